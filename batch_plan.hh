@@ -0,0 +1,113 @@
+#ifndef BATCH_PLAN_HH
+#define BATCH_PLAN_HH
+
+#include <vector>
+#include <algorithm>
+
+#include "graph_arena.hh"
+
+// limits of one batch, 0 means no limit. a graph that alone exceeds the
+// node or edge budget still gets a batch of its own
+struct BatchBudget {
+    int max_graphs = 64;
+    int max_nodes = 0;
+    int max_edges = 0;      // adjacency entries, as in GraphArena::get_edge_sum
+    bool sort_by_size = false;
+};
+
+// the graphs of an arena packed into batches. batch b holds the graph
+// indices get_batch(b)[0 .. get_batch_size(b)), so a prediction can be
+// written back at its graph index whatever the order of the batches.
+// without sort_by_size the graphs keep the input order, with it they are
+// taken largest first, which keeps similar sizes together and starts the
+// slow batches first on the thread pool
+class BatchPlan {
+private:
+    std::vector<int> order_;
+    std::vector<int> offsets_;
+    std::vector<int> node_sums_;
+
+public:
+    BatchPlan();
+    void plan(const GraphArena &arena, const BatchBudget &budget);
+
+    int get_batch_sum() const;
+    int get_batch_size(int b) const;
+    int get_node_sum(int b) const;
+    int get_max_node_sum() const;
+    const int* get_batch(int b) const;
+};
+
+
+BatchPlan::BatchPlan() {
+    offsets_.assign(1, 0);
+}
+
+
+// greedy packing: a batch is closed when the next graph would break one of
+// the budgets
+void BatchPlan::plan(const GraphArena &arena, const BatchBudget &budget) {
+    int graph_sum = arena.get_graph_sum();
+    order_.resize(graph_sum);
+    for (int g = 0; g < graph_sum; ++g)
+        order_[g] = g;
+    if (budget.sort_by_size)
+        std::stable_sort(order_.begin(), order_.end(), [&](int a, int b) {
+            return arena.get_node_sum(a) > arena.get_node_sum(b);
+        });
+
+    offsets_.assign(1, 0);
+    node_sums_.clear();
+    int graphs = 0, nodes = 0, edges = 0;
+    for (int i = 0; i < graph_sum; ++i) {
+        int g_nodes = arena.get_node_sum(order_[i]);
+        int g_edges = arena.get_edge_sum(order_[i]);
+        bool full = graphs > 0 && (
+            (budget.max_graphs > 0 && graphs + 1 > budget.max_graphs) ||
+            (budget.max_nodes > 0 && nodes + g_nodes > budget.max_nodes) ||
+            (budget.max_edges > 0 && edges + g_edges > budget.max_edges)
+        );
+        if (full) {
+            offsets_.push_back(i);
+            node_sums_.push_back(nodes);
+            graphs = nodes = edges = 0;
+        }
+        graphs++;
+        nodes += g_nodes;
+        edges += g_edges;
+    }
+    if (graphs > 0) {
+        offsets_.push_back(graph_sum);
+        node_sums_.push_back(nodes);
+    }
+}
+
+
+inline int BatchPlan::get_batch_sum() const {
+    return offsets_.size() - 1;
+}
+
+
+inline int BatchPlan::get_batch_size(int b) const {
+    return offsets_[b+1] - offsets_[b];
+}
+
+
+inline int BatchPlan::get_node_sum(int b) const {
+    return node_sums_[b];
+}
+
+
+inline int BatchPlan::get_max_node_sum() const {
+    int max_node_sum = 0;
+    for (auto n : node_sums_)
+        max_node_sum = std::max(max_node_sum, n);
+    return max_node_sum;
+}
+
+
+inline const int* BatchPlan::get_batch(int b) const {
+    return order_.data() + offsets_[b];
+}
+
+#endif
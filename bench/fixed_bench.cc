@@ -0,0 +1,134 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cmath>
+#include <map>
+
+#include "../models/gemm.hh"
+#include "../models/gemm_fixed.hh"
+#include "../models/graphcnn.hh"
+#include "../graph_arena.hh"
+#include "../util.hh"
+
+// the fixed size kernels of the square hidden linears against gemm, for
+// every specialized dimension and a few batch sizes (c = ReLU(a * W^T + b)),
+// then a whole model with and without them
+// usage: ./fixed_bench [model] [dataset] [min_seconds], from the repo root
+
+
+template <typename F>
+double time_it(F f, double min_seconds) {
+    f();
+    int iters = 0;
+    auto begin = std::chrono::steady_clock::now();
+    double elapsed = 0;
+    do {
+        f();
+        ++iters;
+        elapsed = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - begin
+        ).count();
+    } while (elapsed < min_seconds);
+    return elapsed / iters;
+}
+
+
+// every graph in batches of 64, the predicted class of each
+void predict_all(
+    const GraphCNN &model, const GraphArena &arena, Workspace &ws, std::vector<int> &pred
+) {
+    int graph_sum = arena.get_graph_sum(), dim = model.get_output_dim();
+    pred.resize(graph_sum);
+    std::vector<int> batch;
+    for (int begin_idx = 0; begin_idx < graph_sum; begin_idx += 64) {
+        int size = std::min(64, graph_sum - begin_idx), node_sum = 0;
+        batch.resize(size);
+        for (int j = 0; j < size; ++j) {
+            batch[j] = begin_idx + j;
+            node_sum += arena.get_node_sum(begin_idx + j);
+        }
+        ws.reserve(
+            Workspace::matrix_bytes(size, dim) +
+            model.get_workspace_size(node_sum, arena.get_tag_sum())
+        );
+        MyMatrix output = ws.matrix(size, dim, true);
+        model.forward(arena, batch, output, ws);
+        for (int j = 0; j < size; ++j)
+            pred[begin_idx + j] = output.get_max_idx(1, j);
+        ws.reset();
+    }
+}
+
+
+int main(int argc, char** argv) {
+    std::string model_path = argc > 1 ? argv[1] : "model2.dat";
+    std::string dataset = argc > 2 ? argv[2] : "MUTAG";
+    double min_seconds = argc > 3 ? std::stod(argv[3]) : 0.2;
+    std::mt19937 rng(0);
+    std::uniform_real_distribution<float> dist(-1, 1);
+
+    std::cout << "fixed kernels: " << fixed_linear_kernel(64)->name << ", gemm kernel: "
+              << gemm_kernel().name << std::endl;
+    std::cout << std::left << std::setw(18) << "m x dim" << std::right
+              << std::setw(12) << "gemm ms" << std::setw(12) << "fixed ms"
+              << std::setw(10) << "speedup" << std::setw(12) << "max diff" << std::endl;
+    for (int dim : {32, 64, 128, 256}) {
+        for (int m : {64, 1146, 20000}) {
+            std::vector<float> a(size_t(m) * dim), w(size_t(dim) * dim), bias(dim), wt;
+            std::vector<float> c0(size_t(m) * dim), c1(size_t(m) * dim);
+            for (auto &x : a)
+                x = std::max(0.0f, dist(rng));
+            for (auto &x : w)
+                x = dist(rng) / std::sqrt(float(dim));
+            for (auto &x : bias)
+                x = dist(rng);
+            pack_fixed_weight(w.data(), dim, dim, wt);
+            const FixedLinearKernel &kernel = *fixed_linear_kernel(dim);
+            GemmEpilogue ep = {nullptr, bias.data(), true};
+            double t0 = time_it([&]() {
+                gemm(m, dim, dim, a.data(), dim, w.data(), dim, c0.data(), dim, false, &ep, true);
+            }, min_seconds);
+            double t1 = time_it([&]() {
+                fixed_linear(
+                    kernel, m, a.data(), dim, wt.data(), bias.data(), true, c1.data(), dim
+                );
+            }, min_seconds);
+            float max_diff = 0;
+            for (size_t i = 0; i < c0.size(); ++i)
+                max_diff = std::max(max_diff, std::fabs(c0[i] - c1[i]));
+            std::string dims = std::to_string(m) + "x" + std::to_string(dim);
+            std::cout << std::left << std::setw(18) << dims << std::right << std::fixed
+                      << std::setprecision(3) << std::setw(12) << t0 * 1000
+                      << std::setw(12) << t1 * 1000 << std::setprecision(2)
+                      << std::setw(9) << t0 / t1 << "x" << std::scientific
+                      << std::setprecision(1) << std::setw(12) << max_diff << std::endl;
+        }
+    }
+
+    // the whole model
+    std::map<std::string, std::vector<std::vector<float>> > model_data;
+    load_model_data(model_path, model_data);
+    GraphCNN model(model_data, false, "sum", "sum");
+    GraphArena arena;
+    loadGraphArena(dataset, false, arena, 1, true);
+    Workspace ws;
+    std::vector<int> pred[2];
+    double t[2];
+    for (int r = 0; r < 2; ++r) {
+        model.specialize_kernels(r == 1);
+        t[r] = time_it([&]() {
+            predict_all(model, arena, ws, pred[r]);
+        }, min_seconds);
+    }
+    int agree = 0;
+    for (int g = 0; g < arena.get_graph_sum(); ++g)
+        agree += pred[0][g] == pred[1][g];
+    std::cout << model_path << " on " << dataset << ": gemm " << std::fixed
+              << std::setprecision(3) << t[0] * 1000 << " ms, fixed "
+              << t[1] * 1000 << " ms (" << std::setprecision(2) << t[0] / t[1]
+              << "x), same prediction on " << agree << "/" << arena.get_graph_sum()
+              << " graphs" << std::endl;
+    return 0;
+}
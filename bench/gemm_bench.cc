@@ -0,0 +1,104 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cmath>
+
+#include "../models/gemm.hh"
+
+// GFLOP/s of the blocked gemm against the textbook i-j-k loop that
+// MyMatrix::mult used to run (including its temporary and copy back)
+// usage: ./gemm_bench [min_seconds]
+
+
+// trans_b: b is n x k (a linear weight)
+void naive_mult(
+    int m, int n, int k, const float *a, const float *b, bool trans_b, float *c
+) {
+    std::vector<float> re(size_t(m) * n);
+    for (int i = 0; i < m; ++i)
+        for (int j = 0; j < n; ++j) {
+            float s = 0;
+            for (int p = 0; p < k; ++p)
+                s += a[size_t(i)*k + p] * (trans_b ? b[size_t(j)*k + p] : b[size_t(p)*n + j]);
+            re[size_t(i)*n + j] = s;
+        }
+    for (size_t i = 0; i < re.size(); ++i)
+        c[i] = re[i];
+}
+
+
+template <typename F>
+double time_it(F f, double min_seconds) {
+    f();
+    int iters = 0;
+    auto begin = std::chrono::steady_clock::now();
+    double elapsed = 0;
+    do {
+        f();
+        ++iters;
+        elapsed = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - begin
+        ).count();
+    } while (elapsed < min_seconds);
+    return elapsed / iters;
+}
+
+
+int main(int argc, char** argv) {
+    double min_seconds = argc > 1 ? std::stod(argv[1]) : 0.2;
+    // (m, n, k) of the products one forward pass on a MUTAG batch of 64
+    // graphs (1146 nodes) runs, plus a large PROTEINS-sized batch. the
+    // linear layers multiply node-major activations by the transposed weight
+    struct Shape { const char *name; int m, n, k; bool trans_b; };
+    std::vector<Shape> shapes = {
+        {"linear in->hidden", 1146, 64, 7, true},
+        {"linear hidden->hidden", 1146, 64, 64, true},
+        {"graph pool readout", 64, 64, 1146, false},
+        {"prediction head", 64, 2, 64, true},
+        {"large batch hidden", 20000, 64, 64, true},
+        {"square 512", 512, 512, 512, false},
+    };
+    std::mt19937 rng(0);
+    std::uniform_real_distribution<float> dist(-1, 1);
+
+    std::cout << "gemm kernel: " << gemm_kernel().name << std::endl;
+    std::cout << std::left << std::setw(24) << "shape"
+              << std::setw(18) << "m x n x k"
+              << std::right << std::setw(12) << "naive GF/s"
+              << std::setw(12) << "gemm GF/s"
+              << std::setw(10) << "speedup"
+              << std::setw(12) << "max diff" << std::endl;
+    for (const auto &s : shapes) {
+        std::vector<float> a(size_t(s.m) * s.k), b(size_t(s.k) * s.n);
+        std::vector<float> c0(size_t(s.m) * s.n), c1(size_t(s.m) * s.n);
+        for (auto &x : a)
+            x = dist(rng);
+        for (auto &x : b)
+            x = dist(rng);
+        double flops = 2.0 * s.m * s.n * s.k;
+        double t0 = time_it([&]() {
+            naive_mult(s.m, s.n, s.k, a.data(), b.data(), s.trans_b, c0.data());
+        }, min_seconds);
+        double t1 = time_it([&]() {
+            gemm(
+                s.m, s.n, s.k, a.data(), s.k, b.data(), s.trans_b ? s.k : s.n,
+                c1.data(), s.n, false, nullptr, s.trans_b
+            );
+        }, min_seconds);
+        float diff = 0;
+        for (size_t i = 0; i < c0.size(); ++i)
+            diff = std::max(diff, std::fabs(c0[i] - c1[i]));
+        std::string dims = std::to_string(s.m) + "x" + std::to_string(s.n)
+                         + "x" + std::to_string(s.k);
+        std::cout << std::left << std::setw(24) << s.name
+                  << std::setw(18) << dims << std::right << std::fixed
+                  << std::setprecision(2) << std::setw(12) << flops / t0 * 1e-9
+                  << std::setw(12) << flops / t1 * 1e-9
+                  << std::setw(9) << t0 / t1 << "x"
+                  << std::scientific << std::setprecision(1)
+                  << std::setw(12) << diff << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,166 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cmath>
+#include <map>
+
+#include "../models/gemm.hh"
+#include "../models/gemm_int8.hh"
+#include "../models/graphcnn.hh"
+#include "../graph_arena.hh"
+#include "../util.hh"
+
+// int8 against fp32: the hidden linear alone (gemm + bias + ReLU), then a
+// whole model calibrated on every 5th graph of a dataset and run on all of
+// them, with the accuracy, the agreement of the predictions and the time
+// of both. needs a text model with batch norm statistics (model2.dat)
+// usage: ./int8_bench [model] [dataset] [min_seconds], from the repo root
+
+
+template <typename F>
+double time_it(F f, double min_seconds) {
+    f();
+    int iters = 0;
+    auto begin = std::chrono::steady_clock::now();
+    double elapsed = 0;
+    do {
+        f();
+        ++iters;
+        elapsed = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - begin
+        ).count();
+    } while (elapsed < min_seconds);
+    return elapsed / iters;
+}
+
+
+// logits of every graph, batches of 64
+void predict_all(
+    const GraphCNN &model, const GraphArena &arena, Workspace &ws, std::vector<float> &logits
+) {
+    int graph_sum = arena.get_graph_sum(), dim = model.get_output_dim();
+    logits.resize(size_t(graph_sum) * dim);
+    std::vector<int> batch;
+    for (int begin_idx = 0; begin_idx < graph_sum; begin_idx += 64) {
+        int size = std::min(64, graph_sum - begin_idx), node_sum = 0;
+        batch.resize(size);
+        for (int j = 0; j < size; ++j) {
+            batch[j] = begin_idx + j;
+            node_sum += arena.get_node_sum(begin_idx + j);
+        }
+        ws.reserve(
+            Workspace::matrix_bytes(size, dim) +
+            model.get_workspace_size(node_sum, arena.get_tag_sum())
+        );
+        MyMatrix output = ws.matrix(size, dim, true);
+        model.forward(arena, batch, output, ws);
+        for (int j = 0; j < size; ++j)
+            for (int k = 0; k < dim; ++k)
+                logits[size_t(begin_idx + j) * dim + k] = output.get_value(j, k);
+        ws.reset();
+    }
+}
+
+
+int main(int argc, char** argv) {
+    std::string model_path = argc > 1 ? argv[1] : "model2.dat";
+    std::string dataset = argc > 2 ? argv[2] : "MUTAG";
+    double min_seconds = argc > 3 ? std::stod(argv[3]) : 0.2;
+    std::mt19937 rng(0);
+    std::uniform_real_distribution<float> dist(-1, 1);
+
+    // the hidden linear of a large batch: node-major input after a ReLU
+    std::cout << "int8 kernel: " << int8_kernel().name << ", fp32 kernel: "
+              << gemm_kernel().name << std::endl;
+    std::cout << std::left << std::setw(18) << "m x n x k" << std::right
+              << std::setw(12) << "fp32 ms" << std::setw(12) << "int8 ms"
+              << std::setw(10) << "speedup" << std::setw(12) << "rel err" << std::endl;
+    for (int hidden : {32, 64, 128, 256}) {
+        int m = 20000, n = hidden, k = hidden;
+        std::vector<float> a(size_t(m) * k), w(size_t(n) * k), bias(n);
+        std::vector<float> c0(size_t(m) * n), c1(size_t(m) * n);
+        for (auto &x : a)
+            x = std::max(0.0f, dist(rng));
+        for (auto &x : w)
+            x = dist(rng) / std::sqrt(float(k));
+        for (auto &x : bias)
+            x = dist(rng);
+        QuantRange range;
+        range.observe(a.data(), m, k, k);
+        QuantizedWeight qw;
+        quantize_weight(w.data(), n, k, k, range, qw);
+        GemmEpilogue ep = {nullptr, bias.data(), true};
+        double t0 = time_it([&]() {
+            gemm(m, n, k, a.data(), k, w.data(), k, c0.data(), n, false, &ep, true);
+        }, min_seconds);
+        double t1 = time_it([&]() {
+            gemm_int8(m, a.data(), k, qw, bias.data(), true, c1.data(), n);
+        }, min_seconds);
+        double err = 0, norm = 0;
+        for (size_t i = 0; i < c0.size(); ++i) {
+            err += (c0[i] - c1[i]) * (c0[i] - c1[i]);
+            norm += c0[i] * c0[i];
+        }
+        std::string dims = std::to_string(m) + "x" + std::to_string(n) + "x" + std::to_string(k);
+        std::cout << std::left << std::setw(18) << dims << std::right << std::fixed
+                  << std::setprecision(3) << std::setw(12) << t0 * 1000
+                  << std::setw(12) << t1 * 1000 << std::setprecision(2)
+                  << std::setw(9) << t0 / t1 << "x" << std::scientific
+                  << std::setprecision(1) << std::setw(12) << std::sqrt(err / norm)
+                  << std::endl;
+    }
+
+    // the whole model
+    std::map<std::string, std::vector<std::vector<float>> > model_data;
+    load_model_data(model_path, model_data);
+    GraphCNN model(model_data, false, "sum", "sum");
+    GraphArena arena;
+    loadGraphArena(dataset, false, arena, 1, true);
+    Workspace ws;
+    std::vector<float> fp32_logits, int8_logits;
+    double t_fp32 = time_it([&]() {
+        predict_all(model, arena, ws, fp32_logits);
+    }, min_seconds);
+
+    std::vector<int> calib_graphs;
+    for (int g = 0; g < arena.get_graph_sum(); g += 5)
+        calib_graphs.push_back(g);
+    std::map<std::string, QuantRange> ranges;
+    model.calibrate(arena, calib_graphs, ranges);
+    model.quantize(ranges);
+    double t_int8 = time_it([&]() {
+        predict_all(model, arena, ws, int8_logits);
+    }, min_seconds);
+
+    int dim = model.get_output_dim(), graph_sum = arena.get_graph_sum();
+    int correct[2] = {0, 0}, agree = 0;
+    float max_diff = 0;
+    for (int g = 0; g < graph_sum; ++g) {
+        int pred[2] = {0, 0};
+        const float *l[2] = {&fp32_logits[size_t(g) * dim], &int8_logits[size_t(g) * dim]};
+        for (int r = 0; r < 2; ++r) {
+            for (int k = 1; k < dim; ++k)
+                if (l[r][k] > l[r][pred[r]])
+                    pred[r] = k;
+            correct[r] += pred[r] == arena.get_label(g);
+        }
+        agree += pred[0] == pred[1];
+        for (int k = 0; k < dim; ++k)
+            max_diff = std::max(max_diff, std::fabs(l[0][k] - l[1][k]));
+    }
+    std::cout << model_path << " on " << dataset << " (" << ranges.size()
+              << " linears in int8, calibrated on " << calib_graphs.size() << " graphs)" << std::endl;
+    std::cout << std::fixed << std::setprecision(6)
+              << "fp32 accuracy " << correct[0] / float(graph_sum)
+              << ", time " << std::setprecision(3) << t_fp32 * 1000 << " ms" << std::endl;
+    std::cout << std::setprecision(6)
+              << "int8 accuracy " << correct[1] / float(graph_sum)
+              << ", time " << std::setprecision(3) << t_int8 * 1000 << " ms ("
+              << std::setprecision(2) << t_fp32 / t_int8 << "x)" << std::endl;
+    std::cout << "same prediction on " << agree << "/" << graph_sum
+              << " graphs, max logit diff " << std::scientific << std::setprecision(1)
+              << max_diff << std::endl;
+    return 0;
+}
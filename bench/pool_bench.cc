@@ -0,0 +1,166 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cmath>
+
+#include "../models/my_matrix.hh"
+#include "../models/sparse_matrix.hh"
+#include "../graph_arena.hh"
+#include "../util.hh"
+
+// neighbor pooling over the batches of a dataset: the sum pooling (CSR x
+// dense product), the gather-max kernel on the same CSR pattern and the
+// per-node vector max pooling GraphCNN used to run
+// usage: ./pool_bench [dataset] [hidden] [min_seconds], from the repo root
+
+
+template <typename F>
+double time_it(F f, double min_seconds) {
+    f();
+    int iters = 0;
+    auto begin = std::chrono::steady_clock::now();
+    double elapsed = 0;
+    do {
+        f();
+        ++iters;
+        elapsed = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - begin
+        ).count();
+    } while (elapsed < min_seconds);
+    return elapsed / iters;
+}
+
+
+// the old max pooling: a padded neighbor list per node, a copy of h with
+// one extra row of column minima, then the max over the list
+void vector_maxpool(
+    const GraphArena &arena, int g_begin, int g_end, const MyMatrix &h, MyMatrix &pooled
+) {
+    int max_degree = 0;
+    for (int g = g_begin; g < g_end; ++g)
+        max_degree = std::max(max_degree, arena.get_max_degree(g));
+    int node_sum = h.get_col_width(), n = h.get_row_width();
+    std::vector<std::vector<int>> padded(node_sum);
+    int begin_idx = 0;
+    for (int g = g_begin; g < g_end; ++g) {
+        int node_begin = arena.get_node_begin(g);
+        for (int i = 0; i < arena.get_node_sum(g); ++i) {
+            std::vector<int> &list = padded[begin_idx + i];
+            const int *neighbors = arena.get_neighbors(node_begin + i);
+            for (int e = 0; e < arena.get_degree(node_begin + i); ++e)
+                list.push_back(neighbors[e] + begin_idx);
+            list.push_back(begin_idx + i);
+            list.resize(max_degree + 1, node_sum);
+        }
+        begin_idx += arena.get_node_sum(g);
+    }
+    std::vector<float> dummy(size_t(node_sum + 1) * n);
+    for (int i = 0; i < node_sum; ++i)
+        for (int k = 0; k < n; ++k)
+            dummy[size_t(i)*n + k] = h.get_value(i, k);
+    for (int k = 0; k < n; ++k) {
+        float m = dummy[k];
+        for (int i = 1; i < node_sum; ++i)
+            m = std::min(m, dummy[size_t(i)*n + k]);
+        dummy[size_t(node_sum)*n + k] = m;
+    }
+    for (int i = 0; i < node_sum; ++i)
+        for (int k = 0; k < n; ++k) {
+            float m = dummy[size_t(padded[i][0])*n + k];
+            for (auto j : padded[i])
+                m = std::max(m, dummy[size_t(j)*n + k]);
+            pooled.set_value(m, i, k);
+        }
+}
+
+
+int main(int argc, char** argv) {
+    std::string dataset = argc > 1 ? argv[1] : "PROTEINS";
+    int hidden = argc > 2 ? std::stoi(argv[2]) : 64;
+    double min_seconds = argc > 3 ? std::stod(argv[3]) : 0.2;
+    int batch_size = 64;
+
+    GraphArena arena;
+    loadGraphArena(dataset, false, arena, 1, true);
+    std::mt19937 rng(0);
+    std::uniform_real_distribution<float> dist(-1, 1);
+
+    // one CSR block and one random h per batch, the self loop in place
+    struct Batch { SparseMatrix adj; MyMatrix h, sum, max, old_max; };
+    std::vector<Batch*> batches;
+    long long node_sum = 0, nnz = 0;
+    for (int b = 0; b < arena.get_graph_sum(); b += batch_size) {
+        int b_end = std::min(b + batch_size, arena.get_graph_sum());
+        int n = arena.get_node_begin(b_end - 1) + arena.get_node_sum(b_end - 1) - arena.get_node_begin(b);
+        Batch *batch = new Batch{
+            SparseMatrix(n, n), MyMatrix(n, hidden), MyMatrix(n, hidden),
+            MyMatrix(n, hidden), MyMatrix(n, hidden)
+        };
+        int begin_idx = 0;
+        for (int g = b; g < b_end; ++g) {
+            int node_begin = arena.get_node_begin(g);
+            for (int i = 0; i < arena.get_node_sum(g); ++i) {
+                const int *neighbors = arena.get_neighbors(node_begin + i);
+                int e = 0, degree = arena.get_degree(node_begin + i);
+                while (e < degree && neighbors[e] < i)
+                    batch->adj.push(neighbors[e++] + begin_idx, 1);
+                batch->adj.push(i + begin_idx, 1);
+                while (e < degree)
+                    batch->adj.push(neighbors[e++] + begin_idx, 1);
+                batch->adj.end_row();
+            }
+            begin_idx += arena.get_node_sum(g);
+        }
+        for (int i = 0; i < n; ++i)
+            for (int k = 0; k < hidden; ++k)
+                batch->h.set_value(dist(rng), i, k);
+        node_sum += n;
+        nnz += batch->adj.get_nnz();
+        batches.push_back(batch);
+    }
+
+    double t_sum = time_it([&]() {
+        for (auto b : batches)
+            b->adj.mult(b->h, b->sum);
+    }, min_seconds);
+    double t_max = time_it([&]() {
+        for (auto b : batches)
+            b->adj.gather_max(b->h, b->max);
+    }, min_seconds);
+    double t_old = time_it([&]() {
+        for (int i = 0; i < batches.size(); ++i)
+            vector_maxpool(
+                arena, i * batch_size, std::min((i + 1) * batch_size, arena.get_graph_sum()),
+                batches[i]->h, batches[i]->old_max
+            );
+    }, min_seconds);
+    float diff = 0;
+    for (auto b : batches)
+        for (int i = 0; i < b->h.get_col_width(); ++i)
+            for (int k = 0; k < hidden; ++k)
+                diff = std::max(diff, std::fabs(b->max.get_value(i, k) - b->old_max.get_value(i, k)));
+
+    // every pooling reads nnz rows of h and writes node_sum rows
+    double bytes = double(nnz + node_sum) * hidden * sizeof(float);
+    std::cout << dataset << ": " << batches.size() << " batches, " << node_sum
+              << " nodes, " << nnz << " entries, hidden " << hidden << std::endl;
+    std::cout << std::left << std::setw(20) << "pooling" << std::right
+              << std::setw(12) << "ms/pass" << std::setw(12) << "GB/s"
+              << std::setw(10) << "vs sum" << std::endl;
+    auto row = [&](const char *name, double t) {
+        std::cout << std::left << std::setw(20) << name << std::right << std::fixed
+                  << std::setprecision(3) << std::setw(12) << t * 1000
+                  << std::setprecision(2) << std::setw(12) << bytes / t * 1e-9
+                  << std::setw(9) << t / t_sum << "x" << std::endl;
+    };
+    row("sum (spmm)", t_sum);
+    row("max (gather_max)", t_max);
+    row("max (vector, old)", t_old);
+    std::cout << "max diff gather_max vs old: " << std::scientific
+              << std::setprecision(1) << diff << std::endl;
+    for (auto b : batches)
+        delete b;
+    return 0;
+}
@@ -0,0 +1,547 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <random>
+#include <chrono>
+#include <atomic>
+#include <cstdlib>
+#include <cerrno>
+#include <algorithm>
+#include <new>
+#include <sys/stat.h>
+
+#include "../models/my_matrix.hh"
+#include "../models/sparse_matrix.hh"
+#include "../models/linear.hh"
+#include "../models/batchnorm.hh"
+#include "../models/mlp.hh"
+#include "../models/graphcnn.hh"
+#include "../models/perf_counters.hh"
+#include "../graph_arena.hh"
+#include "../batch_plan.hh"
+#include "../util.hh"
+
+// every kernel of the forward pass and the whole forward pass, in one run:
+//   mult, transpose, activation   MyMatrix on the activations of a MUTAG
+//                                 batch of 64 graphs (1146 nodes x 64)
+//   linear, batchnorm, mlp        the same batch through one layer
+//   per dataset                   the data loaders, the sum and max
+//                                 neighbor pooling of every batch and
+//                                 GraphCNN::forward over the whole dataset,
+//                                 with a random model of the dataset's size
+//                                 (hidden 64, 5 layers, mlps of 2 layers)
+// each case reports ns/op, GFLOP/s (when the flops are well defined),
+// graphs/s (for the cases that go over a dataset) and the bytes and blocks
+// allocated per op once warm, counted by the allocators below. with
+// --counters the hardware counters of the timed calls are added per op
+// (cycles, instructions, LLC and branch misses, see perf_counters.hh), or
+// reported missing where perf_event_open does not give them. --json
+// writes the same numbers to a file to track regressions
+// usage: ./suite_bench [--json FILE] [--filter TEXT] [--min-seconds S]
+//        [--counters] [--dataset NAME]..., from the repo root
+
+
+static std::atomic<size_t> alloc_bytes(0), alloc_blocks(0);
+
+// every heap block is counted where the C library hands it out: malloc,
+// calloc and the aligned allocators (std::aligned_alloc is what MyMatrix,
+// Workspace and the model image use), forwarded to the glibc internals.
+// the operator new forms below all come down to malloc or aligned_alloc
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_memalign(size_t align, size_t size);
+
+static inline void count_alloc(size_t size) {
+    alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+    alloc_blocks.fetch_add(1, std::memory_order_relaxed);
+}
+
+void* malloc(size_t size) noexcept {
+    count_alloc(size);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) noexcept {
+    count_alloc(n * size);
+    return __libc_calloc(n, size);
+}
+
+void* aligned_alloc(size_t align, size_t size) noexcept {
+    count_alloc(size);
+    return __libc_memalign(align, size);
+}
+
+void* memalign(size_t align, size_t size) noexcept {
+    count_alloc(size);
+    return __libc_memalign(align, size);
+}
+
+int posix_memalign(void **p, size_t align, size_t size) noexcept {
+    count_alloc(size);
+    *p = __libc_memalign(align, size);
+    return *p != nullptr ? 0 : ENOMEM;
+}
+}
+
+
+static void* new_block(size_t size) {
+    void *p = std::malloc(size ? size : 1);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+
+static void* new_block(size_t size, std::align_val_t align) {
+    size_t a = std::max(size_t(align), sizeof(void*));
+    void *p = std::aligned_alloc(a, (std::max(size, size_t(1)) + a - 1) / a * a);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new(size_t size) { return new_block(size); }
+void* operator new[](size_t size) { return new_block(size); }
+void* operator new(size_t size, std::align_val_t align) { return new_block(size, align); }
+void* operator new[](size_t size, std::align_val_t align) { return new_block(size, align); }
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+void operator delete[](void *p, size_t) noexcept { std::free(p); }
+void operator delete(void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void *p, size_t, std::align_val_t) noexcept { std::free(p); }
+
+
+struct BenchResult {
+    std::string name, params;
+    int iters;
+    double ns_per_op, gflops, graphs_per_s, bytes_per_op, allocs_per_op;
+    // per op, -1 when the counter is missing
+    double counters[PERF_COUNTER_SUM];
+};
+
+
+class Suite {
+private:
+    std::string filter_;
+    double min_seconds_;
+    bool counters_;
+    std::vector<BenchResult> results_;
+
+public:
+    Suite(const std::string &filter, double min_seconds, bool counters);
+    void print_header() const;
+    bool enabled(const std::string &name) const;
+    // flops and graphs are per op, 0 when they do not apply
+    template <typename F>
+    void run(const std::string &name, const std::string &params, double flops, int graphs, F f);
+    void save_json(const std::string &path) const;
+};
+
+
+Suite::Suite(const std::string &filter, double min_seconds, bool counters) {
+    filter_ = filter;
+    min_seconds_ = min_seconds;
+    // opened here, so that the cases do not count its allocations
+    counters_ = counters;
+    if (counters_ && !PerfCounters::thread().get_error().empty())
+        std::cout << "hardware counters: "
+                  << (PerfCounters::thread().available() ? "some missing" : "unavailable")
+                  << " (" << PerfCounters::thread().get_error() << ")" << std::endl;
+}
+
+
+void Suite::print_header() const {
+    std::cout << std::left << std::setw(22) << "name" << std::setw(26) << "params"
+              << std::right << std::setw(14) << "ns/op" << std::setw(10) << "GFLOP/s"
+              << std::setw(12) << "graphs/s" << std::setw(12) << "bytes/op"
+              << std::setw(10) << "allocs";
+    if (counters_)
+        std::cout << std::setw(8) << "IPC" << std::setw(12) << "LLC miss/op"
+                  << std::setw(12) << "br miss/op";
+    std::cout << std::endl;
+}
+
+
+inline bool Suite::enabled(const std::string &name) const {
+    return filter_.empty() || name.find(filter_) != std::string::npos;
+}
+
+
+// one call to warm up, then calls until min_seconds have passed. the
+// loaders print, so std::cout is muted meanwhile
+template <typename F>
+void Suite::run(const std::string &name, const std::string &params, double flops, int graphs, F f) {
+    if (!enabled(name))
+        return;
+    std::streambuf *out = std::cout.rdbuf(nullptr);
+    f();
+    size_t bytes = alloc_bytes, blocks = alloc_blocks;
+    PerfSample counters_begin, counters_end;
+    if (counters_)
+        PerfCounters::thread().read(counters_begin);
+    int iters = 0;
+    auto begin = std::chrono::steady_clock::now();
+    double elapsed = 0;
+    do {
+        f();
+        ++iters;
+        elapsed = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - begin
+        ).count();
+    } while (elapsed < min_seconds_);
+    if (counters_)
+        PerfCounters::thread().read(counters_end);
+    bytes = alloc_bytes - bytes;
+    blocks = alloc_blocks - blocks;
+    std::cout.rdbuf(out);
+    std::cout.clear();
+
+    BenchResult r;
+    r.name = name;
+    r.params = params;
+    r.iters = iters;
+    r.ns_per_op = elapsed / iters * 1e9;
+    r.gflops = flops / r.ns_per_op;
+    r.graphs_per_s = graphs / (elapsed / iters);
+    r.bytes_per_op = double(bytes) / iters;
+    r.allocs_per_op = double(blocks) / iters;
+    for (int c = 0; c < PERF_COUNTER_SUM; ++c)
+        r.counters[c] = counters_ && PerfCounters::thread().has(c) ?
+            double(counters_end.value[c] - counters_begin.value[c]) / iters : -1;
+    results_.push_back(r);
+    std::cout << std::left << std::setw(22) << r.name << std::setw(26) << r.params
+              << std::right << std::fixed << std::setprecision(0)
+              << std::setw(14) << r.ns_per_op << std::setprecision(2);
+    if (flops > 0)
+        std::cout << std::setw(10) << r.gflops;
+    else
+        std::cout << std::setw(10) << "-";
+    if (graphs > 0)
+        std::cout << std::setprecision(0) << std::setw(12) << r.graphs_per_s;
+    else
+        std::cout << std::setw(12) << "-";
+    std::cout << std::setprecision(0) << std::setw(12) << r.bytes_per_op
+              << std::setprecision(1) << std::setw(10) << r.allocs_per_op;
+    if (counters_) {
+        const double *c = r.counters;
+        if (c[PERF_CYCLES] > 0 && c[PERF_INSTRUCTIONS] >= 0)
+            std::cout << std::setprecision(2) << std::setw(8) << c[PERF_INSTRUCTIONS] / c[PERF_CYCLES];
+        else
+            std::cout << std::setw(8) << "-";
+        for (int k : {PERF_LLC_MISSES, PERF_BRANCH_MISSES}) {
+            if (c[k] >= 0)
+                std::cout << std::setprecision(0) << std::setw(12) << c[k];
+            else
+                std::cout << std::setw(12) << "-";
+        }
+    }
+    std::cout << std::endl;
+}
+
+
+void Suite::save_json(const std::string &path) const {
+    std::ofstream out(path);
+    out << "{\n  \"gemm_kernel\": \"" << gemm_kernel().name << "\",\n"
+        << "  \"min_seconds\": " << min_seconds_ << ",\n";
+    if (counters_)
+        out << "  \"counters_error\": \"" << PerfCounters::thread().get_error() << "\",\n";
+    out << "  \"results\": [\n";
+    out << std::setprecision(10);
+    for (size_t i = 0; i < results_.size(); ++i) {
+        const BenchResult &r = results_[i];
+        out << "    {\"name\": \"" << r.name << "\", \"params\": \"" << r.params
+            << "\", \"iters\": " << r.iters << ", \"ns_per_op\": " << r.ns_per_op
+            << ", \"gflops\": " << r.gflops << ", \"graphs_per_s\": " << r.graphs_per_s
+            << ", \"bytes_per_op\": " << r.bytes_per_op
+            << ", \"allocs_per_op\": " << r.allocs_per_op;
+        if (counters_) {
+            for (int c = 0; c < PERF_COUNTER_SUM; ++c) {
+                out << ", \"" << PerfCounters::get_name(c) << "_per_op\": ";
+                if (r.counters[c] >= 0)
+                    out << r.counters[c];
+                else
+                    out << "null";
+            }
+        }
+        out << "}" << (i + 1 < results_.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+}
+
+
+void random_matrix(MyMatrix &m, std::mt19937 &rng, float lo = -1, float hi = 1) {
+    std::uniform_real_distribution<float> dist(lo, hi);
+    for (int i = 0; i < m.get_col_width(); ++i)
+        for (int j = 0; j < m.get_row_width(); ++j)
+            m.set_value(dist(rng), i, j);
+}
+
+
+void random_rows(
+    int rows, int cols, std::mt19937 &rng, std::vector<std::vector<float>> &data,
+    float lo = -1, float hi = 1
+) {
+    std::uniform_real_distribution<float> dist(lo, hi);
+    for (int i = 0; i < rows; ++i) {
+        data.push_back(std::vector<float>(cols));
+        for (auto &x : data.back())
+            x = dist(rng);
+    }
+}
+
+
+// a batch norm in the text layout: gamma, beta, running mean, running var
+void random_batchnorm(int dim, std::mt19937 &rng, std::vector<std::vector<float>> &data) {
+    random_rows(1, dim, rng, data, 0.5, 1.5);
+    random_rows(1, dim, rng, data, -0.5, 0.5);
+    random_rows(1, dim, rng, data, -0.5, 0.5);
+    random_rows(1, dim, rng, data, 0.5, 2);
+}
+
+
+// the tensors of a trained GraphCNN, random, under the names of the text
+// models (see model2.dat)
+void random_model(
+    int input_dim, int hidden_dim, int output_dim, int num_layers, int mlp_layers,
+    std::mt19937 &rng, ModelFile::TextModel &model
+) {
+    model.clear();
+    random_rows(1, num_layers - 1, rng, model["eps"], 0, 0.1);
+    auto add_linear = [&](const std::string &tag, int in_dim, int out_dim) {
+        float bound = 1 / std::sqrt(float(in_dim));
+        random_rows(out_dim, in_dim, rng, model[tag + ".weight"], -bound, bound);
+        random_rows(1, out_dim, rng, model[tag + ".bias"], -bound, bound);
+    };
+    auto add_batchnorm = [&](const std::string &tag, int dim) {
+        std::vector<std::vector<float>> rows;
+        random_batchnorm(dim, rng, rows);
+        const char *names[4] = {".weight", ".bias", ".running_mean", ".running_var"};
+        for (int t = 0; t < 4; ++t)
+            model[tag + names[t]].assign(1, rows[t]);
+    };
+    for (int i = 0; i < num_layers - 1; ++i) {
+        std::string tag = "mlps." + std::to_string(i) + ".";
+        for (int j = 0; j < mlp_layers; ++j)
+            add_linear(tag + "linears." + std::to_string(j), i == 0 && j == 0 ? input_dim : hidden_dim, hidden_dim);
+        for (int j = 0; j < mlp_layers - 1; ++j)
+            add_batchnorm(tag + "batch_norms." + std::to_string(j), hidden_dim);
+        add_batchnorm("batch_norms." + std::to_string(i), hidden_dim);
+    }
+    for (int i = 0; i < num_layers; ++i)
+        add_linear("linears_prediction." + std::to_string(i), i == 0 ? input_dim : hidden_dim, output_dim);
+}
+
+
+// the MyMatrix, Linear, BatchNorm and MLP kernels on one MUTAG-sized batch
+void bench_kernels(Suite &suite) {
+    const int nodes = 1146, hidden = 64, input_dim = 7;
+    std::mt19937 rng(0);
+    std::string shape = std::to_string(nodes) + "x" + std::to_string(hidden);
+    MyMatrix x(nodes, hidden), y(nodes, hidden), w(hidden, hidden), xt(hidden, nodes);
+    MyMatrix x_in(nodes, input_dim);
+    random_matrix(x, rng);
+    random_matrix(w, rng);
+    random_matrix(x_in, rng, 0, 1);
+
+    suite.run("mult", shape + "x" + std::to_string(hidden), 2.0 * nodes * hidden * hidden, 0, [&]() {
+        y.mult(x, w);
+    });
+    suite.run("transpose", shape, 0, 0, [&]() {
+        xt.transpose(x);
+    });
+    suite.run("activation_relu", shape, 0, 0, [&]() {
+        y.activation(x, "ReLU");
+    });
+    suite.run("activation_sigmoid", shape, 0, 0, [&]() {
+        y.activation(x, "sigmoid");
+    });
+
+    std::vector<std::vector<float>> wdata, bdata, in_wdata, bn_data;
+    random_rows(hidden, hidden, rng, wdata, -0.125, 0.125);
+    random_rows(1, hidden, rng, bdata);
+    random_rows(hidden, input_dim, rng, in_wdata);
+    random_batchnorm(hidden, rng, bn_data);
+    Linear linear(hidden, hidden, wdata, bdata[0]);
+    Linear in_linear(input_dim, hidden, in_wdata, bdata[0]);
+    double linear_flops = 2.0 * nodes * hidden * hidden;
+    suite.run("linear_forward", shape + "x" + std::to_string(hidden) + " gemm", linear_flops, 0, [&]() {
+        linear.forward(x, y, true);
+    });
+    linear.specialize(true);
+    if (linear.get_fixed_kernel() != nullptr)
+        suite.run("linear_forward", shape + "x" + std::to_string(hidden) + " fixed", linear_flops, 0, [&]() {
+            linear.forward(x, y, true);
+        });
+    suite.run("linear_forward", shape + "x" + std::to_string(input_dim), 2.0 * nodes * input_dim * hidden, 0, [&]() {
+        in_linear.forward(x_in, y);
+    });
+    BatchNorm bn(hidden, bn_data[0], bn_data[1], bn_data[2], bn_data[3]);
+    suite.run("batchnorm_forward", shape, 2.0 * nodes * hidden, 0, [&]() {
+        bn.forward(x, y);
+    });
+
+    // mlps.1 of model2.dat: linear, batch norm, ReLU, linear
+    std::vector<std::vector<float>> mlp_data;
+    random_rows(hidden, hidden, rng, mlp_data, -0.125, 0.125);
+    random_rows(1, hidden, rng, mlp_data);
+    random_rows(hidden, hidden, rng, mlp_data, -0.125, 0.125);
+    random_rows(1, hidden, rng, mlp_data);
+    random_batchnorm(hidden, rng, mlp_data);
+    MLP mlp(hidden, hidden, hidden, 2, mlp_data);
+    Workspace ws(mlp.get_workspace_size(nodes));
+    double mlp_flops = 2 * linear_flops;
+    suite.run("mlp_forward", shape + " 2 layers", mlp_flops, 0, [&]() {
+        mlp.forward(x, y, ws);
+    });
+    BatchNorm output_bn(hidden, bn_data[0], bn_data[1], bn_data[2], bn_data[3]);
+    mlp.fold_batchnorms(&output_bn);
+    suite.run("mlp_forward", shape + " 2 layers folded", mlp_flops, 0, [&]() {
+        mlp.forward(x, y, ws);
+    });
+}
+
+
+// the loaders, the neighbor pooling and the forward pass over one dataset
+void bench_dataset(Suite &suite, const std::string &dataset) {
+    std::streambuf *out = std::cout.rdbuf(nullptr);
+    GraphArena arena;
+    loadGraphArena(dataset, false, arena, 1, true);
+    std::cout.rdbuf(out);
+    std::cout.clear();
+    int graph_sum = arena.get_graph_sum();
+
+    suite.run("loadData", dataset, 0, graph_sum, [&]() {
+        std::vector<S2VGraph*> graphs;
+        int label_sum, tag_sum;
+        loadData(dataset, false, graphs, label_sum, tag_sum);
+        for (auto g : graphs)
+            delete g;
+    });
+    suite.run("loadGraphArena", dataset + " text", 0, graph_sum, [&]() {
+        GraphArena a;
+        loadGraphArena(dataset, false, a, 1, false);
+    });
+    suite.run("loadGraphArena", dataset + " cache", 0, graph_sum, [&]() {
+        GraphArena a;
+        loadGraphArena(dataset, false, a, 1, true);
+    });
+
+    const int hidden = 64, num_layers = 5, mlp_layers = 2;
+    BatchPlan plan;
+    plan.plan(arena, BatchBudget());
+    std::mt19937 rng(1);
+    std::vector<int> batch;
+    auto get_batch = [&](int b) {
+        batch.assign(plan.get_batch(b), plan.get_batch(b) + plan.get_batch_size(b));
+    };
+
+    // the pooling of every batch, on the adjacency with the self loops
+    MyMatrix h(plan.get_max_node_sum(), hidden), pooled(plan.get_max_node_sum(), hidden);
+    random_matrix(h, rng);
+    double nnz_sum = 0;
+    std::vector<SparseMatrix> adjacency(plan.get_batch_sum());
+    for (int b = 0; b < plan.get_batch_sum(); ++b) {
+        BatchedGraph graph;
+        get_batch(b);
+        graph.build(arena, batch, true, false, false);
+        adjacency[b] = graph.get_adjacency();
+        nnz_sum += adjacency[b].get_nnz();
+    }
+    auto pool = [&](bool max) {
+        for (int b = 0; b < plan.get_batch_sum(); ++b) {
+            int n = plan.get_node_sum(b);
+            MyMatrix hb(n, hidden, h.get_ld(), h.get_data());
+            MyMatrix pb(n, hidden, pooled.get_ld(), pooled.get_data());
+            if (max)
+                adjacency[b].gather_max(hb, pb);
+            else
+                adjacency[b].mult(hb, pb);
+        }
+    };
+    suite.run("sum_pool", dataset, 2.0 * nnz_sum * hidden, graph_sum, [&]() {
+        pool(false);
+    });
+    suite.run("maxpool", dataset + " gather_max", nnz_sum * hidden, graph_sum, [&]() {
+        pool(true);
+    });
+
+    // the dense products of one forward pass: every mlp linear but the
+    // first one (a gather), plus the sum pooling of every layer
+    ModelFile::TextModel model_data;
+    int output_dim = std::max(2, arena.get_label_sum());
+    random_model(arena.get_tag_sum(), hidden, output_dim, num_layers, mlp_layers, rng, model_data);
+    GraphCNN model(model_data, false, "sum", "sum");
+    double forward_flops = (num_layers - 1) * 2.0 * nnz_sum * hidden;
+    forward_flops += ((num_layers - 1) * mlp_layers - 1) * 2.0 * arena.get_node_sum() * hidden * hidden;
+    Workspace ws;
+    std::vector<int> pred(graph_sum);
+    auto forward_all = [&]() {
+        for (int b = 0; b < plan.get_batch_sum(); ++b) {
+            int size = plan.get_batch_size(b);
+            ws.reserve(
+                Workspace::matrix_bytes(size, output_dim) +
+                model.get_workspace_size(plan.get_node_sum(b), arena.get_tag_sum())
+            );
+            MyMatrix output = ws.matrix(size, output_dim, true);
+            get_batch(b);
+            model.forward(arena, batch, output, ws);
+            for (int j = 0; j < size; ++j)
+                pred[batch[j]] = output.get_max_idx(1, j);
+            ws.reset();
+        }
+    };
+    suite.run("graphcnn_forward", dataset, forward_flops, graph_sum, forward_all);
+    model.specialize_kernels(false);
+    suite.run("graphcnn_forward", dataset + " gemm only", forward_flops, graph_sum, forward_all);
+}
+
+
+int main(int argc, char** argv) {
+    std::string json_path, filter;
+    double min_seconds = 0.2;
+    bool counters = false;
+    std::vector<std::string> datasets;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (arg == "--json" && i+1 < argc)
+            json_path = argv[++i];
+        else if (arg == "--filter" && i+1 < argc)
+            filter = argv[++i];
+        else if (arg == "--min-seconds" && i+1 < argc)
+            min_seconds = std::stod(argv[++i]);
+        else if (arg == "--dataset" && i+1 < argc)
+            datasets.push_back(argv[++i]);
+        else if (arg == "--counters")
+            counters = true;
+        else {
+            std::cerr << "usage: " << argv[0] << " [--json FILE] [--filter TEXT]"
+                      << " [--min-seconds S] [--counters] [--dataset NAME]..." << std::endl;
+            return 1;
+        }
+    }
+    // every dataset of dataset/ that has its text file
+    if (datasets.empty())
+        for (const char *name : {"MUTAG", "PTC", "PROTEINS", "NCI1", "IMDBBINARY",
+                                 "IMDBMULTI", "COLLAB", "REDDITBINARY", "REDDITMULTI5K"}) {
+            struct stat st;
+            std::string path = "dataset/" + std::string(name) + "/" + name + ".txt";
+            if (stat(path.c_str(), &st) == 0)
+                datasets.push_back(name);
+        }
+
+    std::cout << "gemm kernel: " << gemm_kernel().name << std::endl;
+    Suite suite(filter, min_seconds, counters);
+    suite.print_header();
+    bench_kernels(suite);
+    for (auto &dataset : datasets)
+        bench_dataset(suite, dataset);
+    if (!json_path.empty())
+        suite.save_json(json_path);
+    return 0;
+}
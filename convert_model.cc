@@ -0,0 +1,26 @@
+#include <iostream>
+#include <map>
+#include <vector>
+
+#include "models/model_file.hh"
+#include "util.hh"
+
+// convert a text model (.dat) to the binary format that main maps directly
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        std::cerr << "usage: " << argv[0] << " <model.dat> <model.bin>" << std::endl;
+        return 0;
+    }
+    std::map<std::string, std::vector<std::vector<float>> > model_data;
+    load_model_data(argv[1], model_data);
+    if (model_data.empty()) {
+        std::cerr << "convert error: no tensor in " << argv[1] << "!" << std::endl;
+        return 0;
+    }
+    ModelFile *model = ModelFile::from_text(model_data);
+    model->save(argv[2]);
+    std::cout << "wrote " << model->get_tensor_num() << " tensors ("
+              << model->get_size() << " bytes) to " << argv[2] << std::endl;
+    delete model;
+    return 0;
+}
@@ -0,0 +1,461 @@
+#ifndef GRAPH_ARENA_HH
+#define GRAPH_ARENA_HH
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "s2vgraph.hh"
+
+// binary dataset cache (little endian), written next to the text dataset:
+//   header   128 bytes: magic "PGNNDAT", version, the source it was built
+//            from and the sizes of the arrays
+//   data     the six arrays of a GraphArena in the order of the header,
+//            then the raw label of every label and the raw tag of every
+//            tag, each one starting at a 64 byte aligned offset
+// the source key (size, mtime, content hash, degree_as_tag) tells whether
+// the cache still matches its text file
+
+const char DATASET_CACHE_MAGIC[8] = "PGNNDAT";
+const uint32_t DATASET_CACHE_VERSION = 2;
+
+struct DatasetSource {
+    uint64_t size;
+    int64_t mtime;
+    uint64_t hash;
+    int32_t degree_as_tag;
+    char reserved[4];
+};
+
+struct DatasetCacheHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t graph_sum, node_sum, edge_sum, label_sum, tag_sum;
+    DatasetSource source;
+    // 0 when the arena does not know its raw labels and tags
+    int32_t raw_label_sum, raw_tag_sum;
+    char reserved[56];
+};
+
+static_assert(sizeof(DatasetCacheHeader) == 128, "cache header must be 128 bytes");
+
+// every graph of a dataset in a few flat arrays (CSR):
+//   graph g owns the nodes [node_offsets_[g], node_offsets_[g+1])
+//   node v (index over the whole arena) has the neighbors
+//   neighbors_[adj_offsets_[v] .. adj_offsets_[v+1]), numbered inside its
+//   graph and sorted, and the tag tags_[v] in [0, tag_sum)
+// a batch is just a list of graph indices, nothing is allocated per graph.
+// a dataset loaded by loadGraphArena also keeps the value label l and tag t
+// had in the text file (raw_labels_[l], raw_tags_[t]), to number new graphs
+// the same way. the arrays are views, either on the vectors below or on a
+// mapped cache
+class GraphArena {
+private:
+    static const int ARRAY_NUM = 8;
+
+    int graph_sum_, node_sum_, label_sum_, tag_sum_;
+    int raw_label_sum_, raw_tag_sum_;
+    const int *node_offsets_, *labels_, *max_degrees_;
+    const int *adj_offsets_, *neighbors_, *tags_;
+    const int *raw_labels_, *raw_tags_;
+    std::vector<int> node_offsets_data_, labels_data_, max_degrees_data_;
+    std::vector<int> adj_offsets_data_, neighbors_data_, tags_data_;
+    std::vector<int> raw_labels_data_, raw_tags_data_;
+    char *image_;
+    size_t image_size_;
+
+    void unmap();
+    void use_data();
+    void get_arrays(const int *arrays[ARRAY_NUM], size_t sizes[ARRAY_NUM]) const;
+    bool check_arrays() const;
+
+public:
+    GraphArena();
+    GraphArena(const GraphArena&) = delete;
+    GraphArena& operator=(const GraphArena&) = delete;
+    ~GraphArena();
+    void clear();
+    void assign(const std::vector<S2VGraph*> &graphs, int tag_sum);
+    void set_tag_sum(int tag_sum);
+    void append(
+        int label, int node_sum, const int *tags, const int *adj_offsets, const int *neighbors
+    );
+    bool open_cache(const std::string &path, DatasetSource &source);
+    bool save_cache(const std::string &path, const DatasetSource &source) const;
+
+    int get_graph_sum() const;
+    int get_node_sum() const;
+    int get_label_sum() const;
+    int get_tag_sum() const;
+    int get_raw_label_sum() const;
+    int get_raw_tag_sum() const;
+    int get_raw_label(int label) const;
+    int get_raw_tag(int tag) const;
+    int get_node_begin(int g) const;
+    int get_node_sum(int g) const;
+    int get_edge_sum(int g) const;
+    int get_label(int g) const;
+    int get_max_degree(int g) const;
+    int get_tag(int v) const;
+    int get_degree(int v) const;
+    const int* get_neighbors(int v) const;
+
+    friend void loadGraphArena(
+        const std::string& dataset, bool degree_as_tag, GraphArena &arena,
+        int num_threads, bool use_cache
+    );
+};
+
+
+GraphArena::GraphArena() {
+    image_ = nullptr;
+    image_size_ = 0;
+    clear();
+}
+
+
+GraphArena::~GraphArena() {
+    unmap();
+}
+
+
+void GraphArena::unmap() {
+    if (image_ != nullptr)
+        munmap(image_, image_size_);
+    image_ = nullptr;
+    image_size_ = 0;
+}
+
+
+// point the views at the vectors, once they are filled
+void GraphArena::use_data() {
+    unmap();
+    graph_sum_ = labels_data_.size();
+    node_sum_ = tags_data_.size();
+    node_offsets_ = node_offsets_data_.data();
+    labels_ = labels_data_.data();
+    max_degrees_ = max_degrees_data_.data();
+    adj_offsets_ = adj_offsets_data_.data();
+    neighbors_ = neighbors_data_.data();
+    tags_ = tags_data_.data();
+    raw_label_sum_ = raw_labels_data_.size();
+    raw_tag_sum_ = raw_tags_data_.size();
+    raw_labels_ = raw_labels_data_.data();
+    raw_tags_ = raw_tags_data_.data();
+}
+
+
+// drop every graph, the vectors keep their capacity
+void GraphArena::clear() {
+    label_sum_ = tag_sum_ = 0;
+    node_offsets_data_.assign(1, 0);
+    adj_offsets_data_.assign(1, 0);
+    labels_data_.clear();
+    max_degrees_data_.clear();
+    neighbors_data_.clear();
+    tags_data_.clear();
+    raw_labels_data_.clear();
+    raw_tags_data_.clear();
+    use_data();
+}
+
+
+// copy a list of S2VGraph, the tags are the one-hot indices of their node
+// features
+void GraphArena::assign(const std::vector<S2VGraph*> &graphs, int tag_sum) {
+    clear();
+    tag_sum_ = tag_sum;
+    for (auto g : graphs) {
+        int begin = node_offsets_data_.back(), node_sum = g->get_node_sum();
+        node_offsets_data_.push_back(begin + node_sum);
+        labels_data_.push_back(g->get_label());
+        label_sum_ = std::max(label_sum_, g->get_label() + 1);
+        max_degrees_data_.push_back(g->get_max_degree());
+        tags_data_.resize(begin + node_sum, 0);
+        for (const auto &p : g->get_node_features())
+            tags_data_[begin + p.first] = p.second;
+        for (const auto &neighbors : g->get_neighbors()) {
+            neighbors_data_.insert(neighbors_data_.end(), neighbors.begin(), neighbors.end());
+            adj_offsets_data_.push_back(neighbors_data_.size());
+        }
+    }
+    use_data();
+}
+
+
+inline void GraphArena::set_tag_sum(int tag_sum) {
+    tag_sum_ = tag_sum;
+}
+
+
+// add one graph at the end: node v has the tag tags[v] and the neighbors
+// neighbors[adj_offsets[v] .. adj_offsets[v+1]), sorted and numbered
+// inside the graph. the vectors keep their capacity across clear(), so
+// refilling an arena with graphs of the same size does not allocate
+void GraphArena::append(
+    int label, int node_sum, const int *tags, const int *adj_offsets, const int *neighbors
+) {
+    int begin = node_offsets_data_.back(), max_degree = 0;
+    node_offsets_data_.push_back(begin + node_sum);
+    labels_data_.push_back(label);
+    label_sum_ = std::max(label_sum_, label + 1);
+    tags_data_.insert(tags_data_.end(), tags, tags + node_sum);
+    for (int v = 0; v < node_sum; ++v) {
+        max_degree = std::max(max_degree, adj_offsets[v+1] - adj_offsets[v]);
+        adj_offsets_data_.push_back(neighbors_data_.size() + adj_offsets[v+1] - adj_offsets[v]);
+        neighbors_data_.insert(
+            neighbors_data_.end(), neighbors + adj_offsets[v], neighbors + adj_offsets[v+1]
+        );
+    }
+    max_degrees_data_.push_back(max_degree);
+    use_data();
+}
+
+
+// the arrays in file order with their lengths
+void GraphArena::get_arrays(const int *arrays[ARRAY_NUM], size_t sizes[ARRAY_NUM]) const {
+    const int *a[ARRAY_NUM] = {
+        node_offsets_, labels_, max_degrees_, adj_offsets_, neighbors_, tags_, raw_labels_, raw_tags_
+    };
+    size_t s[ARRAY_NUM] = {
+        size_t(graph_sum_) + 1, size_t(graph_sum_), size_t(graph_sum_),
+        size_t(node_sum_) + 1, size_t(adj_offsets_[node_sum_]), size_t(node_sum_),
+        size_t(raw_label_sum_), size_t(raw_tag_sum_)
+    };
+    for (int i = 0; i < ARRAY_NUM; ++i) {
+        arrays[i] = a[i];
+        sizes[i] = s[i];
+    }
+}
+
+
+// map a cache file and use it in place. returns false (and leaves the
+// arena empty) when the file is missing or broken, source is set to the
+// key the cache was built from
+bool GraphArena::open_cache(const std::string &path, DatasetSource &source) {
+    clear();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < sizeof(DatasetCacheHeader)) {
+        close(fd);
+        return false;
+    }
+    void *image = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED)
+        return false;
+    const DatasetCacheHeader *header = static_cast<const DatasetCacheHeader*>(image);
+    if (
+        std::memcmp(header->magic, DATASET_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != DATASET_CACHE_VERSION ||
+        header->graph_sum < 0 || header->node_sum < 0 || header->edge_sum < 0 ||
+        header->raw_label_sum < 0 || header->raw_tag_sum < 0
+    ) {
+        munmap(image, st.st_size);
+        return false;
+    }
+    size_t sizes[ARRAY_NUM] = {
+        size_t(header->graph_sum) + 1, size_t(header->graph_sum), size_t(header->graph_sum),
+        size_t(header->node_sum) + 1, size_t(header->edge_sum), size_t(header->node_sum),
+        size_t(header->raw_label_sum), size_t(header->raw_tag_sum)
+    };
+    const int *arrays[ARRAY_NUM];
+    size_t offset = sizeof(DatasetCacheHeader);
+    for (int i = 0; i < ARRAY_NUM; ++i) {
+        arrays[i] = reinterpret_cast<const int*>(static_cast<char*>(image) + offset);
+        offset += (sizes[i] * sizeof(int) + 63) / 64 * 64;
+    }
+    if (
+        offset != st.st_size ||
+        arrays[0][header->graph_sum] != header->node_sum ||
+        arrays[3][header->node_sum] != header->edge_sum
+    ) {
+        munmap(image, st.st_size);
+        return false;
+    }
+    image_ = static_cast<char*>(image);
+    image_size_ = st.st_size;
+    graph_sum_ = header->graph_sum;
+    node_sum_ = header->node_sum;
+    label_sum_ = header->label_sum;
+    tag_sum_ = header->tag_sum;
+    node_offsets_ = arrays[0];
+    labels_ = arrays[1];
+    max_degrees_ = arrays[2];
+    adj_offsets_ = arrays[3];
+    neighbors_ = arrays[4];
+    tags_ = arrays[5];
+    raw_label_sum_ = header->raw_label_sum;
+    raw_tag_sum_ = header->raw_tag_sum;
+    raw_labels_ = arrays[6];
+    raw_tags_ = arrays[7];
+    if (!check_arrays()) {
+        clear();
+        return false;
+    }
+    source = header->source;
+    return true;
+}
+
+
+// every offset, neighbor, label and tag of a mapped cache in range, so that
+// a stale or corrupt file is parsed again instead of read out of bounds.
+// one pass over the arrays, much less than parsing the text
+bool GraphArena::check_arrays() const {
+    if (
+        label_sum_ < 0 || tag_sum_ < 0 || raw_label_sum_ > label_sum_ ||
+        raw_tag_sum_ > tag_sum_ || node_offsets_[0] != 0 || adj_offsets_[0] != 0
+    )
+        return false;
+    for (int g = 0; g < graph_sum_; ++g) {
+        int begin = node_offsets_[g], end = node_offsets_[g+1], max_degree = 0;
+        if (end < begin || end > node_sum_ || labels_[g] < 0 || labels_[g] >= label_sum_)
+            return false;
+        for (int v = begin; v < end; ++v) {
+            int degree = adj_offsets_[v+1] - adj_offsets_[v];
+            if (degree < 0 || tags_[v] < 0 || tags_[v] >= tag_sum_)
+                return false;
+            for (int e = adj_offsets_[v]; e < adj_offsets_[v+1]; ++e)
+                if (neighbors_[e] < 0 || neighbors_[e] >= end - begin)
+                    return false;
+            max_degree = std::max(max_degree, degree);
+        }
+        if (max_degrees_[g] != max_degree)
+            return false;
+    }
+    return true;
+}
+
+
+// write the arena as a cache of source. the file is written under a
+// temporary name and renamed, so a reader never sees half of it
+bool GraphArena::save_cache(const std::string &path, const DatasetSource &source) const {
+    DatasetCacheHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, DATASET_CACHE_MAGIC, sizeof(header.magic));
+    header.version = DATASET_CACHE_VERSION;
+    header.graph_sum = graph_sum_;
+    header.node_sum = node_sum_;
+    header.edge_sum = adj_offsets_[node_sum_];
+    header.label_sum = label_sum_;
+    header.tag_sum = tag_sum_;
+    header.source = source;
+    header.raw_label_sum = raw_label_sum_;
+    header.raw_tag_sum = raw_tag_sum_;
+    std::string tmp_path = path + ".tmp" + std::to_string(getpid());
+    std::ofstream out(tmp_path, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    const int *arrays[ARRAY_NUM];
+    size_t sizes[ARRAY_NUM];
+    get_arrays(arrays, sizes);
+    const char padding[64] = {};
+    for (int i = 0; i < ARRAY_NUM; ++i) {
+        size_t bytes = sizes[i] * sizeof(int);
+        out.write(reinterpret_cast<const char*>(arrays[i]), bytes);
+        out.write(padding, (bytes + 63) / 64 * 64 - bytes);
+    }
+    out.close();
+    if (!out || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        std::remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+inline int GraphArena::get_graph_sum() const {
+    return graph_sum_;
+}
+
+
+inline int GraphArena::get_node_sum() const {
+    return node_sum_;
+}
+
+
+inline int GraphArena::get_label_sum() const {
+    return label_sum_;
+}
+
+
+inline int GraphArena::get_tag_sum() const {
+    return tag_sum_;
+}
+
+
+inline int GraphArena::get_raw_label_sum() const {
+    return raw_label_sum_;
+}
+
+
+inline int GraphArena::get_raw_tag_sum() const {
+    return raw_tag_sum_;
+}
+
+
+// the label of the text file that was numbered label
+inline int GraphArena::get_raw_label(int label) const {
+    return raw_labels_[label];
+}
+
+
+// the node tag of the text file (the degree with degree_as_tag) that was
+// numbered tag
+inline int GraphArena::get_raw_tag(int tag) const {
+    return raw_tags_[tag];
+}
+
+
+inline int GraphArena::get_node_begin(int g) const {
+    return node_offsets_[g];
+}
+
+
+inline int GraphArena::get_node_sum(int g) const {
+    return node_offsets_[g+1] - node_offsets_[g];
+}
+
+
+// adjacency entries of graph g, an undirected edge counts twice
+inline int GraphArena::get_edge_sum(int g) const {
+    return adj_offsets_[node_offsets_[g+1]] - adj_offsets_[node_offsets_[g]];
+}
+
+
+inline int GraphArena::get_label(int g) const {
+    return labels_[g];
+}
+
+
+inline int GraphArena::get_max_degree(int g) const {
+    return max_degrees_[g];
+}
+
+
+inline int GraphArena::get_tag(int v) const {
+    return tags_[v];
+}
+
+
+inline int GraphArena::get_degree(int v) const {
+    return adj_offsets_[v+1] - adj_offsets_[v];
+}
+
+
+inline const int* GraphArena::get_neighbors(int v) const {
+    return neighbors_ + adj_offsets_[v];
+}
+
+#endif
@@ -3,44 +3,20 @@
 #include <sstream>
 #include <map>
 #include <vector>
+#include <chrono>
+#include <memory>
 
 #include "models/graphcnn.hh"
 #include "models/my_matrix.hh"
-#include "s2vgraph.hh"
+#include "models/thread_pool.hh"
+#include "models/workspace.hh"
+#include "models/profiler.hh"
+#include "graph_arena.hh"
+#include "batch_plan.hh"
+#include "pipeline.hh"
 #include "util.hh"
 
 
-void load_model_data(const std::string &path, std::map<std::string, std::vector<std::vector<float>> > &data) {
-    std::ifstream get_data(path);
-    std::string str;
-    int dim, row, col;
-    while (std::getline(get_data, str)) {
-        std::string name(str);
-        data[name] = std::vector<std::vector<float>>();
-        std::getline(get_data, str);
-        std::stringstream data_size(str);
-        data_size >> dim;
-        if (dim == 1) {
-            data_size >> col;
-            row = 1;
-        } else {
-            data_size >> row >> col;
-        }
-        for (int i = 0; i < row; ++i) {
-            std::getline(get_data, str);
-            data[name].push_back(std::vector<float>());
-            std::stringstream data_val(str);
-            float val;
-            for (int j = 0; j < col; ++j) {
-                data_val >> val;
-                data[name][i].push_back(val);
-            }
-        }
-    }
-    get_data.close();
-}
-
-
 void test(const std::vector<S2VGraph*>& data, int batch_size) {
     int data_l = data.size();
     for (int begin_idx = 0; begin_idx < data_l; begin_idx += batch_size) {
@@ -51,56 +27,244 @@ void test(const std::vector<S2VGraph*>& data, int batch_size) {
 }
 
 
-void deleteData(std::vector<S2VGraph*>& data) {
-    for (int i = 0; i < data.size(); ++i)
-        delete data[i];
+// predict the graphs graphs[0 .. batch_size) as one batch, pred is indexed
+// by graph. every thread keeps one workspace that grows to the largest
+// batch it has seen, after that a batch does not allocate any matrix
+void predict_batch(
+    const GraphCNN &model, const GraphArena &arena,
+    const int *graphs, int batch_size, std::vector<int> &pred
+) {
+    thread_local Workspace ws;
+    thread_local std::vector<int> batch;
+    batch.assign(graphs, graphs + batch_size);
+    int node_sum = 0;
+    for (int j = 0; j < batch_size; ++j)
+        node_sum += arena.get_node_sum(graphs[j]);
+    ws.reserve(
+        Workspace::matrix_bytes(batch_size, model.get_output_dim()) +
+        model.get_workspace_size(node_sum, arena.get_tag_sum())
+    );
+    MyMatrix output = ws.matrix(batch_size, model.get_output_dim(), true);
+    model.forward(arena, batch, output, ws);
+    for (int j = 0; j < batch_size; ++j)
+        pred[graphs[j]] = output.get_max_idx(1, j);
+    ws.reset();
+}
+
+
+// a build with -DPGNN_PROFILE prints the time of every stage of the
+// forward passes, and saves them as a chrome trace with --trace
+void report_profile(const std::string &trace_path) {
+#ifdef PGNN_PROFILE
+    Profiler::get().print_summary(std::cout);
+    if (!trace_path.empty()) {
+        Profiler::get().save_trace(trace_path);
+        std::cout << "trace saved to " << trace_path << std::endl;
+    }
+#endif
+}
+
+
+void usage(const char *name) {
+    std::cerr << "usage: " << name << " <model> <dataset> [--threads N] [--intra-op] [--no-cache]"
+              << " [--batch-graphs N] [--batch-nodes N] [--batch-edges N] [--sort-batches]"
+              << " [--calibrate FILE [--calib-split K]] [--int8 FILE] [--weights fp32|bf16|fp16]"
+              << " [--generic-kernels] [--pipeline [--queue-depth N]]"
+              << " [--trace FILE] [--counters]" << std::endl;
+    exit(0);
 }
 
 
 int main(int argc, char** argv) {
-    // load the model data
-    std::string model_path(argv[1]);
-    std::map<std::string, std::vector<std::vector<float>> > model_data;
-    load_model_data(model_path, model_data);
+    if (argc < 3)
+        usage(argv[0]);
+    int num_threads = 1;
+    bool intra_op = false, use_cache = true, fixed_kernels = true, pipeline = false;
+    bool counters = false;
+    BatchBudget budget;
+    std::string calibrate_path, int8_path, trace_path;
+    int calib_split = 5, queue_depth = 4;
+    WeightPrecision precision = WEIGHT_FP32;
+    for (int i = 3; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (arg == "--threads" && i+1 < argc)
+            num_threads = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--intra-op")
+            intra_op = true;
+        else if (arg == "--no-cache")
+            use_cache = false;
+        else if (arg == "--batch-graphs" && i+1 < argc)
+            budget.max_graphs = std::max(0, std::stoi(argv[++i]));
+        else if (arg == "--batch-nodes" && i+1 < argc)
+            budget.max_nodes = std::max(0, std::stoi(argv[++i]));
+        else if (arg == "--batch-edges" && i+1 < argc)
+            budget.max_edges = std::max(0, std::stoi(argv[++i]));
+        else if (arg == "--sort-batches")
+            budget.sort_by_size = true;
+        else if (arg == "--calibrate" && i+1 < argc)
+            calibrate_path = argv[++i];
+        else if (arg == "--calib-split" && i+1 < argc)
+            calib_split = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--int8" && i+1 < argc)
+            int8_path = argv[++i];
+        else if (arg == "--weights" && i+1 < argc)
+            precision = parse_weight_precision(argv[++i]);
+        else if (arg == "--generic-kernels")
+            fixed_kernels = false;
+        else if (arg == "--pipeline")
+            pipeline = true;
+        else if (arg == "--queue-depth" && i+1 < argc)
+            queue_depth = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--trace" && i+1 < argc)
+            trace_path = argv[++i];
+        else if (arg == "--counters")
+            counters = true;
+        else
+            usage(argv[0]);
+    }
+#ifndef PGNN_PROFILE
+    if (!trace_path.empty() || counters) {
+        std::cerr << "error: --trace and --counters need a build with -DPGNN_PROFILE!" << std::endl;
+        exit(0);
+    }
+#endif
+    // the pipeline reads the dataset once, in file order, while it predicts
+    if (pipeline && (!calibrate_path.empty() || budget.sort_by_size || intra_op)) {
+        std::cerr << "error: --pipeline does not go with --calibrate, --sort-batches"
+                  << " or --intra-op!" << std::endl;
+        exit(0);
+    }
 
-    // load the model
+    // load the model, a binary model file is mapped and used in place,
+    // a text model is parsed first
+    std::string model_path(argv[1]);
     std::string graph_pooling_type = "sum";
     std::string neighbor_pooling_type = "sum";
-    GraphCNN model(
-        model_data, false, 
-        graph_pooling_type, neighbor_pooling_type
-    );
+    auto load_begin = std::chrono::steady_clock::now();
+    std::unique_ptr<GraphCNN> model_ptr;
+    if (ModelFile::is_binary(model_path)) {
+        model_ptr.reset(new GraphCNN(
+            model_path, false, graph_pooling_type, neighbor_pooling_type
+        ));
+    } else {
+        std::map<std::string, std::vector<std::vector<float>> > model_data;
+        load_model_data(model_path, model_data);
+        model_ptr.reset(new GraphCNN(
+            model_data, false, graph_pooling_type, neighbor_pooling_type
+        ));
+    }
+    if (!fixed_kernels)
+        model_ptr->specialize_kernels(false);
+    if (precision != WEIGHT_FP32)
+        model_ptr->set_weight_precision(precision);
+    std::cout << "model load time: " << std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - load_begin
+    ).count() * 1000 << " ms (weights " << model_ptr->get_weight_bytes() / 1024.0
+      << " KB)" << std::endl;
+    if (model_ptr->get_fixed_kernel() != nullptr)
+        std::cout << "hidden kernel: " << model_ptr->get_fixed_kernel()->name << " "
+                  << model_ptr->get_fixed_kernel()->dim << std::endl;
 
     // load train data and test data
     std::string data_path(argv[2]);
-    std::vector<S2VGraph*> graph_list;
-    int label_sum = 0, tag_sum = 0;
-    loadData(data_path, 0, graph_list, label_sum, tag_sum);
+    GraphArena arena;
+    if (!pipeline) {
+        load_begin = std::chrono::steady_clock::now();
+        loadGraphArena(data_path, false, arena, num_threads, use_cache);
+        std::cout << "data load time: " << std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - load_begin
+        ).count() * 1000 << " ms" << std::endl;
+    }
 
-    int g_list_size = graph_list.size();
-    int output_dim = model.get_output_dim();
-    int correct = 0;
-    for (int i = 0; i < g_list_size; i += 64) {
-        std::vector<S2VGraph*> batch;
-        int batch_size = 64;
-        if (g_list_size - i < 64)
-            batch_size = g_list_size - i;
-        for (int j = i; j < i+batch_size; ++j) 
-            batch.push_back(graph_list[j]);
-        MyMatrix output(output_dim, batch_size);
-        model.forward(batch, tag_sum, output);
-        int pre;
-        for (int j = i; j < i+batch_size; ++j) {
-            pre = output.get_max_idx(0, j-i);
-            if (pre == graph_list[j]->get_label())
-                correct++;
+    // int8: --calibrate records the activation ranges on every calib_split-th
+    // graph and saves them, --int8 loads saved ranges. either way the mlp
+    // linears run in int8 from here on
+    if (!calibrate_path.empty() || !int8_path.empty()) {
+        std::map<std::string, QuantRange> ranges;
+        if (!calibrate_path.empty()) {
+            std::vector<int> calib_graphs;
+            for (int g = 0; g < arena.get_graph_sum(); g += calib_split)
+                calib_graphs.push_back(g);
+            model_ptr->calibrate(arena, calib_graphs, ranges);
+            save_quant_ranges(calibrate_path, ranges);
+            std::cout << "calibrated " << ranges.size() << " linears on "
+                      << calib_graphs.size() << " graphs" << std::endl;
+        } else {
+            load_quant_ranges(int8_path, ranges);
         }
+        model_ptr->quantize(ranges);
+        std::cout << "int8 kernel: " << int8_kernel().name << std::endl;
     }
+    const GraphCNN &model = *model_ptr;
+#ifdef PGNN_PROFILE
+    Profiler::get().clear();
+    Profiler::get().set_counters(counters);
+#endif
+
+    // --pipeline: parsing, batch preparation and forward overlap, the
+    // first batch is predicted while the rest of the file is still read
+    if (pipeline) {
+        std::vector<int> pred, labels;
+        PipelineStats stats;
+        run_pipeline(model, data_path, budget, num_threads, queue_depth, pred, labels, stats);
+        int correct = 0;
+        for (int i = 0; i < pred.size(); ++i)
+            correct += pred[i] == labels[i];
+        std::cout << "batches: " << stats.batch_sum << " (queue depth " << queue_depth
+                  << ")" << std::endl;
+        std::cout << "accuracy: " << float(correct) / float(pred.size()) << std::endl;
+        std::cout << "first prediction after: " << stats.first_seconds * 1000 << " ms"
+                  << std::endl;
+        std::cout << "load and inference time: " << stats.seconds << " s (" << num_threads
+                  << " compute threads)" << std::endl;
+        report_profile(trace_path);
+        return 0;
+    }
+
+    // the model is only read by forward, so every batch can run on its own
+    // thread sharing the same GraphCNN. with --intra-op the batches run one
+    // after another instead and the kernels inside forward split their rows
+    // over the pool, which gives the lowest latency per batch
+    int g_list_size = arena.get_graph_sum();
+    BatchPlan batches;
+    batches.plan(arena, budget);
+    std::cout << "batches: " << batches.get_batch_sum() << " (largest "
+              << batches.get_max_node_sum() << " nodes)" << std::endl;
+    std::vector<int> pred(g_list_size);
+    auto begin = std::chrono::steady_clock::now();
+    if (num_threads > 1 && !intra_op) {
+        ThreadPool pool(num_threads);
+        for (int b = 0; b < batches.get_batch_sum(); ++b) {
+            pool.submit([&, b]() {
+                predict_batch(model, arena, batches.get_batch(b), batches.get_batch_size(b), pred);
+            });
+        }
+        pool.wait();
+    } else {
+        // the calling thread takes a share of every kernel too
+        std::unique_ptr<ThreadPool> pool;
+        if (num_threads > 1) {
+            pool.reset(new ThreadPool(num_threads - 1));
+            ThreadPool::set_shared(pool.get());
+        }
+        for (int b = 0; b < batches.get_batch_sum(); ++b)
+            predict_batch(model, arena, batches.get_batch(b), batches.get_batch_size(b), pred);
+        ThreadPool::set_shared(nullptr);
+    }
+    double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - begin
+    ).count();
+
+    int correct = 0;
+    for (int i = 0; i < g_list_size; ++i)
+        if (pred[i] == arena.get_label(i))
+            correct++;
     float accuracy =  correct;
     accuracy /= float(g_list_size);
     std::cout << "accuracy: " << accuracy << std::endl;
-
-    deleteData(graph_list);
+    std::cout << "inference time: " << seconds << " s (" << num_threads
+              << " threads)" << std::endl;
+    report_profile(trace_path);
 
     return 0;
 }
\ No newline at end of file
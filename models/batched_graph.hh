@@ -0,0 +1,153 @@
+#ifndef BATCHED_GRAPH_HH
+#define BATCHED_GRAPH_HH
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+
+#include "sparse_matrix.hh"
+#include "../graph_arena.hh"
+
+// everything a forward pass needs to know about one batch, built once and
+// read by every layer (and by every later pass on the same batch):
+//   graph i owns the batch nodes [node_offsets_[i], node_offsets_[i+1])
+//   and is pooled with the weight pool_weights_[i] (1, or 1/node count for
+//   an average graph pooling)
+//   batch node v has the tag tags_[v]
+//   adjacency_ is the block-diagonal neighbor matrix in CSR, with the self
+//   loop of every node when self_loop (once, even if the node lists
+//   itself), and each row holding the reciprocal
+//   of its degree instead of 1 for an average neighbor pooling
+// the arrays keep their capacity, so rebuilding it for another batch stops
+// allocating once it has seen the largest one
+class BatchedGraph {
+private:
+    int graph_sum_, node_sum_, tag_sum_;
+    std::vector<int> node_offsets_;
+    std::vector<int> tags_;
+    std::vector<float> pool_weights_;
+    SparseMatrix adjacency_;
+
+public:
+    BatchedGraph();
+    BatchedGraph(const BatchedGraph&) = delete;
+    BatchedGraph& operator=(const BatchedGraph&) = delete;
+    void build(
+        const GraphArena &arena, const std::vector<int> &batch,
+        bool self_loop, bool average_neighbors, bool average_graphs
+    );
+
+    int get_graph_sum() const;
+    int get_node_sum() const;
+    int get_tag_sum() const;
+    int get_node_begin(int i) const;
+    int get_node_sum(int i) const;
+    int get_tag(int v) const;
+    float get_pool_weight(int i) const;
+    const int* get_node_offsets() const;
+    const float* get_pool_weights() const;
+    const SparseMatrix& get_adjacency() const;
+};
+
+
+BatchedGraph::BatchedGraph() {
+    graph_sum_ = node_sum_ = tag_sum_ = 0;
+    node_offsets_.assign(1, 0);
+}
+
+
+// batch holds graph indices of arena, graph i of the batch is batch[i].
+// the neighbors of each node stay sorted, the self loop in its place
+void BatchedGraph::build(
+    const GraphArena &arena, const std::vector<int> &batch,
+    bool self_loop, bool average_neighbors, bool average_graphs
+) {
+    graph_sum_ = batch.size();
+    tag_sum_ = arena.get_tag_sum();
+    node_offsets_.resize(graph_sum_ + 1);
+    pool_weights_.resize(graph_sum_);
+    node_sum_ = 0;
+    for (int i = 0; i < graph_sum_; ++i) {
+        int g_node_sum = arena.get_node_sum(batch[i]);
+        node_offsets_[i] = node_sum_;
+        pool_weights_[i] = average_graphs ? 1/float(g_node_sum) : 1;
+        node_sum_ += g_node_sum;
+    }
+    node_offsets_[graph_sum_] = node_sum_;
+
+    tags_.resize(node_sum_);
+    adjacency_.reset(node_sum_, node_sum_);
+    for (int i = 0; i < graph_sum_; ++i) {
+        int node_begin = arena.get_node_begin(batch[i]), begin_idx = node_offsets_[i];
+        for (int v = 0; v < node_offsets_[i+1] - begin_idx; ++v) {
+            tags_[begin_idx + v] = arena.get_tag(node_begin + v);
+            const int *neighbors = arena.get_neighbors(node_begin + v);
+            int e = 0, degree = arena.get_degree(node_begin + v);
+            // a node that lists itself already has its self loop
+            bool add_loop = self_loop && !std::binary_search(neighbors, neighbors + degree, v);
+            float value = 1;
+            if (average_neighbors && degree + add_loop > 0)
+                value = 1/float(degree + add_loop);
+            while (e < degree && neighbors[e] < v)
+                adjacency_.push(neighbors[e++] + begin_idx, value);
+            if (add_loop)
+                adjacency_.push(v + begin_idx, value);
+            while (e < degree)
+                adjacency_.push(neighbors[e++] + begin_idx, value);
+            adjacency_.end_row();
+        }
+    }
+}
+
+
+inline int BatchedGraph::get_graph_sum() const {
+    return graph_sum_;
+}
+
+
+inline int BatchedGraph::get_node_sum() const {
+    return node_sum_;
+}
+
+
+inline int BatchedGraph::get_tag_sum() const {
+    return tag_sum_;
+}
+
+
+inline int BatchedGraph::get_node_begin(int i) const {
+    return node_offsets_[i];
+}
+
+
+inline int BatchedGraph::get_node_sum(int i) const {
+    return node_offsets_[i+1] - node_offsets_[i];
+}
+
+
+inline int BatchedGraph::get_tag(int v) const {
+    return tags_[v];
+}
+
+
+inline float BatchedGraph::get_pool_weight(int i) const {
+    return pool_weights_[i];
+}
+
+
+// graph_sum + 1 offsets, the segments of the graph readout
+inline const int* BatchedGraph::get_node_offsets() const {
+    return node_offsets_.data();
+}
+
+
+inline const float* BatchedGraph::get_pool_weights() const {
+    return pool_weights_.data();
+}
+
+
+inline const SparseMatrix& BatchedGraph::get_adjacency() const {
+    return adjacency_;
+}
+
+#endif
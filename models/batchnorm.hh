@@ -4,16 +4,25 @@
 #include <iostream>
 
 #include "my_matrix.hh"
+#include "model_file.hh"
 
 // 修改思路：将gamma和beta的数据结构全部改为vector
 //          从模型中得到running_mean和running_var
 //          再稍微修改一下计算方法，就大功告成力！
+// the parameters either live in storage_ or in a model file (zero copy)
 class BatchNorm {
 private:
-    std::vector<float> gamma_;
-    std::vector<float> beta_;
-    std::vector<float> running_mean_;
-    std::vector<float> running_var_;
+    int dim_;
+    std::vector<float> storage_;
+    const float *gamma_;
+    const float *beta_;
+    const float *running_mean_;
+    const float *running_var_;
+    // the layer only runs with the running statistics, so it is just
+    // y = x*scale + shift per feature
+    std::vector<float> scale_, shift_;
+
+    void prepare();
 
 public:
     BatchNorm(
@@ -21,8 +30,14 @@ public:
         const std::vector<float> &gdata, const std::vector<float> &bdata,
         const std::vector<float> &rm, const std::vector<float> &rv
     );
+    BatchNorm(
+        const ModelTensor &gamma, const ModelTensor &beta,
+        const ModelTensor &rm, const ModelTensor &rv
+    );
     ~BatchNorm() {};
-    void forward(const MyMatrix& input, MyMatrix& output);
+    int get_dim() const;
+    void get_scale_shift(std::vector<float> &scale, std::vector<float> &shift) const;
+    void forward(const MyMatrix& input, MyMatrix& output) const;
 };
 
 
@@ -31,15 +46,65 @@ BatchNorm::BatchNorm(
     const std::vector<float> &gdata, const std::vector<float> &bdata,
     const std::vector<float> &rm, const std::vector<float> &rv
 ) {
-    gamma_ = gdata;
-    beta_ = bdata;
-    running_mean_ = rm;
-    running_var_ = rv;
+    dim_ = input_dim;
+    for (const auto *v : {&gdata, &bdata, &rm, &rv}) {
+        if (v->size() != input_dim) {
+            std::cerr << "batch norm error: wrong size of parameter!" << std::endl;
+            exit(0);
+        }
+        storage_.insert(storage_.end(), v->begin(), v->end());
+    }
+    gamma_ = storage_.data();
+    beta_ = gamma_ + dim_;
+    running_mean_ = beta_ + dim_;
+    running_var_ = running_mean_ + dim_;
+    prepare();
+}
+
+
+BatchNorm::BatchNorm(
+    const ModelTensor &gamma, const ModelTensor &beta,
+    const ModelTensor &rm, const ModelTensor &rv
+) {
+    dim_ = gamma.cols;
+    for (const auto *t : {&gamma, &beta, &rm, &rv}) {
+        if (t->rows != 1 || t->cols != dim_) {
+            std::cerr << "batch norm error: wrong size of parameter!" << std::endl;
+            exit(0);
+        }
+    }
+    gamma_ = gamma.data;
+    beta_ = beta.data;
+    running_mean_ = rm.data;
+    running_var_ = rv.data;
+    prepare();
 }
 
 
-void BatchNorm::forward(const MyMatrix& input, MyMatrix& output) {
-    if (input.col_width_ != gamma_.size()) {
+void BatchNorm::prepare() {
+    scale_.resize(dim_);
+    shift_.resize(dim_);
+    for (int i = 0; i < dim_; ++i) {
+        scale_[i] = gamma_[i] / std::sqrt(running_var_[i] + 0.00001f);
+        shift_[i] = beta_[i] - running_mean_[i] * scale_[i];
+    }
+}
+
+
+inline int BatchNorm::get_dim() const {
+    return dim_;
+}
+
+
+void BatchNorm::get_scale_shift(std::vector<float> &scale, std::vector<float> &shift) const {
+    scale = scale_;
+    shift = shift_;
+}
+
+
+// one sample per row, one feature per column
+void BatchNorm::forward(const MyMatrix& input, MyMatrix& output) const {
+    if (input.row_width_ != dim_) {
         std::cerr << "batch norm error: wrong size of input!" << std::endl;
         exit(0);
     }
@@ -50,18 +115,16 @@ void BatchNorm::forward(const MyMatrix& input, MyMatrix& output) {
         std::cerr << "batch norm error: wrong size of input!" << std::endl;
         exit(0);
     }
-    for (int i = 0; i < input.col_width_; ++i) {
-        float rm = running_mean_[i], rv = running_var_[i];
-        float gm = gamma_[i], bt = beta_[i];
-        rv = std::sqrt(rv + 0.00001);
-        float tmp;
-        for (int j = 0; j < input.row_width_; ++j) {
-            tmp = input.mat_[i][j];
-            tmp = (tmp - rm) / rv;
-            tmp = tmp*gm + bt;
-            output.mat_[i][j] = tmp;
+    const float *sc = scale_.data(), *sh = shift_.data();
+    int grain = std::max(1, PARALLEL_MIN_WORK / std::max(1, dim_));
+    parallel_for(0, input.col_width_, grain, [&](int row_begin, int row_end) {
+        for (int i = row_begin; i < row_end; ++i) {
+            const float *in = input.row_ptr(i);
+            float *out = output.row_ptr(i);
+            for (int j = 0; j < dim_; ++j)
+                out[j] = in[j]*sc[j] + sh[j];
         }
-    }
+    });
 }
 
 #endif
\ No newline at end of file
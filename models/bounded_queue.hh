@@ -0,0 +1,142 @@
+#ifndef BOUNDED_QUEUE_HH
+#define BOUNDED_QUEUE_HH
+
+#include <iostream>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <cstdint>
+#include <cstdlib>
+
+// lock-free bounded multi-producer multi-consumer queue (Vyukov): a ring
+// of capacity cells (a power of two), each with a sequence number telling
+// whether it is free for the push of ticket t (seq == t) or holds the
+// value for the pop of ticket t (seq == t + 1). push and pop claim a
+// ticket with one compare-and-swap and never take a lock.
+// the blocking push/pop spin a little, then yield, so a stage waiting on a
+// full or empty queue gives its core to the others. after close() pop
+// returns false once the queue is drained
+template <typename T>
+class BoundedQueue {
+private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        T value;
+    };
+
+    std::vector<Cell> cells_;
+    size_t mask_;
+    alignas(64) std::atomic<size_t> head_;
+    alignas(64) std::atomic<size_t> tail_;
+    alignas(64) std::atomic<bool> closed_;
+
+    static void backoff(int &spins);
+
+public:
+    BoundedQueue(size_t capacity);
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    bool try_push(const T &value);
+    bool try_pop(T &value);
+    void push(const T &value);
+    bool pop(T &value);
+    void close();
+};
+
+
+template <typename T>
+BoundedQueue<T>::BoundedQueue(size_t capacity) : cells_(capacity) {
+    if (capacity < 2 || (capacity & (capacity - 1)) != 0) {
+        std::cerr << "queue error: the capacity must be a power of two!" << std::endl;
+        exit(0);
+    }
+    for (size_t i = 0; i < capacity; ++i)
+        cells_[i].seq.store(i, std::memory_order_relaxed);
+    mask_ = capacity - 1;
+    head_.store(0, std::memory_order_relaxed);
+    tail_.store(0, std::memory_order_relaxed);
+    closed_.store(false, std::memory_order_relaxed);
+}
+
+
+template <typename T>
+inline void BoundedQueue<T>::backoff(int &spins) {
+    if (++spins < 64)
+        return;
+    std::this_thread::yield();
+}
+
+
+template <typename T>
+bool BoundedQueue<T>::try_push(const T &value) {
+    size_t pos = tail_.load(std::memory_order_relaxed);
+    while (true) {
+        Cell &cell = cells_[pos & mask_];
+        size_t seq = cell.seq.load(std::memory_order_acquire);
+        intptr_t diff = intptr_t(seq) - intptr_t(pos);
+        if (diff == 0) {
+            if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                cell.value = value;
+                cell.seq.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = tail_.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+
+template <typename T>
+bool BoundedQueue<T>::try_pop(T &value) {
+    size_t pos = head_.load(std::memory_order_relaxed);
+    while (true) {
+        Cell &cell = cells_[pos & mask_];
+        size_t seq = cell.seq.load(std::memory_order_acquire);
+        intptr_t diff = intptr_t(seq) - intptr_t(pos + 1);
+        if (diff == 0) {
+            if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                value = cell.value;
+                cell.seq.store(pos + mask_ + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = head_.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+
+template <typename T>
+void BoundedQueue<T>::push(const T &value) {
+    int spins = 0;
+    while (!try_push(value))
+        backoff(spins);
+}
+
+
+// false when the queue is closed and empty
+template <typename T>
+bool BoundedQueue<T>::pop(T &value) {
+    int spins = 0;
+    while (!try_pop(value)) {
+        if (closed_.load(std::memory_order_acquire))
+            return try_pop(value);
+        backoff(spins);
+    }
+    return true;
+}
+
+
+// no push may follow
+template <typename T>
+void BoundedQueue<T>::close() {
+    closed_.store(true, std::memory_order_release);
+}
+
+#endif
@@ -0,0 +1,516 @@
+#ifndef GEMM_HH
+#define GEMM_HH
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
+
+#include "thread_pool.hh"
+#include "half.hh"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GEMM_X86 1
+#endif
+
+// cache-blocked single precision GEMM on row-major buffers:
+//     c = a * op(b)        (accumulate == false)
+//     c = c + a * op(b)    (accumulate == true)
+// followed by the optional epilogue. op(b) is b, or b transposed when
+// trans_b is set (b is then n x k, e.g. the weight of a linear layer), the
+// transpose is folded into the packing and never materialized.
+// a is m x k, b is k x n, c is m x n. b is packed into kc x NR column strips,
+// a into MR x kc row strips, then a register-tiled micro-kernel computes
+// each MR x NR tile of c. the micro-kernel is picked once at runtime from
+// the features of the cpu (avx512f, avx2+fma, or a portable fallback)
+struct GemmEpilogue;
+void gemm(
+    int m, int n, int k,
+    const float *a, int lda, const float *b, int ldb,
+    float *c, int ldc, bool accumulate = false,
+    const GemmEpilogue *epilogue = nullptr, bool trans_b = false
+);
+// the same with b stored in 16 bits (WEIGHT_BF16 or WEIGHT_FP16): it is
+// widened to fp32 while it is packed, the micro-kernel is unchanged
+void gemm(
+    int m, int n, int k,
+    const float *a, int lda, const uint16_t *b, int ldb, WeightPrecision precision,
+    float *c, int ldc, bool accumulate = false,
+    const GemmEpilogue *epilogue = nullptr, bool trans_b = false
+);
+
+// applied to each tile of c right after its last k block is stored, while
+// the tile is still in cache:
+//     c[i][j] = act(c[i][j] + row_bias[i] + col_bias[j])
+// either bias may be null, act is ReLU or the identity
+struct GemmEpilogue {
+    const float *row_bias;
+    const float *col_bias;
+    bool relu;
+};
+
+// the kernel writes a full mr x nr tile to c (row stride ldc)
+typedef void (*GemmMicroKernel)(
+    int kc, const float *ap, const float *bp, float *c, int ldc, bool accumulate
+);
+
+struct GemmKernel {
+    const char *name;
+    int mr, nr;
+    GemmMicroKernel kernel;
+};
+
+const GemmKernel& gemm_kernel();
+
+
+namespace gemm_detail {
+
+const int MC = 144;
+const int KC = 256;
+const int NC = 3072;
+
+template <int MR, int NR>
+void kernel_generic(
+    int kc, const float *ap, const float *bp, float *c, int ldc, bool accumulate
+) {
+    float acc[MR][NR] = {};
+    for (int p = 0; p < kc; ++p) {
+        for (int i = 0; i < MR; ++i) {
+            float av = ap[i];
+            for (int j = 0; j < NR; ++j)
+                acc[i][j] += av * bp[j];
+        }
+        ap += MR;
+        bp += NR;
+    }
+    for (int i = 0; i < MR; ++i) {
+        float *cr = c + i*ldc;
+        if (accumulate) {
+            for (int j = 0; j < NR; ++j)
+                cr[j] += acc[i][j];
+        } else {
+            for (int j = 0; j < NR; ++j)
+                cr[j] = acc[i][j];
+        }
+    }
+}
+
+
+#ifdef GEMM_X86
+
+#define GEMM_AVX2_ROW(r) \
+    a = _mm256_broadcast_ss(ap + r); \
+    c##r##0 = _mm256_fmadd_ps(a, b0, c##r##0); \
+    c##r##1 = _mm256_fmadd_ps(a, b1, c##r##1);
+
+#define GEMM_AVX2_STORE(r) \
+    if (accumulate) { \
+        c##r##0 = _mm256_add_ps(c##r##0, _mm256_loadu_ps(c + r*ldc)); \
+        c##r##1 = _mm256_add_ps(c##r##1, _mm256_loadu_ps(c + r*ldc + 8)); \
+    } \
+    _mm256_storeu_ps(c + r*ldc, c##r##0); \
+    _mm256_storeu_ps(c + r*ldc + 8, c##r##1);
+
+// 6 x 16 tile, 12 accumulators
+__attribute__((target("avx2,fma")))
+void kernel_avx2(
+    int kc, const float *ap, const float *bp, float *c, int ldc, bool accumulate
+) {
+    __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps();
+    __m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+    __m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps();
+    __m256 c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps();
+    __m256 c40 = _mm256_setzero_ps(), c41 = _mm256_setzero_ps();
+    __m256 c50 = _mm256_setzero_ps(), c51 = _mm256_setzero_ps();
+    __m256 a, b0, b1;
+    for (int p = 0; p < kc; ++p) {
+        b0 = _mm256_loadu_ps(bp);
+        b1 = _mm256_loadu_ps(bp + 8);
+        GEMM_AVX2_ROW(0) GEMM_AVX2_ROW(1) GEMM_AVX2_ROW(2)
+        GEMM_AVX2_ROW(3) GEMM_AVX2_ROW(4) GEMM_AVX2_ROW(5)
+        ap += 6;
+        bp += 16;
+    }
+    GEMM_AVX2_STORE(0) GEMM_AVX2_STORE(1) GEMM_AVX2_STORE(2)
+    GEMM_AVX2_STORE(3) GEMM_AVX2_STORE(4) GEMM_AVX2_STORE(5)
+}
+
+#undef GEMM_AVX2_ROW
+#undef GEMM_AVX2_STORE
+
+
+#define GEMM_AVX512_ROW(r) \
+    a = _mm512_set1_ps(ap[r]); \
+    c##r##0 = _mm512_fmadd_ps(a, b0, c##r##0); \
+    c##r##1 = _mm512_fmadd_ps(a, b1, c##r##1);
+
+#define GEMM_AVX512_STORE(r) \
+    if (accumulate) { \
+        c##r##0 = _mm512_add_ps(c##r##0, _mm512_loadu_ps(c + r*ldc)); \
+        c##r##1 = _mm512_add_ps(c##r##1, _mm512_loadu_ps(c + r*ldc + 16)); \
+    } \
+    _mm512_storeu_ps(c + r*ldc, c##r##0); \
+    _mm512_storeu_ps(c + r*ldc + 16, c##r##1);
+
+// 12 x 32 tile, 24 accumulators
+__attribute__((target("avx512f")))
+void kernel_avx512(
+    int kc, const float *ap, const float *bp, float *c, int ldc, bool accumulate
+) {
+    __m512 c00 = _mm512_setzero_ps(), c01 = _mm512_setzero_ps();
+    __m512 c10 = _mm512_setzero_ps(), c11 = _mm512_setzero_ps();
+    __m512 c20 = _mm512_setzero_ps(), c21 = _mm512_setzero_ps();
+    __m512 c30 = _mm512_setzero_ps(), c31 = _mm512_setzero_ps();
+    __m512 c40 = _mm512_setzero_ps(), c41 = _mm512_setzero_ps();
+    __m512 c50 = _mm512_setzero_ps(), c51 = _mm512_setzero_ps();
+    __m512 c60 = _mm512_setzero_ps(), c61 = _mm512_setzero_ps();
+    __m512 c70 = _mm512_setzero_ps(), c71 = _mm512_setzero_ps();
+    __m512 c80 = _mm512_setzero_ps(), c81 = _mm512_setzero_ps();
+    __m512 c90 = _mm512_setzero_ps(), c91 = _mm512_setzero_ps();
+    __m512 c100 = _mm512_setzero_ps(), c101 = _mm512_setzero_ps();
+    __m512 c110 = _mm512_setzero_ps(), c111 = _mm512_setzero_ps();
+    __m512 a, b0, b1;
+    for (int p = 0; p < kc; ++p) {
+        b0 = _mm512_loadu_ps(bp);
+        b1 = _mm512_loadu_ps(bp + 16);
+        GEMM_AVX512_ROW(0) GEMM_AVX512_ROW(1) GEMM_AVX512_ROW(2)
+        GEMM_AVX512_ROW(3) GEMM_AVX512_ROW(4) GEMM_AVX512_ROW(5)
+        GEMM_AVX512_ROW(6) GEMM_AVX512_ROW(7) GEMM_AVX512_ROW(8)
+        GEMM_AVX512_ROW(9) GEMM_AVX512_ROW(10) GEMM_AVX512_ROW(11)
+        ap += 12;
+        bp += 32;
+    }
+    GEMM_AVX512_STORE(0) GEMM_AVX512_STORE(1) GEMM_AVX512_STORE(2)
+    GEMM_AVX512_STORE(3) GEMM_AVX512_STORE(4) GEMM_AVX512_STORE(5)
+    GEMM_AVX512_STORE(6) GEMM_AVX512_STORE(7) GEMM_AVX512_STORE(8)
+    GEMM_AVX512_STORE(9) GEMM_AVX512_STORE(10) GEMM_AVX512_STORE(11)
+}
+
+#undef GEMM_AVX512_ROW
+#undef GEMM_AVX512_STORE
+
+#endif // GEMM_X86
+
+
+GemmKernel select_kernel() {
+#ifdef GEMM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return GemmKernel{"avx512", 12, 32, kernel_avx512};
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return GemmKernel{"avx2", 6, 16, kernel_avx2};
+#endif
+    return GemmKernel{"generic", 4, 8, kernel_generic<4, 8>};
+}
+
+
+// max(x, 0) without a branch, the sign of an activation is not predictable
+inline void relu_row(float *x, int n) {
+    int j = 0;
+#ifdef __SSE__
+    __m128 zero = _mm_setzero_ps();
+    for (; j + 4 <= n; j += 4)
+        _mm_storeu_ps(x + j, _mm_max_ps(_mm_loadu_ps(x + j), zero));
+#endif
+    for (; j < n; ++j)
+        x[j] = x[j] > 0 ? x[j] : 0;
+}
+
+
+void apply_epilogue(
+    const GemmEpilogue &ep, int row0, int col0, int h, int w, float *c, int ldc
+) {
+    for (int i = 0; i < h; ++i) {
+        float *cr = c + size_t(i)*ldc;
+        float rb = ep.row_bias ? ep.row_bias[row0 + i] : 0;
+        if (ep.col_bias) {
+            const float *cb = ep.col_bias + col0;
+            for (int j = 0; j < w; ++j)
+                cr[j] += rb + cb[j];
+        } else if (rb != 0) {
+            for (int j = 0; j < w; ++j)
+                cr[j] += rb;
+        }
+        if (ep.relu)
+            relu_row(cr, w);
+    }
+}
+
+
+// element types of b, load widens one element to fp32
+void fp16_row_generic(const uint16_t *src, int len, float *dst) {
+    for (int p = 0; p < len; ++p)
+        dst[p] = fp16_to_float(src[p]);
+}
+
+
+#ifdef GEMM_X86
+__attribute__((target("avx,f16c")))
+void fp16_row_f16c(const uint16_t *src, int len, float *dst) {
+    int p = 0;
+    for (; p + 8 <= len; p += 8) {
+        __m128i h = _mm_loadu_si128((const __m128i*)(src + p));
+        _mm256_storeu_ps(dst + p, _mm256_cvtph_ps(h));
+    }
+    for (; p < len; ++p)
+        dst[p] = fp16_to_float(src[p]);
+}
+#endif
+
+
+typedef void (*Fp16Row)(const uint16_t*, int, float*);
+
+Fp16Row select_fp16_row() {
+#ifdef GEMM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c"))
+        return fp16_row_f16c;
+#endif
+    return fp16_row_generic;
+}
+
+
+// widen len weights of a row of b to fp32
+struct LoadFp32 {
+    typedef float Type;
+    static void load_row(const float *src, int len, float *dst) {
+        std::memcpy(dst, src, sizeof(float) * len);
+    }
+};
+
+struct LoadBf16 {
+    typedef uint16_t Type;
+    static void load_row(const uint16_t *src, int len, float *dst) {
+        for (int p = 0; p < len; ++p)
+            dst[p] = bf16_to_float(src[p]);
+    }
+};
+
+struct LoadFp16 {
+    typedef uint16_t Type;
+    static void load_row(const uint16_t *src, int len, float *dst) {
+        static const Fp16Row row = select_fp16_row();
+        row(src, len, dst);
+    }
+};
+
+
+// op(b)[0:kc, 0:nc] -> strips of nr columns, k-major, zero padded
+template <typename Load>
+void pack_b(
+    int kc, int nc, int nr, const typename Load::Type *b, int ldb, bool trans_b, float *bp
+) {
+    for (int j = 0; j < nc; j += nr) {
+        int w = std::min(nr, nc - j);
+        if (trans_b) {
+            // column j+q of op(b) is row j+q of b, widened into row first
+            float row[KC];
+            for (int q = 0; q < w; ++q) {
+                const float *src = row;
+                if constexpr (std::is_same<Load, LoadFp32>::value)
+                    src = b + size_t(j+q)*ldb;
+                else
+                    Load::load_row(b + size_t(j+q)*ldb, kc, row);
+                for (int p = 0; p < kc; ++p)
+                    bp[p*nr + q] = src[p];
+            }
+            for (int q = w; q < nr; ++q)
+                for (int p = 0; p < kc; ++p)
+                    bp[p*nr + q] = 0;
+            bp += size_t(kc) * nr;
+            continue;
+        }
+        for (int p = 0; p < kc; ++p) {
+            Load::load_row(b + size_t(p)*ldb + j, w, bp);
+            for (int q = w; q < nr; ++q)
+                bp[q] = 0;
+            bp += nr;
+        }
+    }
+}
+
+
+// a[0:mc, 0:kc] -> strips of mr rows, k-major, zero padded
+void pack_a(
+    int mc, int kc, int mr, const float *a, int lda, float *ap
+) {
+    for (int i = 0; i < mc; i += mr) {
+        int h = std::min(mr, mc - i);
+        for (int p = 0; p < kc; ++p) {
+            int q = 0;
+            for (; q < h; ++q)
+                ap[q] = a[size_t(i+q)*lda + p];
+            for (; q < mr; ++q)
+                ap[q] = 0;
+            ap += mr;
+        }
+    }
+}
+
+} // namespace gemm_detail
+
+
+const GemmKernel& gemm_kernel() {
+    static const GemmKernel kernel = gemm_detail::select_kernel();
+    return kernel;
+}
+
+
+namespace gemm_detail {
+
+template <typename Load>
+void gemm_serial(
+    int m, int n, int k,
+    const float *a, int lda, const typename Load::Type *b, int ldb,
+    float *c, int ldc, bool accumulate, const GemmEpilogue *ep, bool trans_b
+) {
+    if (m <= 0 || n <= 0)
+        return;
+    if (k <= 0) {
+        if (!accumulate)
+            for (int i = 0; i < m; ++i)
+                std::memset(c + size_t(i)*ldc, 0, n * sizeof(float));
+        if (ep)
+            apply_epilogue(*ep, 0, 0, m, n, c, ldc);
+        return;
+    }
+    const GemmKernel &kern = gemm_kernel();
+    int mr = kern.mr, nr = kern.nr;
+    // the packing buffers live as long as the thread and only ever grow
+    thread_local std::vector<float> abuf, bbuf;
+    size_t a_size = size_t(MC + mr) * KC;
+    size_t b_size = size_t(NC + nr) * KC;
+    if (abuf.size() < a_size)
+        abuf.resize(a_size);
+    if (bbuf.size() < b_size)
+        bbuf.resize(b_size);
+    float tile[16 * 32];
+
+    for (int jc = 0; jc < n; jc += NC) {
+        int nc = std::min(NC, n - jc);
+        for (int pc = 0; pc < k; pc += KC) {
+            int kc = std::min(KC, k - pc);
+            bool acc = accumulate || pc > 0;
+            const GemmEpilogue *tile_ep = pc + kc >= k ? ep : nullptr;
+            const typename Load::Type *bsrc =
+                trans_b ? b + size_t(jc)*ldb + pc : b + size_t(pc)*ldb + jc;
+            pack_b<Load>(kc, nc, nr, bsrc, ldb, trans_b, bbuf.data());
+            for (int ic = 0; ic < m; ic += MC) {
+                int mc = std::min(MC, m - ic);
+                pack_a(mc, kc, mr, a + size_t(ic)*lda + pc, lda, abuf.data());
+                for (int jr = 0; jr < nc; jr += nr) {
+                    int w = std::min(nr, nc - jr);
+                    const float *bp = bbuf.data() + size_t(jr)*kc;
+                    for (int ir = 0; ir < mc; ir += mr) {
+                        int h = std::min(mr, mc - ir);
+                        const float *ap = abuf.data() + size_t(ir)*kc;
+                        float *cp = c + size_t(ic+ir)*ldc + jc + jr;
+                        if (h == mr && w == nr) {
+                            kern.kernel(kc, ap, bp, cp, ldc, acc);
+                        } else {
+                            // edge tile: compute into a local tile and copy the valid part
+                            kern.kernel(kc, ap, bp, tile, nr, false);
+                            for (int i = 0; i < h; ++i) {
+                                float *cr = cp + size_t(i)*ldc;
+                                const float *tr = tile + i*nr;
+                                if (acc) {
+                                    for (int j = 0; j < w; ++j)
+                                        cr[j] += tr[j];
+                                } else {
+                                    for (int j = 0; j < w; ++j)
+                                        cr[j] = tr[j];
+                                }
+                            }
+                        }
+                        if (tile_ep)
+                            apply_epilogue(*tile_ep, ic+ir, jc+jr, h, w, cp, ldc);
+                    }
+                }
+            }
+        }
+    }
+}
+
+
+// big products are split into independent column (or row) blocks aligned
+// to the micro-kernel tile, one block per thread of the shared pool
+template <typename Load>
+void gemm_split(
+    int m, int n, int k,
+    const float *a, int lda, const typename Load::Type *b, int ldb,
+    float *c, int ldc, bool accumulate, const GemmEpilogue *epilogue, bool trans_b
+) {
+    double work = double(m) * n * std::max(k, 1);
+    if (work < PARALLEL_MIN_WORK * 8.0) {
+        gemm_serial<Load>(m, n, k, a, lda, b, ldb, c, ldc, accumulate, epilogue, trans_b);
+        return;
+    }
+    const GemmKernel &kern = gemm_kernel();
+    if (n >= m) {
+        int nr = kern.nr, strips = (n + nr - 1) / nr;
+        int grain = std::max(1, int(PARALLEL_MIN_WORK * 8.0 / (double(m) * k * nr)));
+        parallel_for(0, strips, grain, [&](int sb, int se) {
+            int j0 = sb * nr, j1 = std::min(n, se * nr);
+            GemmEpilogue ep, *pep = nullptr;
+            if (epilogue) {
+                ep = *epilogue;
+                if (ep.col_bias)
+                    ep.col_bias += j0;
+                pep = &ep;
+            }
+            const typename Load::Type *bj = trans_b ? b + size_t(j0)*ldb : b + j0;
+            gemm_serial<Load>(m, j1 - j0, k, a, lda, bj, ldb, c + j0, ldc, accumulate, pep, trans_b);
+        });
+    } else {
+        int mr = kern.mr, strips = (m + mr - 1) / mr;
+        int grain = std::max(1, int(PARALLEL_MIN_WORK * 8.0 / (double(n) * k * mr)));
+        parallel_for(0, strips, grain, [&](int sb, int se) {
+            int i0 = sb * mr, i1 = std::min(m, se * mr);
+            GemmEpilogue ep, *pep = nullptr;
+            if (epilogue) {
+                ep = *epilogue;
+                if (ep.row_bias)
+                    ep.row_bias += i0;
+                pep = &ep;
+            }
+            gemm_serial<Load>(
+                i1 - i0, n, k, a + size_t(i0)*lda, lda, b, ldb,
+                c + size_t(i0)*ldc, ldc, accumulate, pep, trans_b
+            );
+        });
+    }
+}
+
+} // namespace gemm_detail
+
+
+void gemm(
+    int m, int n, int k,
+    const float *a, int lda, const float *b, int ldb,
+    float *c, int ldc, bool accumulate, const GemmEpilogue *epilogue, bool trans_b
+) {
+    gemm_detail::gemm_split<gemm_detail::LoadFp32>(
+        m, n, k, a, lda, b, ldb, c, ldc, accumulate, epilogue, trans_b
+    );
+}
+
+
+void gemm(
+    int m, int n, int k,
+    const float *a, int lda, const uint16_t *b, int ldb, WeightPrecision precision,
+    float *c, int ldc, bool accumulate, const GemmEpilogue *epilogue, bool trans_b
+) {
+    using namespace gemm_detail;
+    if (precision == WEIGHT_BF16) {
+        gemm_split<LoadBf16>(m, n, k, a, lda, b, ldb, c, ldc, accumulate, epilogue, trans_b);
+    } else if (precision == WEIGHT_FP16) {
+        gemm_split<LoadFp16>(m, n, k, a, lda, b, ldb, c, ldc, accumulate, epilogue, trans_b);
+    } else {
+        std::cerr << "gemm error: b is not a 16 bit format!" << std::endl;
+        exit(0);
+    }
+}
+
+#endif
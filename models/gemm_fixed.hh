@@ -0,0 +1,267 @@
+#ifndef GEMM_FIXED_HH
+#define GEMM_FIXED_HH
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+
+#include "thread_pool.hh"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GEMM_FIXED_X86 1
+#endif
+
+// the square hidden linears of a model (dim x dim, dim one of the common
+// hidden sizes) with the size known at compile time:
+//     c = act(a * W^T + bias),  a is m x dim, c is m x dim
+// the weight is packed once, k-major (wt[p*dim + j] = W[j][p]), and small
+// enough to stay in cache, so there is no packing per call and no edge
+// tile: every loop bound is a constant and the register tile of each
+// kernel is fully unrolled. a table holds one kernel per size for the
+// features of the cpu (avx512f, avx2+fma, or a portable fallback), other
+// sizes keep using gemm
+typedef void (*FixedLinearFn)(
+    int m, const float *a, int lda, const float *wt,
+    const float *bias, bool relu, float *c, int ldc
+);
+
+struct FixedLinearKernel {
+    const char *name;
+    int dim;
+    FixedLinearFn fn;
+};
+
+// null when there is no kernel for dim
+const FixedLinearKernel* fixed_linear_kernel(int dim);
+// w is dim x dim (the layout of a linear weight, row stride ldw)
+void pack_fixed_weight(const float *w, int dim, int ldw, std::vector<float> &wt);
+void fixed_linear(
+    const FixedLinearKernel &kernel, int m, const float *a, int lda, const float *wt,
+    const float *bias, bool relu, float *c, int ldc
+);
+
+
+namespace fixed_detail {
+
+// the rows handed to a thread, a multiple of the row tile of every kernel
+const int FIXED_STRIP = 24;
+
+// R rows, 16 columns at a time
+template <int D, int R>
+void rows_generic(
+    const float *a, int lda, const float *wt, const float *bias, bool relu,
+    float *c, int ldc
+) {
+    for (int j0 = 0; j0 < D; j0 += 16) {
+        float acc[R][16];
+        for (int r = 0; r < R; ++r)
+            for (int j = 0; j < 16; ++j)
+                acc[r][j] = bias[j0 + j];
+        for (int p = 0; p < D; ++p) {
+            const float *w = wt + p*D + j0;
+            for (int r = 0; r < R; ++r) {
+                float av = a[r*lda + p];
+                for (int j = 0; j < 16; ++j)
+                    acc[r][j] += av * w[j];
+            }
+        }
+        for (int r = 0; r < R; ++r) {
+            float *cr = c + r*ldc + j0;
+            for (int j = 0; j < 16; ++j)
+                cr[j] = relu && acc[r][j] < 0 ? 0 : acc[r][j];
+        }
+    }
+}
+
+
+template <int D>
+void linear_generic(
+    int m, const float *a, int lda, const float *wt,
+    const float *bias, bool relu, float *c, int ldc
+) {
+    int i = 0;
+    for (; i + 4 <= m; i += 4)
+        rows_generic<D, 4>(a + size_t(i)*lda, lda, wt, bias, relu, c + size_t(i)*ldc, ldc);
+    for (; i < m; ++i)
+        rows_generic<D, 1>(a + size_t(i)*lda, lda, wt, bias, relu, c + size_t(i)*ldc, ldc);
+}
+
+
+#ifdef GEMM_FIXED_X86
+
+// gcc 12 warns that the _mm512_undefined_ps inside the avx512 intrinsics
+// may be used uninitialized, a false positive
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+// R rows x V vectors of 16 columns in zmm registers (R*V <= 24)
+template <int D, int R, int V>
+__attribute__((target("avx512f")))
+inline void rows_avx512(
+    const float *a, int lda, const float *wt, const float *bias, bool relu,
+    float *c, int ldc
+) {
+    for (int j0 = 0; j0 < D; j0 += V*16) {
+        __m512 acc[R][V];
+#pragma GCC unroll 24
+        for (int r = 0; r < R; ++r)
+#pragma GCC unroll 4
+            for (int v = 0; v < V; ++v)
+                acc[r][v] = _mm512_loadu_ps(bias + j0 + v*16);
+        for (int p = 0; p < D; ++p) {
+            __m512 w[V];
+#pragma GCC unroll 4
+            for (int v = 0; v < V; ++v)
+                w[v] = _mm512_loadu_ps(wt + p*D + j0 + v*16);
+#pragma GCC unroll 24
+            for (int r = 0; r < R; ++r) {
+                __m512 av = _mm512_set1_ps(a[r*lda + p]);
+#pragma GCC unroll 4
+                for (int v = 0; v < V; ++v)
+                    acc[r][v] = _mm512_fmadd_ps(av, w[v], acc[r][v]);
+            }
+        }
+        __m512 zero = _mm512_setzero_ps();
+#pragma GCC unroll 24
+        for (int r = 0; r < R; ++r)
+#pragma GCC unroll 4
+            for (int v = 0; v < V; ++v) {
+                __m512 x = relu ? _mm512_max_ps(acc[r][v], zero) : acc[r][v];
+                _mm512_storeu_ps(c + r*ldc + j0 + v*16, x);
+            }
+    }
+}
+
+
+template <int D>
+__attribute__((target("avx512f")))
+void linear_avx512(
+    int m, const float *a, int lda, const float *wt,
+    const float *bias, bool relu, float *c, int ldc
+) {
+    const int V = D/16 < 4 ? D/16 : 4, R = 24 / V;
+    int i = 0;
+    for (; i + R <= m; i += R)
+        rows_avx512<D, R, V>(a + size_t(i)*lda, lda, wt, bias, relu, c + size_t(i)*ldc, ldc);
+    for (; i < m; ++i)
+        rows_avx512<D, 1, V>(a + size_t(i)*lda, lda, wt, bias, relu, c + size_t(i)*ldc, ldc);
+}
+
+#pragma GCC diagnostic pop
+
+
+// R rows x V vectors of 8 columns in ymm registers (R*V <= 12)
+template <int D, int R, int V>
+__attribute__((target("avx2,fma")))
+inline void rows_avx2(
+    const float *a, int lda, const float *wt, const float *bias, bool relu,
+    float *c, int ldc
+) {
+    for (int j0 = 0; j0 < D; j0 += V*8) {
+        __m256 acc[R][V];
+#pragma GCC unroll 12
+        for (int r = 0; r < R; ++r)
+#pragma GCC unroll 4
+            for (int v = 0; v < V; ++v)
+                acc[r][v] = _mm256_loadu_ps(bias + j0 + v*8);
+        for (int p = 0; p < D; ++p) {
+            __m256 w[V];
+#pragma GCC unroll 4
+            for (int v = 0; v < V; ++v)
+                w[v] = _mm256_loadu_ps(wt + p*D + j0 + v*8);
+#pragma GCC unroll 12
+            for (int r = 0; r < R; ++r) {
+                __m256 av = _mm256_broadcast_ss(a + r*lda + p);
+#pragma GCC unroll 4
+                for (int v = 0; v < V; ++v)
+                    acc[r][v] = _mm256_fmadd_ps(av, w[v], acc[r][v]);
+            }
+        }
+        __m256 zero = _mm256_setzero_ps();
+#pragma GCC unroll 12
+        for (int r = 0; r < R; ++r)
+#pragma GCC unroll 4
+            for (int v = 0; v < V; ++v) {
+                __m256 x = relu ? _mm256_max_ps(acc[r][v], zero) : acc[r][v];
+                _mm256_storeu_ps(c + r*ldc + j0 + v*8, x);
+            }
+    }
+}
+
+
+template <int D>
+__attribute__((target("avx2,fma")))
+void linear_avx2(
+    int m, const float *a, int lda, const float *wt,
+    const float *bias, bool relu, float *c, int ldc
+) {
+    const int V = 4, R = 3;
+    int i = 0;
+    for (; i + R <= m; i += R)
+        rows_avx2<D, R, V>(a + size_t(i)*lda, lda, wt, bias, relu, c + size_t(i)*ldc, ldc);
+    for (; i < m; ++i)
+        rows_avx2<D, 1, V>(a + size_t(i)*lda, lda, wt, bias, relu, c + size_t(i)*ldc, ldc);
+}
+
+#endif // GEMM_FIXED_X86
+
+
+std::vector<FixedLinearKernel> select_kernels() {
+#ifdef GEMM_FIXED_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return {
+            {"avx512", 32, linear_avx512<32>}, {"avx512", 64, linear_avx512<64>},
+            {"avx512", 128, linear_avx512<128>}, {"avx512", 256, linear_avx512<256>}
+        };
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return {
+            {"avx2", 32, linear_avx2<32>}, {"avx2", 64, linear_avx2<64>},
+            {"avx2", 128, linear_avx2<128>}, {"avx2", 256, linear_avx2<256>}
+        };
+#endif
+    return {
+        {"generic", 32, linear_generic<32>}, {"generic", 64, linear_generic<64>},
+        {"generic", 128, linear_generic<128>}, {"generic", 256, linear_generic<256>}
+    };
+}
+
+} // namespace fixed_detail
+
+
+const FixedLinearKernel* fixed_linear_kernel(int dim) {
+    static const std::vector<FixedLinearKernel> table = fixed_detail::select_kernels();
+    for (auto &kernel : table)
+        if (kernel.dim == dim)
+            return &kernel;
+    return nullptr;
+}
+
+
+void pack_fixed_weight(const float *w, int dim, int ldw, std::vector<float> &wt) {
+    wt.resize(size_t(dim) * dim);
+    for (int j = 0; j < dim; ++j)
+        for (int p = 0; p < dim; ++p)
+            wt[size_t(p)*dim + j] = w[size_t(j)*ldw + p];
+}
+
+
+// the rows are split into strips over the shared pool
+void fixed_linear(
+    const FixedLinearKernel &kernel, int m, const float *a, int lda, const float *wt,
+    const float *bias, bool relu, float *c, int ldc
+) {
+    using fixed_detail::FIXED_STRIP;
+    int strips = (m + FIXED_STRIP - 1) / FIXED_STRIP;
+    double strip_work = double(FIXED_STRIP) * kernel.dim * kernel.dim;
+    int grain = std::max(1, int(PARALLEL_MIN_WORK * 8.0 / strip_work));
+    parallel_for(0, strips, grain, [&](int sb, int se) {
+        int i0 = sb * FIXED_STRIP, i1 = std::min(m, se * FIXED_STRIP);
+        kernel.fn(
+            i1 - i0, a + size_t(i0)*lda, lda, wt, bias, relu, c + size_t(i0)*ldc, ldc
+        );
+    });
+}
+
+#endif
@@ -0,0 +1,378 @@
+#ifndef GEMM_INT8_HH
+#define GEMM_INT8_HH
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+
+#include "thread_pool.hh"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GEMM_INT8_X86 1
+#endif
+
+// post-training int8 quantization of a linear layer y = x * W^T + b:
+//   the weight is quantized per output channel, symmetric to [-127, 127]
+//   with w_scale[j] = max |W[j]| / 127
+//   the input is quantized per tensor to u8 with a zero point, from a range
+//   observed on calibration data: q = round(x / x_scale) + zero_point
+// the u8 x s8 products are summed exactly in int32 (every micro-kernel
+// below gives the same sums) and turned back into
+//   y[i][j] = x_scale * w_scale[j] * (acc[i][j] - zero_point * sum_k qw[j][k]) + b[j]
+// the weight is packed once into blocks of 16 output channels, and inside
+// a block into groups of 4 consecutive k: byte (g*16 + q)*4 + t of block jb
+// is qw[jb*16 + q][g*4 + t], which is the operand layout of vpdpbusd
+
+// min and max of every value given to observe, the range an activation is
+// quantized with. a range that saw nothing is empty
+struct QuantRange {
+    float min, max;
+
+    QuantRange();
+    bool is_empty() const;
+    void observe(const float *x, int rows, int cols, int ld);
+};
+
+struct QuantizedWeight {
+    int n, k, k_pad;
+    float input_scale;
+    int zero_point;
+    std::vector<int8_t> packed;
+    // input_scale * w_scale[j] and zero_point * sum_k qw[j][k]
+    std::vector<float> scale;
+    std::vector<int32_t> offset;
+};
+
+void quantize_weight(
+    const float *w, int n, int k, int ldw, const QuantRange &input_range,
+    QuantizedWeight &qw
+);
+void gemm_int8(
+    int m, const float *a, int lda, const QuantizedWeight &qw,
+    const float *bias, bool relu, float *c, int ldc
+);
+
+// c (MR x 16, row stride 16) = the int32 products of MR u8 rows of a (row
+// stride lda, k_pad columns) with one packed block of 16 channels
+const int INT8_MR = 8;
+typedef void (*Int8MicroKernel)(
+    int k_pad, const uint8_t *a, int lda, const int8_t *bp, int32_t *c
+);
+
+// one strip of h <= MR rows: quantize a into qa (MR x k_pad), run the
+// micro-kernel on every block and write c = dequantized + bias (ReLU)
+typedef void (*Int8StripKernel)(
+    const QuantizedWeight &qw, int h, const float *a, int lda,
+    const float *bias, bool relu, float *c, int ldc, uint8_t *qa
+);
+
+struct Int8Kernel {
+    const char *name;
+    Int8MicroKernel kernel;
+    Int8StripKernel strip;
+};
+
+const Int8Kernel& int8_kernel();
+
+
+QuantRange::QuantRange() {
+    min = INFINITY;
+    max = -INFINITY;
+}
+
+
+inline bool QuantRange::is_empty() const {
+    return min > max;
+}
+
+
+void QuantRange::observe(const float *x, int rows, int cols, int ld) {
+    for (int i = 0; i < rows; ++i) {
+        const float *row = x + size_t(i) * ld;
+        for (int j = 0; j < cols; ++j) {
+            min = std::min(min, row[j]);
+            max = std::max(max, row[j]);
+        }
+    }
+}
+
+
+namespace int8_detail {
+
+// rows [0, m) of a -> u8, rows up to INT8_MR and columns up to k_pad are 0
+void quantize_rows(
+    int m, int k, const float *a, int lda, float inv_scale, int zero_point,
+    int k_pad, uint8_t *q
+) {
+    for (int i = 0; i < INT8_MR; ++i) {
+        uint8_t *qr = q + size_t(i) * k_pad;
+        if (i >= m) {
+            std::memset(qr, 0, k_pad);
+            continue;
+        }
+        const float *ar = a + size_t(i) * lda;
+        for (int j = 0; j < k; ++j) {
+            float v = std::min(std::max(ar[j] * inv_scale + zero_point, 0.0f), 255.0f);
+            qr[j] = uint8_t(v + 0.5f);
+        }
+        for (int j = k; j < k_pad; ++j)
+            qr[j] = 0;
+    }
+}
+
+
+// the strip with a scalar quantization and epilogue around any micro-kernel
+template <Int8MicroKernel KERNEL>
+void strip_generic(
+    const QuantizedWeight &qw, int h, const float *a, int lda,
+    const float *bias, bool relu, float *c, int ldc, uint8_t *qa
+) {
+    alignas(64) int32_t tile[INT8_MR * 16];
+    quantize_rows(h, qw.k, a, lda, 1 / qw.input_scale, qw.zero_point, qw.k_pad, qa);
+    for (int j0 = 0; j0 < qw.n; j0 += 16) {
+        int w = std::min(16, qw.n - j0);
+        KERNEL(qw.k_pad, qa, qw.k_pad, qw.packed.data() + size_t(j0) * qw.k_pad, tile);
+        for (int i = 0; i < h; ++i) {
+            float *cr = c + size_t(i) * ldc + j0;
+            const int32_t *tr = tile + i * 16;
+            for (int j = 0; j < w; ++j) {
+                float v = qw.scale[j0+j] * float(tr[j] - qw.offset[j0+j]);
+                if (bias)
+                    v += bias[j0+j];
+                cr[j] = relu && v < 0 ? 0 : v;
+            }
+        }
+    }
+}
+
+
+void kernel_generic(int k_pad, const uint8_t *a, int lda, const int8_t *bp, int32_t *c) {
+    for (int i = 0; i < INT8_MR; ++i) {
+        const uint8_t *ar = a + size_t(i) * lda;
+        int32_t acc[16] = {};
+        for (int g = 0; g < k_pad / 4; ++g) {
+            const int8_t *b = bp + g * 64;
+            for (int q = 0; q < 16; ++q)
+                for (int t = 0; t < 4; ++t)
+                    acc[q] += int32_t(ar[g*4 + t]) * b[q*4 + t];
+        }
+        std::memcpy(c + i * 16, acc, sizeof(acc));
+    }
+}
+
+
+#ifdef GEMM_INT8_X86
+
+inline int32_t load_group(const uint8_t *a) {
+    int32_t v;
+    std::memcpy(&v, a, sizeof(v));
+    return v;
+}
+
+
+#define INT8_VNNI_ROW(r) \
+    c##r = _mm512_dpbusd_epi32(c##r, _mm512_set1_epi32(load_group(a + r*lda + g*4)), b);
+
+// 8 rows x 16 channels, one vpdpbusd per row and group of 4 k
+__attribute__((target("avx512f,avx512vnni")))
+void kernel_avx512_vnni(int k_pad, const uint8_t *a, int lda, const int8_t *bp, int32_t *c) {
+    __m512i c0 = _mm512_setzero_si512(), c1 = _mm512_setzero_si512();
+    __m512i c2 = _mm512_setzero_si512(), c3 = _mm512_setzero_si512();
+    __m512i c4 = _mm512_setzero_si512(), c5 = _mm512_setzero_si512();
+    __m512i c6 = _mm512_setzero_si512(), c7 = _mm512_setzero_si512();
+    for (int g = 0; g < k_pad / 4; ++g) {
+        __m512i b = _mm512_loadu_si512(bp + g * 64);
+        INT8_VNNI_ROW(0) INT8_VNNI_ROW(1) INT8_VNNI_ROW(2) INT8_VNNI_ROW(3)
+        INT8_VNNI_ROW(4) INT8_VNNI_ROW(5) INT8_VNNI_ROW(6) INT8_VNNI_ROW(7)
+    }
+    _mm512_storeu_si512(c, c0);
+    _mm512_storeu_si512(c + 16, c1);
+    _mm512_storeu_si512(c + 32, c2);
+    _mm512_storeu_si512(c + 48, c3);
+    _mm512_storeu_si512(c + 64, c4);
+    _mm512_storeu_si512(c + 80, c5);
+    _mm512_storeu_si512(c + 96, c6);
+    _mm512_storeu_si512(c + 112, c7);
+}
+
+#undef INT8_VNNI_ROW
+
+
+// gcc 12 warns that the _mm512_undefined_ps inside the avx512 intrinsics
+// may be used uninitialized, a false positive
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+// the same strip as strip_generic, with the quantization and the epilogue
+// on 16 lanes (masked at the edges)
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+void strip_avx512_vnni(
+    const QuantizedWeight &qw, int h, const float *a, int lda,
+    const float *bias, bool relu, float *c, int ldc, uint8_t *qa
+) {
+    const __m512 inv_scale = _mm512_set1_ps(1 / qw.input_scale);
+    const __m512 zero_point = _mm512_set1_ps(float(qw.zero_point));
+    const __m512 zero = _mm512_setzero_ps(), top = _mm512_set1_ps(255.0f);
+    const __m512 half = _mm512_set1_ps(0.5f);
+    for (int i = 0; i < INT8_MR; ++i) {
+        uint8_t *qr = qa + size_t(i) * qw.k_pad;
+        if (i >= h) {
+            std::memset(qr, 0, qw.k_pad);
+            continue;
+        }
+        const float *ar = a + size_t(i) * lda;
+        for (int j = 0; j < qw.k_pad; j += 16) {
+            __mmask16 load = qw.k - j >= 16 ? 0xffff : qw.k > j ? (1u << (qw.k - j)) - 1 : 0;
+            __mmask16 store = qw.k_pad - j >= 16 ? 0xffff : (1u << (qw.k_pad - j)) - 1;
+            __m512 v = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(load, ar + j), inv_scale, zero_point);
+            v = _mm512_min_ps(_mm512_max_ps(v, zero), top);
+            __m512i q = _mm512_maskz_cvttps_epi32(load, _mm512_add_ps(v, half));
+            _mm512_mask_cvtepi32_storeu_epi8(qr + j, store, q);
+        }
+    }
+    alignas(64) int32_t tile[INT8_MR * 16];
+    for (int j0 = 0; j0 < qw.n; j0 += 16) {
+        int w = std::min(16, qw.n - j0);
+        __mmask16 mask = w == 16 ? 0xffff : (1u << w) - 1;
+        kernel_avx512_vnni(qw.k_pad, qa, qw.k_pad, qw.packed.data() + size_t(j0) * qw.k_pad, tile);
+        __m512 scale = _mm512_maskz_loadu_ps(mask, qw.scale.data() + j0);
+        __m512i offset = _mm512_maskz_loadu_epi32(mask, qw.offset.data() + j0);
+        __m512 b = bias ? _mm512_maskz_loadu_ps(mask, bias + j0) : zero;
+        for (int i = 0; i < h; ++i) {
+            __m512i acc = _mm512_sub_epi32(_mm512_load_si512(tile + i * 16), offset);
+            __m512 v = _mm512_add_ps(_mm512_mul_ps(scale, _mm512_cvtepi32_ps(acc)), b);
+            if (relu)
+                v = _mm512_max_ps(v, zero);
+            _mm512_mask_storeu_ps(c + size_t(i) * ldc + j0, mask, v);
+        }
+    }
+}
+
+#pragma GCC diagnostic pop
+
+
+// without vnni the bytes are widened to int16 and vpmaddwd sums pairs of k
+// without saturating (vpmaddubsw could). the two pair sums of a channel
+// land in neighbouring lanes, one vphaddd per 8 channels adds them, in the
+// lane order 0 1 4 5 2 3 6 7 that is undone once at the end
+__attribute__((target("avx2")))
+void kernel_avx2(int k_pad, const uint8_t *a, int lda, const int8_t *bp, int32_t *c) {
+    __m256i acc[INT8_MR][2];
+    for (int i = 0; i < INT8_MR; ++i)
+        acc[i][0] = acc[i][1] = _mm256_setzero_si256();
+    for (int g = 0; g < k_pad / 4; ++g) {
+        const int8_t *b = bp + g * 64;
+        __m256i b0 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)b));
+        __m256i b1 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(b + 16)));
+        __m256i b2 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(b + 32)));
+        __m256i b3 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(b + 48)));
+        for (int i = 0; i < INT8_MR; ++i) {
+            __m256i av = _mm256_cvtepu8_epi16(
+                _mm_set1_epi32(load_group(a + size_t(i) * lda + g*4))
+            );
+            __m256i lo = _mm256_hadd_epi32(_mm256_madd_epi16(av, b0), _mm256_madd_epi16(av, b1));
+            __m256i hi = _mm256_hadd_epi32(_mm256_madd_epi16(av, b2), _mm256_madd_epi16(av, b3));
+            acc[i][0] = _mm256_add_epi32(acc[i][0], lo);
+            acc[i][1] = _mm256_add_epi32(acc[i][1], hi);
+        }
+    }
+    const __m256i order = _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7);
+    for (int i = 0; i < INT8_MR; ++i) {
+        _mm256_storeu_si256((__m256i*)(c + i*16), _mm256_permutevar8x32_epi32(acc[i][0], order));
+        _mm256_storeu_si256((__m256i*)(c + i*16 + 8), _mm256_permutevar8x32_epi32(acc[i][1], order));
+    }
+}
+
+#endif // GEMM_INT8_X86
+
+
+Int8Kernel select_kernel() {
+#ifdef GEMM_INT8_X86
+    __builtin_cpu_init();
+    if (
+        __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+        __builtin_cpu_supports("avx512vnni")
+    )
+        return Int8Kernel{"avx512vnni", kernel_avx512_vnni, strip_avx512_vnni};
+    if (__builtin_cpu_supports("avx2"))
+        return Int8Kernel{"avx2", kernel_avx2, strip_generic<kernel_avx2>};
+#endif
+    return Int8Kernel{"generic", kernel_generic, strip_generic<kernel_generic>};
+}
+
+
+} // namespace int8_detail
+
+
+const Int8Kernel& int8_kernel() {
+    static const Int8Kernel kernel = int8_detail::select_kernel();
+    return kernel;
+}
+
+
+// w is n x k (the layout of a linear weight, row stride ldw)
+void quantize_weight(
+    const float *w, int n, int k, int ldw, const QuantRange &input_range,
+    QuantizedWeight &qw
+) {
+    // the range always holds 0, so that 0 (padding, ReLU) is exact
+    float lo = std::min(input_range.min, 0.0f), hi = std::max(input_range.max, 0.0f);
+    qw.n = n;
+    qw.k = k;
+    qw.k_pad = (k + 3) / 4 * 4;
+    qw.input_scale = hi > lo ? (hi - lo) / 255 : 1;
+    qw.zero_point = std::min(255, std::max(0, int(std::lround(-lo / qw.input_scale))));
+    int blocks = (n + 15) / 16;
+    qw.packed.assign(size_t(blocks) * 16 * qw.k_pad, 0);
+    qw.scale.assign(n, 0);
+    qw.offset.assign(n, 0);
+    for (int j = 0; j < n; ++j) {
+        const float *row = w + size_t(j) * ldw;
+        float max_abs = 0;
+        for (int p = 0; p < k; ++p)
+            max_abs = std::max(max_abs, std::fabs(row[p]));
+        float w_scale = max_abs > 0 ? max_abs / 127 : 1;
+        int8_t *block = qw.packed.data() + size_t(j / 16) * 16 * qw.k_pad;
+        int q = j % 16, sum = 0;
+        for (int p = 0; p < k; ++p) {
+            int v = int(std::lround(row[p] / w_scale));
+            v = std::min(127, std::max(-127, v));
+            block[(p/4 * 16 + q) * 4 + p%4] = v;
+            sum += v;
+        }
+        qw.scale[j] = qw.input_scale * w_scale;
+        qw.offset[j] = qw.zero_point * sum;
+    }
+}
+
+
+// c = dequantize(quantize(a) * qw) + bias (then ReLU), a is m x qw.k.
+// every strip of INT8_MR rows is quantized into a per-thread buffer right
+// before its products, so the u8 copy of a is never stored as a whole
+void gemm_int8(
+    int m, const float *a, int lda, const QuantizedWeight &qw,
+    const float *bias, bool relu, float *c, int ldc
+) {
+    const Int8StripKernel strip = int8_kernel().strip;
+    int strips = (m + INT8_MR - 1) / INT8_MR;
+    double strip_work = double(INT8_MR) * qw.k_pad * qw.n;
+    int grain = std::max(1, int(PARALLEL_MIN_WORK * 8.0 / strip_work));
+    parallel_for(0, strips, grain, [&](int sb, int se) {
+        thread_local std::vector<uint8_t> qa;
+        if (qa.size() < size_t(INT8_MR) * qw.k_pad)
+            qa.resize(size_t(INT8_MR) * qw.k_pad);
+        for (int s = sb; s < se; ++s) {
+            int i0 = s * INT8_MR, h = std::min(INT8_MR, m - i0);
+            strip(
+                qw, h, a + size_t(i0) * lda, lda, bias, relu,
+                c + size_t(i0) * ldc, ldc, qa.data()
+            );
+        }
+    });
+}
+
+#endif
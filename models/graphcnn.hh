@@ -9,7 +9,13 @@
 #include "linear.hh"
 #include "batchnorm.hh"
 #include "mlp.hh"
+#include "sparse_matrix.hh"
+#include "model_file.hh"
+#include "workspace.hh"
+#include "batched_graph.hh"
+#include "profiler.hh"
 #include "../s2vgraph.hh"
+#include "../graph_arena.hh"
 
 class GraphCNN {
 private:
@@ -21,26 +27,31 @@ private:
     std::vector<Linear*> linears_;
     std::vector<BatchNorm*> batchnorms_;
     std::vector<MLP*> mlps_;
-
-    void build_linear(
-        const std::string& tag, 
-        std::map<std::string, std::vector<std::vector<float>> > &data
-    );
-    void build_mlp(
-        const std::string& tag, int input_dim, 
-        std::map<std::string, std::vector<std::vector<float>> > &data
-    );
-
-    void get_node_feature(const std::vector<S2VGraph*> &data, MyMatrix& node_feature);
-    void preprocess_graphpool(const std::vector<S2VGraph*> &data, MyMatrix& graph_pool);
-    void preprocess_neighbors_sumavepool(
-        const std::vector<S2VGraph*> &data, MyMatrix *adj_block
-    );
-    MyMatrix* maxpool(const std::vector<S2VGraph*> &data,MyMatrix* h, int max_degree);
-    MyMatrix* nextLayer(
-        MyMatrix* h, const std::vector<S2VGraph*> &data, 
-        int layer_idx, int max_degree, MyMatrix* neighbor_block
+    bool bn_folded_;
+    // every weight is a view on this image
+    ModelFile *model_file_;
+    // transposed first mlp linear and linears_prediction.0, the node tags
+    // index their rows (sum and average neighbor pooling only)
+    MyMatrix *input_embedding_, *readout_embedding_;
+
+    void build(
+        bool learn_eps,
+        const std::string &graph_pooling_type, const std::string &neighbor_pooling_type
     );
+    void build_linear(const std::string& tag);
+    void build_mlp(const std::string& tag, int input_dim);
+    void build_embeddings();
+
+    void get_node_feature(const BatchedGraph &graph, MyMatrix& node_feature) const;
+    void gather_node_tags(
+        const BatchedGraph &graph, const MyMatrix& table, MyMatrix& output
+    ) const;
+    void nextLayer(
+        const MyMatrix& h, int layer_idx, const SparseMatrix& neighbor_block,
+        MyMatrix& output, Workspace &ws
+    ) const;
+    void embeddedLayer(const BatchedGraph &graph, MyMatrix& output, Workspace &ws) const;
+    void embeddedReadout(const BatchedGraph &graph, MyMatrix& output) const;
 
 public:
     GraphCNN(
@@ -48,59 +59,95 @@ public:
         bool learn_eps, 
         const std::string &graph_pooling_type, const std::string &neighbor_pooling_type
     );
+    GraphCNN(
+        const std::string &model_path,
+        bool learn_eps, 
+        const std::string &graph_pooling_type, const std::string &neighbor_pooling_type
+    );
     ~GraphCNN();
 
-    int get_input_dim();
-    int get_output_dim();
-    void forward(const std::vector<S2VGraph*> &data, int tag_sum, MyMatrix &output);
+    void fold_batchnorms();
+    // post-training int8: calibrate runs forward over graphs and records
+    // the input range of every mlp linear ("mlps.i.linears.j"), quantize
+    // then switches the linears found in ranges to int8
+    void calibrate(
+        const GraphArena &arena, const std::vector<int> &graphs,
+        std::map<std::string, QuantRange> &ranges
+    );
+    void quantize(const std::map<std::string, QuantRange> &ranges);
+    // store the weights of every linear in bf16 or fp16, chosen at load
+    void set_weight_precision(WeightPrecision precision);
+    size_t get_weight_bytes() const;
+    // run the square mlp linears with the fixed size kernels of the hidden
+    // dimension (chosen when the model is built), or with gemm
+    void specialize_kernels(bool enable);
+    const FixedLinearKernel* get_fixed_kernel() const;
+    int get_input_dim() const;
+    int get_output_dim() const;
+    size_t get_workspace_size(int node_sum, int tag_sum) const;
+    // a batch is a list of graph indices into an arena, prepared once into
+    // the BatchedGraph every layer reads
+    void prepare(
+        const GraphArena &arena, const std::vector<int> &batch, BatchedGraph &graph
+    ) const;
+    // every matrix of the forward pass is node-major (one node or graph per
+    // row), output is batch size x output_dim and is added to
+    void forward(const std::vector<S2VGraph*> &data, int tag_sum, MyMatrix &output) const;
+    void forward(
+        const std::vector<S2VGraph*> &data, int tag_sum, MyMatrix &output, Workspace &ws
+    ) const;
+    void forward(
+        const GraphArena &arena, const std::vector<int> &batch, MyMatrix &output, Workspace &ws
+    ) const;
+    void forward(const BatchedGraph &graph, MyMatrix &output, Workspace &ws) const;
 };
 
 
-void GraphCNN::build_linear(
-    const std::string& tag, 
-    std::map<std::string, std::vector<std::vector<float>> > &data
-) {
-    std::string weight_tag = tag + ".weight";
-    std::string bias_tag = tag + ".bias";
-    int input_dim = data[weight_tag][0].size();
-    int output_dim = data[weight_tag].size();
-    linears_.push_back(
-        new Linear(input_dim, output_dim, data[weight_tag], data[bias_tag][0])
-    );
+void GraphCNN::build_linear(const std::string& tag) {
+    linears_.push_back(new Linear(
+        model_file_->get(tag + ".weight"), model_file_->get(tag + ".bias")
+    ));
 }
 
 
 // tag: mlps.x.
-void GraphCNN::build_mlp(
-    const std::string& tag, int input_dim,
-    std::map<std::string, std::vector<std::vector<float>> > &data
-) {
-    std::string linear_tag = tag + "linears.";
-    std::vector<std::vector<float>> mlp_data;
-    for (int i = 0; i < mlp_num_layers_; ++i) {
-        std::string weight_tag = linear_tag + std::to_string(i) + ".weight";
-        std::string bias_tag = linear_tag + std::to_string(i) + ".bias";
-        for (const auto &line : data[weight_tag])
-            mlp_data.push_back(line);
-        mlp_data.push_back(data[bias_tag][0]);
-    }
-    std::string bn_tag = tag + "batch_norms.";
-    for (int i = 0; i < mlp_num_layers_-1; ++i) {
-        mlp_data.push_back(data[bn_tag + std::to_string(i) + ".weight"][0]);
-        mlp_data.push_back(data[bn_tag + std::to_string(i) + ".bias"][0]);
-        mlp_data.push_back(data[bn_tag + std::to_string(i) + ".running_mean"][0]);
-        mlp_data.push_back(data[bn_tag + std::to_string(i) + ".running_var"][0]);
-    }
-    mlps_.push_back(new MLP(input_dim, hidden_dim_, hidden_dim_, mlp_num_layers_, mlp_data));
+void GraphCNN::build_mlp(const std::string& tag, int input_dim) {
+    mlps_.push_back(new MLP(
+        *model_file_, tag, input_dim, hidden_dim_, hidden_dim_, mlp_num_layers_
+    ));
 }
 
 
+// the text model is laid out like a binary model file in memory
 GraphCNN::GraphCNN(
     std::map<std::string, std::vector<std::vector<float>> > &data, 
     bool learn_eps, 
     const std::string &graph_pooling_type, const std::string &neighbor_pooling_type
 ) {
-    num_layers_ = data["eps"][0].size() + 1;
+    model_file_ = ModelFile::from_text(data);
+    input_embedding_ = readout_embedding_ = nullptr;
+    build(learn_eps, graph_pooling_type, neighbor_pooling_type);
+}
+
+
+// map a binary model file, the weights are used in place
+GraphCNN::GraphCNN(
+    const std::string &model_path,
+    bool learn_eps, 
+    const std::string &graph_pooling_type, const std::string &neighbor_pooling_type
+) {
+    model_file_ = ModelFile::open(model_path);
+    input_embedding_ = readout_embedding_ = nullptr;
+    build(learn_eps, graph_pooling_type, neighbor_pooling_type);
+}
+
+
+void GraphCNN::build(
+    bool learn_eps,
+    const std::string &graph_pooling_type, const std::string &neighbor_pooling_type
+) {
+    const ModelTensor &eps = model_file_->get("eps");
+    num_layers_ = eps.cols + 1;
     if (num_layers_ <= 1) {
         std::cerr << "error: invalid value of num_layer!" << std::endl;
         exit(0);
@@ -108,39 +155,154 @@ GraphCNN::GraphCNN(
     learn_eps_ = learn_eps;
     graph_pooling_type_ = graph_pooling_type;
     neighbor_pooling_type_ = neighbor_pooling_type;
-    for (auto e : data["eps"][0]) 
-        epss_.push_back(e);
+    for (int i = 0; i < eps.cols; ++i) 
+        epss_.push_back(eps.data[i]);
     // linear, and get the size of model by the way
-    input_dim_ = data["linears_prediction.0.weight"][0].size();
-    output_dim_ = data["linears_prediction.0.weight"].size();
-    build_linear("linears_prediction.0", data);
-    hidden_dim_ = data["linears_prediction.1.weight"][0].size();
+    input_dim_ = model_file_->get("linears_prediction.0.weight").cols;
+    output_dim_ = model_file_->get("linears_prediction.0.weight").rows;
+    build_linear("linears_prediction.0");
+    hidden_dim_ = model_file_->get("linears_prediction.1.weight").cols;
     std::string linear_tag = "linears_prediction.";
     for (int i = 1; i < num_layers_; ++i)
-        build_linear(linear_tag+std::to_string(i), data);
+        build_linear(linear_tag+std::to_string(i));
     // batchnorm
     for (int i = 0; i < num_layers_-1; ++i) {
-        std::string gamma_tag = "batch_norms." + std::to_string(i) + ".weight";
-        std::string beta_tag = "batch_norms." + std::to_string(i) + ".bias";
-        std::string rm_tag = "batch_norms." + std::to_string(i) + ".running_mean";
-        std::string rv_tag = "batch_norms." + std::to_string(i) + ".running_var";
-        batchnorms_.push_back(
-            new BatchNorm(
-                hidden_dim_, data[gamma_tag][0], data[beta_tag][0], 
-                data[rm_tag][0], data[rv_tag][0]
-            )
-        );
+        std::string bn_tag = "batch_norms." + std::to_string(i);
+        batchnorms_.push_back(new BatchNorm(
+            model_file_->get(bn_tag + ".weight"), model_file_->get(bn_tag + ".bias"),
+            model_file_->get(bn_tag + ".running_mean"), model_file_->get(bn_tag + ".running_var")
+        ));
     }
     // mlp
     mlp_num_layers_ = 0;
-    while (true) {
-        if (data.find("mlps.0.linears." + std::to_string(mlp_num_layers_) + ".bias") == data.end())
-            break;
+    while (model_file_->has("mlps.0.linears." + std::to_string(mlp_num_layers_) + ".bias"))
         ++mlp_num_layers_;
-    }
-    build_mlp("mlps.0.", input_dim_, data);
+    build_mlp("mlps.0.", input_dim_);
     for (int i = 1; i < num_layers_-1; ++i)
-        build_mlp("mlps." + std::to_string(i) + ".", hidden_dim_, data);
+        build_mlp("mlps." + std::to_string(i) + ".", hidden_dim_);
+    bn_folded_ = false;
+    build_embeddings();
+    fold_batchnorms();
+    specialize_kernels(true);
+}
+
+
+// the node features are one-hot tags, so multiplying them by a weight only
+// picks rows of its transpose. with a max neighbor pooling the features go
+// through a max before the first linear and the dense path is used
+void GraphCNN::build_embeddings() {
+    delete input_embedding_;
+    delete readout_embedding_;
+    input_embedding_ = readout_embedding_ = nullptr;
+    if (neighbor_pooling_type_ == "max")
+        return;
+    input_embedding_ = mlps_[0]->get_first_linear().get_embedding();
+    readout_embedding_ = linears_[0]->get_embedding();
+}
+
+
+// load-time optimization: inference only uses the running statistics, so
+// every batch norm (inside the mlps and after them) becomes part of the
+// weights of the linear before it, and each hidden layer runs as a single
+// gemm + bias + ReLU kernel
+void GraphCNN::fold_batchnorms() {
+    if (bn_folded_)
+        return;
+    for (int i = 0; i < num_layers_-1; ++i)
+        mlps_[i]->fold_batchnorms(batchnorms_[i]);
+    bn_folded_ = true;
+    build_embeddings();
+}
+
+
+// single threaded, in batches of 64 graphs. a linear that never ran (the
+// first one when it is gathered from its embedding) gets no range
+void GraphCNN::calibrate(
+    const GraphArena &arena, const std::vector<int> &graphs,
+    std::map<std::string, QuantRange> &ranges
+) {
+    ranges.clear();
+    for (int i = 0; i < num_layers_-1; ++i)
+        for (int j = 0; j < mlps_[i]->get_num_layers(); ++j) {
+            std::string name = "mlps." + std::to_string(i) + ".linears." + std::to_string(j);
+            mlps_[i]->get_linear(j).set_observer(&ranges[name]);
+        }
+    Workspace ws;
+    std::vector<int> batch;
+    for (int begin_idx = 0; begin_idx < graphs.size(); begin_idx += 64) {
+        int end_idx = std::min(begin_idx + 64, int(graphs.size()));
+        batch.assign(graphs.begin() + begin_idx, graphs.begin() + end_idx);
+        int node_sum = 0;
+        for (auto g : batch)
+            node_sum += arena.get_node_sum(g);
+        ws.reserve(
+            Workspace::matrix_bytes(batch.size(), output_dim_) +
+            get_workspace_size(node_sum, arena.get_tag_sum())
+        );
+        MyMatrix output = ws.matrix(batch.size(), output_dim_, true);
+        forward(arena, batch, output, ws);
+        ws.reset();
+    }
+    for (int i = 0; i < num_layers_-1; ++i)
+        for (int j = 0; j < mlps_[i]->get_num_layers(); ++j)
+            mlps_[i]->get_linear(j).set_observer(nullptr);
+    for (auto it = ranges.begin(); it != ranges.end();) {
+        if (it->second.is_empty())
+            it = ranges.erase(it);
+        else
+            ++it;
+    }
+}
+
+
+void GraphCNN::quantize(const std::map<std::string, QuantRange> &ranges) {
+    fold_batchnorms();
+    for (int i = 0; i < num_layers_-1; ++i)
+        for (int j = 0; j < mlps_[i]->get_num_layers(); ++j) {
+            std::string name = "mlps." + std::to_string(i) + ".linears." + std::to_string(j);
+            auto it = ranges.find(name);
+            if (it != ranges.end())
+                mlps_[i]->get_linear(j).quantize(it->second);
+        }
+}
+
+
+// the embeddings are built from the fp32 weights first and stay in fp32
+void GraphCNN::set_weight_precision(WeightPrecision precision) {
+    fold_batchnorms();
+    for (auto p : linears_)
+        p->set_precision(precision);
+    for (auto m : mlps_)
+        for (int j = 0; j < m->get_num_layers(); ++j)
+            m->get_linear(j).set_precision(precision);
+}
+
+
+size_t GraphCNN::get_weight_bytes() const {
+    size_t bytes = 0;
+    for (auto p : linears_)
+        bytes += p->get_weight_bytes();
+    for (auto m : mlps_)
+        for (int j = 0; j < m->get_num_layers(); ++j)
+            bytes += m->get_linear(j).get_weight_bytes();
+    return bytes;
+}
+
+
+void GraphCNN::specialize_kernels(bool enable) {
+    for (auto m : mlps_)
+        for (int j = 0; j < m->get_num_layers(); ++j)
+            m->get_linear(j).specialize(enable);
+}
+
+
+// the kernel of the hidden linears, null when they run with gemm
+const FixedLinearKernel* GraphCNN::get_fixed_kernel() const {
+    for (auto m : mlps_)
+        for (int j = 0; j < m->get_num_layers(); ++j)
+            if (m->get_linear(j).get_fixed_kernel() != nullptr)
+                return m->get_linear(j).get_fixed_kernel();
+    return nullptr;
 }
 
 
@@ -151,201 +313,313 @@ GraphCNN::~GraphCNN() {
         delete p;
     for (auto p : mlps_)
         delete p;
+    delete input_embedding_;
+    delete readout_embedding_;
+    delete model_file_;
 }
 
 
-inline int GraphCNN::get_input_dim() {
+inline int GraphCNN::get_input_dim() const {
     return input_dim_;
 }
 
 
-inline int GraphCNN::get_output_dim() {
+inline int GraphCNN::get_output_dim() const {
     return output_dim_;
 }
 
 
-void GraphCNN::get_node_feature(
-    const std::vector<S2VGraph*> &data, MyMatrix &node_feature
-) {
-    int begin_idx = 0;
-    for (const auto &g : data) {
-        auto f = g->get_node_features();
-        for (const auto &p : f)
-            node_feature.set_value(1, p.first + begin_idx, p.second);
-        begin_idx += g->get_node_sum();
+void GraphCNN::get_node_feature(const BatchedGraph &graph, MyMatrix &node_feature) const {
+    for (int v = 0; v < graph.get_node_sum(); ++v)
+        node_feature.set_value(1, v, graph.get_tag(v));
+}
+
+
+// output (node_sum x table width) = the one-hot node features times the
+// table, i.e. the table rows of the tags of every node
+void GraphCNN::gather_node_tags(
+    const BatchedGraph &graph, const MyMatrix& table, MyMatrix& output
+) const {
+    int dim = table.get_row_width(), table_ld = table.get_ld(), ld = output.get_ld();
+    const float *t = table.get_data();
+    float *out = output.get_data();
+    for (int v = 0; v < graph.get_node_sum(); ++v) {
+        int tag = graph.get_tag(v);
+        if (tag >= table.get_col_width()) {
+            std::cerr << "gather error: node tag out of range!" << std::endl;
+            exit(0);
+        }
+        float *o = out + size_t(v) * ld;
+        const float *row = t + size_t(tag) * table_ld;
+        for (int j = 0; j < dim; ++j)
+            o[j] += row[j];
     }
 }
 
 
-void GraphCNN::preprocess_graphpool(
-    const std::vector<S2VGraph*> &data, MyMatrix& graph_pool
-) {
-    int begin_idx = 0;
-    for (int i = 0; i < data.size(); ++i) {
-        float elem = 0;
-        int g_node_sum = data[i]->get_node_sum();
-        if (graph_pooling_type_ == "average")
-            elem = 1/float(g_node_sum);
-        else 
-            elem = 1;
-        for (int j = 0; j < g_node_sum; ++j)
-            graph_pool.set_value(elem, i, begin_idx+j);
-        begin_idx += g_node_sum;
+// output = the next hidden representation of h (node_sum x hidden_dim),
+// the scratch matrices come from ws and are given back before returning
+void GraphCNN::nextLayer(
+    const MyMatrix& h, int layer_idx, const SparseMatrix& neighbor_block,
+    MyMatrix& output, Workspace &ws
+) const {
+    size_t mark = ws.get_mark();
+    int node_sum = h.get_col_width(), dim = h.get_row_width();
+    MyMatrix pooled = ws.matrix(node_sum, dim);
+    {
+        PGNN_PROFILE_SCOPE(
+            "aggregate", layer_idx, double(neighbor_block.get_nnz()) * dim,
+            Workspace::matrix_bytes(node_sum, dim), &ws
+        );
+        if (neighbor_pooling_type_ == "max")
+            neighbor_block.gather_max(h, pooled);
+        else
+            neighbor_block.mult(h, pooled);
+        if (learn_eps_) {
+            MyMatrix tmp = ws.matrix(node_sum, dim);
+            tmp.copy(h);
+            tmp.mult(epss_[layer_idx] + 1);
+            pooled.add(pooled, tmp);
+        }
+    }
+    {
+        PGNN_PROFILE_SCOPE(
+            "mlp", layer_idx, mlps_[layer_idx]->get_flops(node_sum),
+            Workspace::matrix_bytes(node_sum, hidden_dim_), &ws
+        );
+        mlps_[layer_idx]->forward(pooled, output, ws);
+    }
+    if (!bn_folded_) {
+        {
+            PGNN_PROFILE_SCOPE(
+                "batchnorm", layer_idx, 2.0 * node_sum * hidden_dim_,
+                Workspace::matrix_bytes(node_sum, hidden_dim_)
+            );
+            batchnorms_[layer_idx]->forward(output, output);
+        }
+        PGNN_PROFILE_SCOPE(
+            "relu", layer_idx, double(node_sum) * hidden_dim_,
+            Workspace::matrix_bytes(node_sum, hidden_dim_)
+        );
+        output.activation(output, "ReLU");
     }
+    ws.release(mark);
 }
 
 
-void GraphCNN::preprocess_neighbors_sumavepool(
-    const std::vector<S2VGraph*> &data, MyMatrix *adj_block
-) {
-    int begin_idx = 0;
-    for (auto g : data) {
-        int g_node_sum = g->get_node_sum();
-        auto g_edges = g->get_edges();
-        for (const auto &p : g_edges)
-            adj_block->set_value(1, p.first+begin_idx, p.second+begin_idx);
-        if (!learn_eps_) {
-            for (int i = 0; i < g_node_sum; ++i)
-                adj_block->set_value(1, i+begin_idx, i+begin_idx);
+// layer 0 on the node tags: A * X * W^T = A * (X * W^T), and X * W^T is a
+// gather of embedding rows, so the aggregation and the first gemm work on
+// hidden_dim wide rows whatever the number of tags
+void GraphCNN::embeddedLayer(const BatchedGraph &graph, MyMatrix& output, Workspace &ws) const {
+    size_t mark = ws.get_mark();
+    int node_sum = output.get_col_width(), dim = input_embedding_->get_row_width();
+    MyMatrix h = ws.matrix(node_sum, dim, true);
+    {
+        PGNN_PROFILE_SCOPE(
+            "gather", 0, double(node_sum) * dim,
+            Workspace::matrix_bytes(node_sum, dim)
+        );
+        gather_node_tags(graph, *input_embedding_, h);
+    }
+    MyMatrix pooled = ws.matrix(node_sum, dim);
+    {
+        PGNN_PROFILE_SCOPE(
+            "aggregate", 0, double(graph.get_adjacency().get_nnz()) * dim,
+            Workspace::matrix_bytes(node_sum, dim)
+        );
+        graph.get_adjacency().mult(h, pooled);
+        if (learn_eps_) {
+            h.mult(epss_[0] + 1);
+            pooled.add(pooled, h);
+        }
+    }
+    {
+        PGNN_PROFILE_SCOPE(
+            "mlp", 0, mlps_[0]->get_flops(node_sum, true),
+            Workspace::matrix_bytes(node_sum, hidden_dim_), &ws
+        );
+        mlps_[0]->forward_embedded(pooled, output, ws);
+    }
+    if (!bn_folded_) {
+        {
+            PGNN_PROFILE_SCOPE(
+                "batchnorm", 0, 2.0 * node_sum * hidden_dim_,
+                Workspace::matrix_bytes(node_sum, hidden_dim_)
+            );
+            batchnorms_[0]->forward(output, output);
         }
-        begin_idx += g_node_sum;
+        PGNN_PROFILE_SCOPE(
+            "relu", 0, double(node_sum) * hidden_dim_,
+            Workspace::matrix_bytes(node_sum, hidden_dim_)
+        );
+        output.activation(output, "ReLU");
     }
+    ws.release(mark);
 }
 
 
-MyMatrix* GraphCNN::maxpool(
-    const std::vector<S2VGraph*> &data, MyMatrix* h, int max_degree
-) {
-    MyMatrix* pooled_rep = new MyMatrix(h->get_col_width(), h->get_row_width());
-    std::vector<float> dummy;
-    int row_length = h->get_row_width();
-    for (int i = 0; i < row_length; ++i)
-        dummy.push_back(h->get_min_val(0, i));
-    int begin_idx = 0;
-    for (const auto &g : data) {
-        int g_node_sum = g->get_node_sum();
-        auto neighbor_list = g->get_neighbors();
-        for (int i = 0; i < g_node_sum; ++i) {
-            std::vector<std::vector<float>> neighbors;
-            if (neighbor_list[i].size() < max_degree)
-                neighbors.push_back(dummy);
-            if (!learn_eps_) {
-                neighbors.push_back(std::vector<float>());
-                h->get_row(i+begin_idx, neighbors.back());
-            }
-            for (auto n : neighbor_list[i]) {
-                neighbors.push_back(std::vector<float>());
-                h->get_row(i+begin_idx, neighbors.back());
-            }
-            int l = neighbors.size();
-            for (int j = 0; j < row_length; ++j) {
-                float max_val = neighbors[0][j];
-                for (int k = 1; k < l; ++k)
-                    max_val = std::max(max_val, neighbors[k][j]);
-                pooled_rep->set_value(max_val, i+begin_idx, j);
+// readout of layer 0: the graph pooling of X * W^T adds the embedding rows
+// of the tags of each graph, scaled by 1/node_sum for an average pooling
+void GraphCNN::embeddedReadout(const BatchedGraph &graph, MyMatrix& output) const {
+    int dim = output_dim_, table_ld = readout_embedding_->get_ld(), ld = output.get_ld();
+    const float *t = readout_embedding_->get_data();
+    float *out = output.get_data();
+    for (int i = 0; i < graph.get_graph_sum(); ++i) {
+        int node_begin = graph.get_node_begin(i), node_end = node_begin + graph.get_node_sum(i);
+        float elem = graph.get_pool_weight(i);
+        float *o = out + size_t(i) * ld;
+        for (int v = node_begin; v < node_end; ++v) {
+            int tag = graph.get_tag(v);
+            if (tag >= readout_embedding_->get_col_width()) {
+                std::cerr << "gather error: node tag out of range!" << std::endl;
+                exit(0);
             }
+            const float *row = t + size_t(tag) * table_ld;
+            for (int j = 0; j < dim; ++j)
+                o[j] += elem * row[j];
         }
-        begin_idx += g_node_sum;
     }
-    return pooled_rep;
+    linears_[0]->add_bias(output);
 }
 
 
-MyMatrix* GraphCNN::nextLayer(
-    MyMatrix* h, const std::vector<S2VGraph*> &data, 
-    int layer_idx, int max_degree, MyMatrix* neighbor_block
-) {
-    MyMatrix *pooled;
-    if (neighbor_pooling_type_ == "max") {
-        pooled = maxpool(data, h, max_degree);
+// upper bound of the scratch memory forward takes for a batch of node_sum
+// nodes with tag_sum node tags
+size_t GraphCNN::get_workspace_size(int node_sum, int tag_sum) const {
+    size_t bytes = 2 * Workspace::matrix_bytes(node_sum, hidden_dim_);
+    // layer 0 gathers embedding rows, or reads the dense one-hot tags
+    int dim = hidden_dim_;
+    if (input_embedding_ != nullptr) {
+        dim = std::max(dim, input_embedding_->get_row_width());
     } else {
-        pooled = new MyMatrix(neighbor_block->get_col_width(), h->get_row_width());
-        pooled->mult(*(neighbor_block), *(h));
-        if (neighbor_pooling_type_ == "average") {
-            for (int i = 0; i < neighbor_block->get_col_width(); ++i) {
-                float degree_sum = 0;
-                for (int j = 0; j < neighbor_block->get_row_width(); ++j)
-                    degree_sum += neighbor_block->get_value(i, j);
-                for (int j = 0; j < neighbor_block->get_row_width(); ++j) {
-                    float tmp = neighbor_block->get_value(i, j);
-                    tmp /= degree_sum;
-                    neighbor_block->set_value(tmp, i, j);
-                }
-            } // for (int i=0)
-        } // if (neighbor_pooling_type_ == "average")
-    }
-    if (learn_eps_) {
-        MyMatrix tmp(h->get_col_width(), h->get_row_width());
-        tmp.copy(*(h));
-        tmp.mult(epss_[layer_idx] + 1);
-        pooled->add(*(pooled), tmp);
+        bytes += Workspace::matrix_bytes(node_sum, tag_sum);
+        dim = std::max(dim, tag_sum);
     }
-    MyMatrix *pooled_rep_t = new MyMatrix(hidden_dim_, pooled->get_col_width());
-    MyMatrix *pooled_t = new MyMatrix(pooled->get_row_width(), pooled->get_col_width());
-    pooled_t->transpose(*(pooled));
-    mlps_[layer_idx]->forward(*(pooled_t), *(pooled_rep_t));
-    batchnorms_[layer_idx]->forward(*(pooled_rep_t), *(pooled_rep_t));
-    pooled_rep_t->activation(*(pooled_rep_t), "ReLU");
-    MyMatrix *pooled_rep = new MyMatrix(pooled_rep_t->get_row_width(), pooled_rep_t->get_col_width());
-    pooled_rep->transpose(*(pooled_rep_t));
-    delete pooled;
-    delete pooled_t;
-    delete pooled_rep_t;
-    return pooled_rep;
+    size_t layer = 2 * Workspace::matrix_bytes(node_sum, dim);
+    size_t mlp = 0;
+    for (auto m : mlps_)
+        mlp = std::max(mlp, m->get_workspace_size(node_sum));
+    return bytes + layer + mlp;
 }
 
 
+void GraphCNN::prepare(
+    const GraphArena &arena, const std::vector<int> &batch, BatchedGraph &graph
+) const {
+    PGNN_PROFILE_SCOPE("prepare", -1);
+    graph.build(
+        arena, batch, !learn_eps_,
+        neighbor_pooling_type_ == "average", graph_pooling_type_ == "average"
+    );
+}
+
+
+// one workspace per thread, it grows to the largest batch seen and is
+// reused from then on
 void GraphCNN::forward(
     const std::vector<S2VGraph*> &data, int tag_sum, MyMatrix &output
-) {
-    // get node features
+) const {
+    thread_local Workspace ws;
     int node_sum = 0;
     for (const auto &g : data)
         node_sum += g->get_node_sum();
-    MyMatrix *node_feature = new MyMatrix(node_sum, tag_sum);
-    get_node_feature(data, *(node_feature));
+    ws.reserve(get_workspace_size(node_sum, tag_sum));
+    forward(data, tag_sum, output, ws);
+}
 
-    // get graph pool
-    MyMatrix graph_pool(data.size(), node_sum);
-    preprocess_graphpool(data, graph_pool);
 
-    MyMatrix *neighbor_block;
-    int max_deg = 0;
-    for (const auto &g : data)
-        max_deg = std::max(g->get_max_degree(), max_deg);
+// the graphs are copied into a per-thread arena first
+void GraphCNN::forward(
+    const std::vector<S2VGraph*> &data, int tag_sum, MyMatrix &output, Workspace &ws
+) const {
+    thread_local GraphArena arena;
+    thread_local std::vector<int> batch;
+    arena.assign(data, tag_sum);
+    batch.resize(data.size());
+    for (int i = 0; i < batch.size(); ++i)
+        batch[i] = i;
+    forward(arena, batch, output, ws);
+}
 
-    // get neibor list
-    if (neighbor_pooling_type_ != "max") {
-        neighbor_block = new MyMatrix(node_sum, node_sum);
-        preprocess_neighbors_sumavepool(data, neighbor_block);
-    }
 
-    std::vector<MyMatrix*> hidden_rep;
-    hidden_rep.push_back(node_feature);
+// the batch is prepared into the graph of ws, a caller that runs the same
+// batch again can prepare its own BatchedGraph once and keep it instead
+void GraphCNN::forward(
+    const GraphArena &arena, const std::vector<int> &batch, MyMatrix &output, Workspace &ws
+) const {
+    prepare(arena, batch, ws.get_graph());
+    forward(ws.get_graph(), output, ws);
+}
+
 
-    for (int layer_idx = 0; layer_idx < num_layers_-1; ++layer_idx) 
-        hidden_rep.push_back(
-            nextLayer(hidden_rep.back(), data, layer_idx, max_deg, neighbor_block)
+// every intermediate is taken from ws, which must hold at least
+// get_workspace_size bytes, so the pass itself does no heap allocation
+// (apart from the tasks of parallel_for when a shared pool is set)
+void GraphCNN::forward(const BatchedGraph &graph, MyMatrix &output, Workspace &ws) const {
+    int node_sum = graph.get_node_sum();
+    PGNN_PROFILE_SCOPE(
+        "forward", -1, 0, Workspace::matrix_bytes(graph.get_graph_sum(), output_dim_), &ws
+    );
+    size_t mark = ws.get_mark();
+    const SparseMatrix &neighbor_block = graph.get_adjacency();
+    bool embedded = input_embedding_ != nullptr;
+    // the graph pooling is a weighted sum over the node range of each graph,
+    // reduced straight into the prediction linear of the layer
+    auto readout = [&](const MyMatrix &h, int layer_idx) {
+        PGNN_PROFILE_SCOPE(
+            "readout", layer_idx,
+            (node_sum + 2.0 * graph.get_graph_sum() * output_dim_) * h.get_row_width(),
+            Workspace::matrix_bytes(graph.get_graph_sum(), output_dim_)
         );
-    
-    int row_size;
-    for (int layer_idx = 0; layer_idx < num_layers_; ++layer_idx) {
-        if (layer_idx == 0)
-            row_size = input_dim_;
-        else
-            row_size = hidden_dim_;
-        MyMatrix pooled_h(data.size(), row_size);
-        pooled_h.mult(graph_pool, *(hidden_rep[layer_idx]));
-        delete hidden_rep[layer_idx];
-        MyMatrix tmp(output_dim_, data.size());
-        MyMatrix pooled_h_t(row_size, data.size());
-        pooled_h_t.transpose(pooled_h);
-        linears_[layer_idx]->forward(pooled_h_t, tmp);
-        output.add(output, tmp);
+        linears_[layer_idx]->forward_pooled(
+            h, graph.get_node_offsets(), graph.get_pool_weights(), output
+        );
+    };
+
+    // every layer is read out as soon as it is computed and only feeds the
+    // next one after that, so two hidden buffers take turns: layer l lives
+    // in hidden[(l-1) % 2]
+    MyMatrix hidden[2] = {
+        ws.matrix(num_layers_ > 1 ? node_sum : 0, hidden_dim_),
+        ws.matrix(num_layers_ > 2 ? node_sum : 0, hidden_dim_)
+    };
+
+    // layer 0, the node features. the dense one-hot matrix is only needed
+    // when the tags can not be gathered from the embeddings, it sits above
+    // the hidden buffers and is given back once layer 1 is computed from it
+    size_t feature_mark = ws.get_mark();
+    if (embedded) {
+        {
+            PGNN_PROFILE_SCOPE(
+                "readout", 0, double(node_sum) * 2 * output_dim_,
+                Workspace::matrix_bytes(graph.get_graph_sum(), output_dim_)
+            );
+            embeddedReadout(graph, output);
+        }
+        if (num_layers_ > 1)
+            embeddedLayer(graph, hidden[0], ws);
+    } else {
+        MyMatrix node_feature = ws.matrix(node_sum, graph.get_tag_sum(), true);
+        {
+            PGNN_PROFILE_SCOPE(
+                "features", -1, 0, Workspace::matrix_bytes(node_sum, graph.get_tag_sum())
+            );
+            get_node_feature(graph, node_feature);
+        }
+        readout(node_feature, 0);
+        if (num_layers_ > 1)
+            nextLayer(node_feature, 0, neighbor_block, hidden[0], ws);
+    }
+    ws.release(feature_mark);
+
+    for (int layer_idx = 1; layer_idx < num_layers_; ++layer_idx) {
+        const MyMatrix &h = hidden[(layer_idx-1) % 2];
+        readout(h, layer_idx);
+        if (layer_idx < num_layers_-1)
+            nextLayer(h, layer_idx, neighbor_block, hidden[layer_idx % 2], ws);
     }
 
-    if (neighbor_pooling_type_ != "max")
-        delete neighbor_block;
+    ws.release(mark);
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,95 @@
+#ifndef HALF_HH
+#define HALF_HH
+
+#include <iostream>
+#include <string>
+#include <cstdint>
+#include <cstring>
+
+// 16 bit storage formats of the weights, the arithmetic stays in fp32:
+//   bf16  the top half of an fp32 (8 bit exponent, 7 bit mantissa)
+//   fp16  ieee half precision (5 bit exponent, 10 bit mantissa)
+enum WeightPrecision { WEIGHT_FP32, WEIGHT_BF16, WEIGHT_FP16 };
+
+WeightPrecision parse_weight_precision(const std::string &name) {
+    if (name == "fp32")
+        return WEIGHT_FP32;
+    if (name == "bf16")
+        return WEIGHT_BF16;
+    if (name == "fp16")
+        return WEIGHT_FP16;
+    std::cerr << "error: unknown weight precision " << name << "!" << std::endl;
+    exit(0);
+}
+
+
+inline uint32_t float_bits(float x) {
+    uint32_t u;
+    std::memcpy(&u, &x, sizeof(u));
+    return u;
+}
+
+
+inline float bits_float(uint32_t u) {
+    float x;
+    std::memcpy(&x, &u, sizeof(x));
+    return x;
+}
+
+
+// round to nearest even
+inline uint16_t float_to_bf16(float x) {
+    uint32_t u = float_bits(x);
+    if ((u & 0x7fffffff) > 0x7f800000)
+        return (u >> 16) | 0x40;
+    return (u + 0x7fff + ((u >> 16) & 1)) >> 16;
+}
+
+
+inline float bf16_to_float(uint16_t h) {
+    return bits_float(uint32_t(h) << 16);
+}
+
+
+// round to nearest even, too large values become infinity
+inline uint16_t float_to_fp16(float x) {
+    uint32_t u = float_bits(x);
+    uint16_t sign = (u >> 16) & 0x8000;
+    uint32_t abs = u & 0x7fffffff;
+    if (abs > 0x7f800000)
+        return sign | 0x7e00;
+    if (abs >= 0x477ff000)
+        return sign | 0x7c00;
+    if (abs < 0x38800000) {
+        // subnormal: the value in units of 2^-24
+        int shift = 126 - int(abs >> 23);
+        if (shift > 24)
+            return sign;
+        uint32_t mant = (abs & 0x7fffff) | 0x800000;
+        uint32_t half = mant >> shift, rest = mant & ((1u << shift) - 1);
+        uint32_t mid = 1u << (shift - 1);
+        if (rest > mid || (rest == mid && (half & 1)))
+            ++half;
+        return sign | half;
+    }
+    uint32_t h = ((abs >> 13) - (112 << 10));
+    uint32_t rest = abs & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (h & 1)))
+        ++h;
+    return sign | h;
+}
+
+
+inline float fp16_to_float(uint16_t h) {
+    uint32_t sign = uint32_t(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f, mant = h & 0x3ff;
+    if (exp == 0x1f)
+        return bits_float(sign | 0x7f800000 | (mant << 13));
+    if (exp != 0)
+        return bits_float(sign | ((exp + 112) << 23) | (mant << 13));
+    // subnormal or zero: mant * 2^-24
+    float x = float(mant) * (1.0f / 16777216.0f);
+    return sign ? -x : x;
+}
+
+#endif
@@ -5,19 +5,60 @@
 #include <vector>
 
 #include "my_matrix.hh"
+#include "model_file.hh"
+#include "batchnorm.hh"
+#include "gemm_int8.hh"
+#include "gemm_fixed.hh"
+#include "half.hh"
 
+// output = input * weight^T + bias, input and output hold one sample per
+// row (node-major, like every activation of the model). the weight keeps
+// the output_dim x input_dim layout of the model file and the bias is a
+// 1 x output_dim row. after quantize() forward runs in int8, the fp32
+// weight is kept for the embedding and the pooled readout.
+// set_precision can store the weight in 16 bits instead (weight_ is then
+// null), every product widens it back and accumulates in fp32.
+// a square fp32 linear of a common hidden size can be specialized: forward
+// then runs the fixed size kernel on a k-major copy of the weight
 class Linear {
 private:
+    int input_dim_, output_dim_;
     MyMatrix* weight_;
     MyMatrix* bia_;
+    WeightPrecision precision_;
+    std::vector<uint16_t> half_weight_;
+    const FixedLinearKernel* fixed_;
+    std::vector<float> fixed_weight_;
+    QuantizedWeight* qweight_;
+    // while calibrating, the range of every input given to forward
+    QuantRange* observer_;
+
+    void get_weight_row(int j, int k0, int len, float *row) const;
 public:
     Linear(
         int input_dim, int output_dim, 
         const std::vector<std::vector<float>> &wdata, 
         const std::vector<float> &bdata
     );
+    Linear(const ModelTensor &weight, const ModelTensor &bias);
     ~Linear();
-    void forward(const MyMatrix& input, MyMatrix& output);
+    int get_input_dim() const;
+    int get_output_dim() const;
+    void fold_batchnorm(const BatchNorm &bn);
+    void set_precision(WeightPrecision precision);
+    void specialize(bool enable);
+    const FixedLinearKernel* get_fixed_kernel() const;
+    size_t get_weight_bytes() const;
+    MyMatrix* get_embedding() const;
+    void set_observer(QuantRange *observer);
+    void quantize(const QuantRange &input_range);
+    bool is_quantized() const;
+    void add_bias(MyMatrix& output, bool relu = false) const;
+    void forward(const MyMatrix& input, MyMatrix& output, bool relu = false) const;
+    void forward_pooled(
+        const MyMatrix& input, const int *segments, const float *segment_weights,
+        MyMatrix& output
+    ) const;
 };
 
 
@@ -32,23 +73,306 @@ Linear::Linear(
         for (auto num : wdata[i])
             m.push_back(num);
     weight_->copy(m);
-    bia_ = new MyMatrix(output_dim, 1);
+    bia_ = new MyMatrix(1, output_dim);
     bia_->copy(bdata);
+    input_dim_ = input_dim;
+    output_dim_ = output_dim;
+    precision_ = WEIGHT_FP32;
+    fixed_ = nullptr;
+    qweight_ = nullptr;
+    observer_ = nullptr;
+}
+
+
+// zero copy: the matrices are views on the tensors of a model file
+Linear::Linear(const ModelTensor &weight, const ModelTensor &bias) {
+    if (bias.rows != 1 || bias.cols != weight.rows) {
+        std::cerr << "linear error: bias does not match the weight!" << std::endl;
+        exit(0);
+    }
+    weight_ = new MyMatrix(weight.rows, weight.cols, weight.ld, weight.data);
+    bia_ = new MyMatrix(1, bias.cols, bias.ld, bias.data);
+    input_dim_ = weight.cols;
+    output_dim_ = weight.rows;
+    precision_ = WEIGHT_FP32;
+    fixed_ = nullptr;
+    qweight_ = nullptr;
+    observer_ = nullptr;
+}
+
+
+inline int Linear::get_input_dim() const {
+    return input_dim_;
+}
+
+
+inline int Linear::get_output_dim() const {
+    return output_dim_;
+}
+
+
+// weight[j][k0 .. k0+len) in fp32
+void Linear::get_weight_row(int j, int k0, int len, float *row) const {
+    if (weight_ != nullptr) {
+        std::memcpy(row, weight_->row_ptr(j) + k0, len * sizeof(float));
+        return;
+    }
+    const uint16_t *src = half_weight_.data() + size_t(j) * input_dim_ + k0;
+    for (int k = 0; k < len; ++k)
+        row[k] = precision_ == WEIGHT_BF16 ? bf16_to_float(src[k]) : fp16_to_float(src[k]);
+}
+
+
+// keep the weight in bf16 or fp16 from now on (once, after the batch norms
+// are folded), the fp32 weight is freed. the bias stays in fp32
+void Linear::set_precision(WeightPrecision precision) {
+    if (precision == precision_)
+        return;
+    if (precision_ != WEIGHT_FP32 || precision == WEIGHT_FP32) {
+        std::cerr << "linear error: the weight is already reduced!" << std::endl;
+        exit(0);
+    }
+    half_weight_.resize(size_t(output_dim_) * input_dim_);
+    for (int j = 0; j < output_dim_; ++j) {
+        const float *w = weight_->row_ptr(j);
+        uint16_t *dst = half_weight_.data() + size_t(j) * input_dim_;
+        for (int k = 0; k < input_dim_; ++k)
+            dst[k] = precision == WEIGHT_BF16 ? float_to_bf16(w[k]) : float_to_fp16(w[k]);
+    }
+    delete weight_;
+    weight_ = nullptr;
+    precision_ = precision;
+    specialize(false);
+}
+
+
+// use the fixed size kernel of the weight if there is one (the packed copy
+// is rebuilt by fold_batchnorm), enable == false goes back to gemm
+void Linear::specialize(bool enable) {
+    fixed_ = nullptr;
+    if (enable && weight_ != nullptr && input_dim_ == output_dim_)
+        fixed_ = fixed_linear_kernel(input_dim_);
+    if (fixed_ == nullptr) {
+        std::vector<float>().swap(fixed_weight_);
+        return;
+    }
+    pack_fixed_weight(weight_->row_ptr(0), input_dim_, weight_->ld_, fixed_weight_);
+}
+
+
+inline const FixedLinearKernel* Linear::get_fixed_kernel() const {
+    return fixed_;
+}
+
+
+// memory held by the weight (a view on a model file counts too) and its
+// packed copy for the fixed size kernel
+size_t Linear::get_weight_bytes() const {
+    if (weight_ == nullptr)
+        return half_weight_.size() * sizeof(uint16_t);
+    return (size_t(output_dim_) * weight_->ld_ + fixed_weight_.size()) * sizeof(float);
+}
+
+
+// fold an inference batch norm that follows this layer into the weight and
+// the bias: bn(Wx + b) = (s*W)x + (s*b + t). the parameters are copied
+// first since they may be views on a read-only model
+void Linear::fold_batchnorm(const BatchNorm &bn) {
+    if (weight_ == nullptr) {
+        std::cerr << "linear error: fold the batch norm before reducing the weight!" << std::endl;
+        exit(0);
+    }
+    std::vector<float> scale, shift;
+    bn.get_scale_shift(scale, shift);
+    if (scale.size() != weight_->col_width_) {
+        std::cerr << "linear error: batch norm does not match the output!" << std::endl;
+        exit(0);
+    }
+    MyMatrix *weight = new MyMatrix(*weight_);
+    MyMatrix *bia = new MyMatrix(*bia_);
+    delete weight_;
+    delete bia_;
+    weight_ = weight;
+    bia_ = bia;
+    float *b = bia_->row_ptr(0);
+    for (int i = 0; i < weight_->col_width_; ++i) {
+        float *w = weight_->row_ptr(i);
+        for (int j = 0; j < weight_->row_width_; ++j)
+            w[j] *= scale[i];
+        b[i] = b[i] * scale[i] + shift[i];
+    }
+    if (fixed_ != nullptr)
+        specialize(true);
+}
+
+
+// weight^T (input_dim x output_dim): row t is the product of the one-hot
+// input t with the weight, so a one-hot input becomes a row gather
+MyMatrix* Linear::get_embedding() const {
+    MyMatrix *table = new MyMatrix(input_dim_, output_dim_);
+    std::vector<float> row(input_dim_);
+    for (int j = 0; j < output_dim_; ++j) {
+        get_weight_row(j, 0, input_dim_, row.data());
+        for (int k = 0; k < input_dim_; ++k)
+            table->set_value(row[k], k, j);
+    }
+    return table;
+}
+
+
+// calibration is single threaded: the observer is written by forward
+inline void Linear::set_observer(QuantRange *observer) {
+    observer_ = observer;
+}
+
+
+// quantize the current weight (fold the batch norms first) for inputs in
+// input_range
+void Linear::quantize(const QuantRange &input_range) {
+    if (input_range.is_empty()) {
+        std::cerr << "linear error: no calibration data to quantize!" << std::endl;
+        exit(0);
+    }
+    std::vector<float> w(size_t(output_dim_) * input_dim_);
+    for (int j = 0; j < output_dim_; ++j)
+        get_weight_row(j, 0, input_dim_, w.data() + size_t(j) * input_dim_);
+    if (qweight_ == nullptr)
+        qweight_ = new QuantizedWeight;
+    quantize_weight(w.data(), output_dim_, input_dim_, input_dim_, input_range, *qweight_);
+    specialize(false);
+}
+
+
+inline bool Linear::is_quantized() const {
+    return qweight_ != nullptr;
+}
+
+
+// output += bias (then ReLU) on every row, for an output whose product
+// with the weight was computed some other way
+void Linear::add_bias(MyMatrix& output, bool relu) const {
+    if (output.row_width_ != output_dim_) {
+        std::cerr << "linear error: illegal size of matrix!" << std::endl;
+        exit(0);
+    }
+    int n = output.row_width_;
+    const float *b = bia_->row_ptr(0);
+    int grain = std::max(1, PARALLEL_MIN_WORK / std::max(1, n));
+    parallel_for(0, output.col_width_, grain, [&](int row_begin, int row_end) {
+        for (int i = row_begin; i < row_end; ++i) {
+            float *out = output.row_ptr(i);
+            for (int j = 0; j < n; ++j)
+                out[j] += b[j];
+            if (relu)
+                for (int j = 0; j < n; ++j)
+                    out[j] = std::max(out[j], 0.0f);
+        }
+    });
+}
+
+
+// the transpose of the weight is folded into the gemm packing, the bias and
+// the optional ReLU are applied by the gemm epilogue on each output tile,
+// so the output is written only once
+void Linear::forward(const MyMatrix& input, MyMatrix& output, bool relu) const {
+    if (
+        input.row_width_ != input_dim_ || output.row_width_ != output_dim_ ||
+        output.col_width_ != input.col_width_ || &input == &output
+    ) {
+        std::cerr << "linear error: illegal size of matrix!" << std::endl;
+        exit(0);
+    }
+    if (observer_ != nullptr)
+        observer_->observe(input.mat_, input.col_width_, input.row_width_, input.ld_);
+    if (qweight_ != nullptr) {
+        gemm_int8(
+            input.col_width_, input.mat_, input.ld_, *qweight_,
+            bia_->row_ptr(0), relu, output.mat_, output.ld_
+        );
+        return;
+    }
+    if (fixed_ != nullptr) {
+        fixed_linear(
+            *fixed_, input.col_width_, input.mat_, input.ld_, fixed_weight_.data(),
+            bia_->row_ptr(0), relu, output.mat_, output.ld_
+        );
+        return;
+    }
+    GemmEpilogue ep = {nullptr, bia_->row_ptr(0), relu};
+    if (weight_ == nullptr) {
+        gemm(
+            input.col_width_, output_dim_, input_dim_, input.mat_, input.ld_,
+            half_weight_.data(), input_dim_, precision_,
+            output.mat_, output.ld_, false, &ep, true
+        );
+        return;
+    }
+    gemm(
+        input.col_width_, output_dim_, input_dim_,
+        input.mat_, input.ld_, weight_->mat_, weight_->ld_,
+        output.mat_, output.ld_, false, &ep, true
+    );
 }
 
 
-void Linear::forward(const MyMatrix& input, MyMatrix& output) {
-    output.mult(*(weight_), input);
-    for (int i = 0; i < output.row_width_; ++i) {
-        for (int j = 0; j < output.col_width_; ++j)
-            output.mat_[j][i] += bia_->mat_[j][0];
+// output row i += (segment_weights[i] * the sum of the input rows
+// [segments[i], segments[i+1])) * weight^T + bias, i.e. the graph readout
+// of one layer fused with its prediction linear. the segment sum is built
+// POOL_CHUNK columns at a time on the stack and dotted with the weight
+// right away, so the pooled rows are never stored
+void Linear::forward_pooled(
+    const MyMatrix& input, const int *segments, const float *segment_weights,
+    MyMatrix& output
+) const {
+    if (
+        input.row_width_ != input_dim_ || output.row_width_ != output_dim_ ||
+        segments[output.col_width_] != input.col_width_
+    ) {
+        std::cerr << "linear error: illegal size of matrix!" << std::endl;
+        exit(0);
     }
+    const int POOL_CHUNK = 256;
+    int in = input_dim_, out = output_dim_;
+    int graph_sum = output.col_width_;
+    int row_cost = (input.col_width_ / std::max(1, graph_sum) + out) * in;
+    int grain = std::max(1, PARALLEL_MIN_WORK / std::max(1, row_cost));
+    const float *b = bia_->row_ptr(0);
+    parallel_for(0, graph_sum, grain, [&](int row_begin, int row_end) {
+        alignas(64) float pooled[POOL_CHUNK], weight_row[POOL_CHUNK];
+        for (int i = row_begin; i < row_end; ++i) {
+            float *o = output.row_ptr(i);
+            for (int k0 = 0; k0 < in; k0 += POOL_CHUNK) {
+                int len = std::min(POOL_CHUNK, in - k0);
+                for (int k = 0; k < len; ++k)
+                    pooled[k] = 0;
+                for (int v = segments[i]; v < segments[i+1]; ++v) {
+                    const float *row = input.row_ptr(v) + k0;
+                    for (int k = 0; k < len; ++k)
+                        pooled[k] += row[k];
+                }
+                for (int j = 0; j < out; ++j) {
+                    const float *w = weight_row;
+                    if (weight_ != nullptr)
+                        w = weight_->row_ptr(j) + k0;
+                    else
+                        get_weight_row(j, k0, len, weight_row);
+                    float sum = 0;
+                    for (int k = 0; k < len; ++k)
+                        sum += w[k] * pooled[k];
+                    o[j] += segment_weights[i] * sum;
+                }
+            }
+            for (int j = 0; j < out; ++j)
+                o[j] += b[j];
+        }
+    });
 }
 
 
 Linear::~Linear() {
     delete weight_;
     delete bia_;
+    delete qweight_;
 }
 
 #endif
\ No newline at end of file
@@ -5,6 +5,9 @@
 #include <vector>
 
 #include "my_matrix.hh"
+#include "linear.hh"
+#include "batchnorm.hh"
+#include "workspace.hh"
 
 class MLP {
 private:
@@ -12,7 +15,10 @@ private:
     int input_dim_, hidden_dim_, output_dim_;
     std::vector<Linear*> linears_;
     std::vector<BatchNorm*> batchnorms_;
+    // after fold_batchnorms every hidden layer is one fused linear+ReLU
+    bool folded_, relu_output_;
 
+    void hidden_layer(int idx, const MyMatrix& input, MyMatrix& output) const;
     void add_new_linear(
         int input_dim, int output_dim, int begin_idx,
         const std::vector<std::vector<float>> &model_data
@@ -27,8 +33,20 @@ public:
         int input_dim, int hidden_dim, int output_dim, int num_layers, 
         const std::vector<std::vector<float>>& model_data
     );
+    MLP(
+        const ModelFile &model, const std::string &tag,
+        int input_dim, int hidden_dim, int output_dim, int num_layers
+    );
     ~MLP();
-    void forward(MyMatrix& input, MyMatrix& output);
+    void fold_batchnorms(const BatchNorm *output_bn);
+    size_t get_workspace_size(int sample_sum) const;
+    double get_flops(int sample_sum, bool embedded = false) const;
+    const Linear& get_first_linear() const;
+    int get_num_layers() const;
+    Linear& get_linear(int idx);
+    void forward(const MyMatrix& input, MyMatrix& output) const;
+    void forward(const MyMatrix& input, MyMatrix& output, Workspace &ws) const;
+    void forward_embedded(MyMatrix& first, MyMatrix& output, Workspace &ws) const;
 };
 
 
@@ -68,6 +86,8 @@ MLP::MLP(
     const std::vector<std::vector<float>>& model_data
 ) {
     num_layers_ = num_layers;
+    folded_ = false;
+    relu_output_ = false;
     input_dim_ = input_dim;
     hidden_dim_ = hidden_dim;
     output_dim_ = output_dim;
@@ -94,29 +114,156 @@ MLP::MLP(
 }
 
 
-void MLP::forward(MyMatrix& input, MyMatrix& output) {
-    if (num_layers_ == 1) {
-        linears_[0]->forward(input, output);
-    } else {
-        MyMatrix* h[2];
-        int row_length = input.get_row_width();
-        h[0] = new MyMatrix(hidden_dim_, row_length);
-        h[1] = new MyMatrix(input.get_col_width(), input.get_row_width());
-        h[1]->copy(input);
-        linears_[0]->forward(*(h[1]), *(h[0]));
-        batchnorms_[0]->forward(*(h[0]), *(h[0]));
-        h[0]->activation(*(h[0]), "ReLU");
-        delete h[1];
-        h[1] = new MyMatrix(hidden_dim_, row_length);
-        for (int i = 1; i < num_layers_-1; ++i) {
-            linears_[i]->forward(*(h[(i+1)%2]), *(h[i%2]));
-            batchnorms_[i]->forward(*(h[i%2]), *(h[i%2]));
-            h[i%2]->activation(*(h[i%2]), "ReLU");
+// tag: mlps.x., the parameters are used in place
+MLP::MLP(
+    const ModelFile &model, const std::string &tag,
+    int input_dim, int hidden_dim, int output_dim, int num_layers
+) {
+    num_layers_ = num_layers;
+    folded_ = false;
+    relu_output_ = false;
+    input_dim_ = input_dim;
+    hidden_dim_ = hidden_dim;
+    output_dim_ = output_dim;
+    if (num_layers < 1) {
+        std::cerr << "error: wrong size of mlp!" << std::endl;
+        exit(0);
+    }
+    for (int i = 0; i < num_layers; ++i) {
+        std::string linear_tag = tag + "linears." + std::to_string(i);
+        const ModelTensor &w = model.get(linear_tag + ".weight");
+        int in_dim = i == 0 ? input_dim : hidden_dim;
+        int out_dim = i == num_layers-1 ? output_dim : hidden_dim;
+        if (w.rows != out_dim || w.cols != in_dim) {
+            std::cerr << "error: wrong size of " << linear_tag << "!" << std::endl;
+            exit(0);
         }
-        linears_[num_layers_-1]->forward(*(h[num_layers_%2]), output);
-        delete h[0];
-        delete h[1];
+        linears_.push_back(new Linear(w, model.get(linear_tag + ".bias")));
+    }
+    for (int i = 0; i < num_layers-1; ++i) {
+        std::string bn_tag = tag + "batch_norms." + std::to_string(i);
+        batchnorms_.push_back(new BatchNorm(
+            model.get(bn_tag + ".weight"), model.get(bn_tag + ".bias"),
+            model.get(bn_tag + ".running_mean"), model.get(bn_tag + ".running_var")
+        ));
+    }
+}
+
+
+// fold every batch norm into the linear before it. output_bn (may be
+// null) is a batch norm + ReLU applied by the caller on the output, it is
+// folded into the last linear and forward then returns relu(bn(mlp(x)))
+void MLP::fold_batchnorms(const BatchNorm *output_bn) {
+    if (folded_)
+        return;
+    for (int i = 0; i < num_layers_-1; ++i)
+        linears_[i]->fold_batchnorm(*(batchnorms_[i]));
+    if (output_bn != nullptr) {
+        linears_[num_layers_-1]->fold_batchnorm(*output_bn);
+        relu_output_ = true;
+    }
+    folded_ = true;
+}
+
+
+void MLP::hidden_layer(int idx, const MyMatrix& input, MyMatrix& output) const {
+    if (folded_) {
+        linears_[idx]->forward(input, output, true);
+    } else {
+        linears_[idx]->forward(input, output);
+        batchnorms_[idx]->forward(output, output);
+        output.activation(output, "ReLU");
+    }
+}
+
+
+// scratch memory taken by forward for sample_sum samples
+size_t MLP::get_workspace_size(int sample_sum) const {
+    if (num_layers_ == 1)
+        return 0;
+    return 2 * Workspace::matrix_bytes(sample_sum, hidden_dim_);
+}
+
+
+// multiply-adds of forward (of forward_embedded, which gathers the first
+// linear) counted as two flops
+double MLP::get_flops(int sample_sum, bool embedded) const {
+    double flops = 0;
+    for (int i = embedded ? 1 : 0; i < num_layers_; ++i)
+        flops += 2.0 * sample_sum * linears_[i]->get_input_dim() * linears_[i]->get_output_dim();
+    return flops;
+}
+
+
+inline const Linear& MLP::get_first_linear() const {
+    return *(linears_[0]);
+}
+
+
+inline int MLP::get_num_layers() const {
+    return num_layers_;
+}
+
+
+inline Linear& MLP::get_linear(int idx) {
+    return *(linears_[idx]);
+}
+
+
+// input: samples x input_dim, output: samples x output_dim
+void MLP::forward(const MyMatrix& input, MyMatrix& output) const {
+    Workspace ws(get_workspace_size(input.get_col_width()));
+    forward(input, output, ws);
+}
+
+
+// the hidden layers ping-pong between two buffers taken from ws, they are
+// given back before returning
+void MLP::forward(const MyMatrix& input, MyMatrix& output, Workspace &ws) const {
+    if (num_layers_ == 1) {
+        linears_[0]->forward(input, output, relu_output_);
+        return;
+    }
+    size_t mark = ws.get_mark();
+    int sample_sum = input.get_col_width();
+    MyMatrix h0 = ws.matrix(sample_sum, hidden_dim_);
+    MyMatrix h1 = ws.matrix(sample_sum, hidden_dim_);
+    MyMatrix *h[2] = {&h0, &h1};
+    const MyMatrix *x = &input;
+    for (int i = 0; i < num_layers_-1; ++i) {
+        hidden_layer(i, *x, *(h[i%2]));
+        x = h[i%2];
+    }
+    linears_[num_layers_-1]->forward(*x, output, relu_output_);
+    ws.release(mark);
+}
+
+
+// like forward, but first already holds input * weight^T of the first
+// linear (e.g. gathered from its embedding), it is used as scratch
+void MLP::forward_embedded(MyMatrix& first, MyMatrix& output, Workspace &ws) const {
+    if (num_layers_ == 1) {
+        linears_[0]->add_bias(first, relu_output_);
+        output.copy(first);
+        return;
+    }
+    linears_[0]->add_bias(first, folded_);
+    if (!folded_) {
+        batchnorms_[0]->forward(first, first);
+        first.activation(first, "ReLU");
+    }
+    size_t mark = ws.get_mark();
+    int sample_sum = first.get_col_width();
+    MyMatrix h0 = ws.matrix(sample_sum, hidden_dim_);
+    MyMatrix h1 = ws.matrix(sample_sum, hidden_dim_);
+    MyMatrix *h[2] = {&h0, &h1};
+    const MyMatrix *x = &first;
+    for (int i = 1; i < num_layers_-1; ++i) {
+        hidden_layer(i, *x, *(h[i%2]));
+        x = h[i%2];
     }
+    linears_[num_layers_-1]->forward(*x, output, relu_output_);
+    ws.release(mark);
 }
 
 
@@ -0,0 +1,250 @@
+#ifndef MODEL_FILE_HH
+#define MODEL_FILE_HH
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <map>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// binary model format (little endian):
+//   header   64 bytes: magic "PGNNMDL", version, tensor number, file size
+//   table    one 128 byte entry per tensor: name, dim, rows, cols, leading
+//            dimension and the offset of its data
+//   data     every tensor is rows x ld floats starting at a 64 byte
+//            aligned offset, ld is padded exactly like a MyMatrix row, so
+//            the weights are used in place without any copy
+// a file is mapped copy-on-write; the same image can also be built in
+// memory from the text model (see from_text), both are used the same way
+
+const char MODEL_FILE_MAGIC[8] = "PGNNMDL";
+const uint32_t MODEL_FILE_VERSION = 1;
+
+struct ModelFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t tensor_num;
+    uint64_t file_size;
+    char reserved[40];
+};
+
+struct ModelTensorEntry {
+    char name[96];
+    int32_t dim, rows, cols, ld;
+    uint64_t offset;
+    char reserved[8];
+};
+
+struct ModelTensor {
+    int dim, rows, cols, ld;
+    float *data;
+};
+
+class ModelFile {
+private:
+    char *image_;
+    size_t size_;
+    bool mapped_;
+    std::map<std::string, ModelTensor> tensors_;
+
+    ModelFile(char *image, size_t size, bool mapped);
+    void parse();
+
+public:
+    typedef std::map<std::string, std::vector<std::vector<float>> > TextModel;
+
+    ModelFile(const ModelFile&) = delete;
+    ModelFile& operator=(const ModelFile&) = delete;
+    ~ModelFile();
+
+    static bool is_binary(const std::string &path);
+    static ModelFile* open(const std::string &path);
+    static ModelFile* from_text(const TextModel &data);
+    void save(const std::string &path) const;
+
+    bool has(const std::string &name) const;
+    const ModelTensor& get(const std::string &name) const;
+    int get_tensor_num() const;
+    size_t get_size() const;
+};
+
+
+ModelFile::ModelFile(char *image, size_t size, bool mapped) {
+    image_ = image;
+    size_ = size;
+    mapped_ = mapped;
+    parse();
+}
+
+
+ModelFile::~ModelFile() {
+    if (mapped_)
+        munmap(image_, size_);
+    else
+        std::free(image_);
+}
+
+
+// check the header and the table, then index the tensors by name
+void ModelFile::parse() {
+    if (size_ < sizeof(ModelFileHeader)) {
+        std::cerr << "model file error: file too small!" << std::endl;
+        exit(0);
+    }
+    const ModelFileHeader *header = reinterpret_cast<const ModelFileHeader*>(image_);
+    if (std::memcmp(header->magic, MODEL_FILE_MAGIC, sizeof(header->magic)) != 0) {
+        std::cerr << "model file error: not a binary model!" << std::endl;
+        exit(0);
+    }
+    if (header->version != MODEL_FILE_VERSION) {
+        std::cerr << "model file error: unsupported version " << header->version << "!" << std::endl;
+        exit(0);
+    }
+    size_t table_end = sizeof(ModelFileHeader) + size_t(header->tensor_num) * sizeof(ModelTensorEntry);
+    if (header->file_size != size_ || table_end > size_) {
+        std::cerr << "model file error: truncated file!" << std::endl;
+        exit(0);
+    }
+    const ModelTensorEntry *entry = reinterpret_cast<const ModelTensorEntry*>(
+        image_ + sizeof(ModelFileHeader)
+    );
+    for (uint32_t i = 0; i < header->tensor_num; ++i, ++entry) {
+        size_t bytes = size_t(entry->rows) * entry->ld * sizeof(float);
+        if (
+            entry->rows < 0 || entry->cols < 0 || entry->ld < entry->cols ||
+            entry->offset % 64 != 0 || entry->offset + bytes > size_
+        ) {
+            std::cerr << "model file error: broken tensor " << entry->name << "!" << std::endl;
+            exit(0);
+        }
+        ModelTensor t;
+        t.dim = entry->dim;
+        t.rows = entry->rows;
+        t.cols = entry->cols;
+        t.ld = entry->ld;
+        t.data = reinterpret_cast<float*>(image_ + entry->offset);
+        tensors_[std::string(entry->name, strnlen(entry->name, sizeof(entry->name)))] = t;
+    }
+}
+
+
+bool ModelFile::is_binary(const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    char magic[8] = {};
+    in.read(magic, sizeof(magic));
+    return in && std::memcmp(magic, MODEL_FILE_MAGIC, sizeof(magic)) == 0;
+}
+
+
+ModelFile* ModelFile::open(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "model file error: can not open " << path << "!" << std::endl;
+        exit(0);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        std::cerr << "model file error: can not stat " << path << "!" << std::endl;
+        exit(0);
+    }
+    // private writable mapping: pages stay shared with the page cache until
+    // something writes to them
+    void *image = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        std::cerr << "model file error: can not map " << path << "!" << std::endl;
+        exit(0);
+    }
+    return new ModelFile(static_cast<char*>(image), st.st_size, true);
+}
+
+
+// lay the text model out in the binary format
+ModelFile* ModelFile::from_text(const TextModel &data) {
+    size_t offset = sizeof(ModelFileHeader) + data.size() * sizeof(ModelTensorEntry);
+    offset = (offset + 63) / 64 * 64;
+    std::vector<ModelTensorEntry> entries;
+    for (const auto &t : data) {
+        ModelTensorEntry e;
+        std::memset(&e, 0, sizeof(e));
+        if (t.first.size() >= sizeof(e.name)) {
+            std::cerr << "model file error: tensor name too long!" << std::endl;
+            exit(0);
+        }
+        std::strcpy(e.name, t.first.c_str());
+        e.rows = t.second.size();
+        e.cols = t.second.empty() ? 0 : t.second[0].size();
+        e.dim = e.rows == 1 ? 1 : 2;
+        e.ld = (e.cols + 15) / 16 * 16;
+        e.offset = offset;
+        offset += (size_t(e.rows) * e.ld * sizeof(float) + 63) / 64 * 64;
+        entries.push_back(e);
+    }
+    size_t size = std::max<size_t>(offset, 64);
+    char *image = static_cast<char*>(std::aligned_alloc(64, size));
+    std::memset(image, 0, size);
+    ModelFileHeader *header = reinterpret_cast<ModelFileHeader*>(image);
+    std::memcpy(header->magic, MODEL_FILE_MAGIC, sizeof(header->magic));
+    header->version = MODEL_FILE_VERSION;
+    header->tensor_num = entries.size();
+    header->file_size = size;
+    std::memcpy(image + sizeof(ModelFileHeader), entries.data(), entries.size() * sizeof(ModelTensorEntry));
+    int i = 0;
+    for (const auto &t : data) {
+        const ModelTensorEntry &e = entries[i++];
+        float *dst = reinterpret_cast<float*>(image + e.offset);
+        for (int r = 0; r < e.rows; ++r) {
+            if (t.second[r].size() != e.cols) {
+                std::cerr << "model file error: ragged tensor " << t.first << "!" << std::endl;
+                exit(0);
+            }
+            std::memcpy(dst + size_t(r)*e.ld, t.second[r].data(), e.cols * sizeof(float));
+        }
+    }
+    return new ModelFile(image, size, false);
+}
+
+
+void ModelFile::save(const std::string &path) const {
+    std::ofstream out(path, std::ios::binary);
+    out.write(image_, size_);
+    if (!out) {
+        std::cerr << "model file error: can not write " << path << "!" << std::endl;
+        exit(0);
+    }
+}
+
+
+inline bool ModelFile::has(const std::string &name) const {
+    return tensors_.find(name) != tensors_.end();
+}
+
+
+const ModelTensor& ModelFile::get(const std::string &name) const {
+    auto it = tensors_.find(name);
+    if (it == tensors_.end()) {
+        std::cerr << "model file error: missing tensor " << name << "!" << std::endl;
+        exit(0);
+    }
+    return it->second;
+}
+
+
+inline int ModelFile::get_tensor_num() const {
+    return tensors_.size();
+}
+
+
+inline size_t ModelFile::get_size() const {
+    return size_;
+}
+
+#endif
@@ -4,28 +4,50 @@
 #include <iostream>
 #include <vector>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
 
+#include "gemm.hh"
+
+// row-major matrix kept in one 64-byte-aligned buffer, row i starts at
+// mat_ + i*ld_. by default every row is padded to a whole cache line.
+// kernels only touch the first row_width_ floats of a row.
+// a matrix can also be a view on memory it does not own (e.g. weights in a
+// mapped model file), the owner must outlive the view
 class MyMatrix {
 private:
     int row_width_, col_width_;
-    float **mat_;
+    int ld_;
+    float *mat_;
+    bool owns_;
+
+    static const int ALIGN = 64;
+    float* row_ptr(int i);
+    const float* row_ptr(int i) const;
+
 public:
-    MyMatrix(int col_wid, int row_wid);
+    MyMatrix(int col_wid, int row_wid, bool padded = true);
+    MyMatrix(int col_wid, int row_wid, int ld, float *data);
     MyMatrix(const MyMatrix& m);
+    MyMatrix& operator=(const MyMatrix& m) = delete;
     ~MyMatrix();
-    float get_value(int i, int j);
-    int get_row_width();
-    int get_col_width();
-    float get_min_val(int dim, int idx);
-    float get_max_val(int dim, int idx);
-    int get_min_idx(int dim, int idx);
-    int get_max_idx(int dim, int idx);
-    void get_row(int idx, std::vector<float> &row);
+    static int padded_width(int row_wid);
+    float get_value(int i, int j) const;
+    int get_row_width() const;
+    int get_col_width() const;
+    int get_ld() const;
+    float* get_data();
+    const float* get_data() const;
+    float get_min_val(int dim, int idx) const;
+    float get_max_val(int dim, int idx) const;
+    int get_min_idx(int dim, int idx) const;
+    int get_max_idx(int dim, int idx) const;
+    void get_row(int idx, std::vector<float> &row) const;
 
     void set_value(float value, int i, int j);
     void copy(const MyMatrix& m);
     void copy(const std::vector<float>& m);
-    void check();
+    void check() const;
 
     void add(const MyMatrix& a, const MyMatrix &b);
     void sub(const MyMatrix& a, const MyMatrix &b);
@@ -37,31 +59,58 @@ public:
 
     friend class Linear;
     friend class BatchNorm;
+    friend class SparseMatrix;
 };
 
-MyMatrix::MyMatrix(int col_wid, int row_wid) {
+inline int MyMatrix::padded_width(int row_wid) {
+    int unit = ALIGN / sizeof(float);
+    return (row_wid + unit - 1) / unit * unit;
+}
+
+MyMatrix::MyMatrix(int col_wid, int row_wid, bool padded) {
     row_width_ = row_wid;
     col_width_ = col_wid;
-    mat_ = new float*[col_wid]();
-    for (int i = 0; i < col_wid; ++i)
-        mat_[i] = new float[row_wid]();
+    ld_ = padded ? padded_width(row_wid) : row_wid;
+    size_t bytes = size_t(col_wid) * ld_ * sizeof(float);
+    bytes = (bytes + ALIGN - 1) / ALIGN * ALIGN;
+    if (bytes == 0)
+        bytes = ALIGN;
+    mat_ = static_cast<float*>(std::aligned_alloc(ALIGN, bytes));
+    if (mat_ == nullptr) {
+        std::cerr << "matrix error: out of memory!" << std::endl;
+        exit(0);
+    }
+    std::memset(mat_, 0, bytes);
+    owns_ = true;
 }
 
-MyMatrix::MyMatrix(const MyMatrix& m) {
-    this->row_width_ = m.row_width_;
-    this->col_width_ = m.col_width_;
-    this->mat_ = new float*[col_width_]();
-    for (int i = 0; i < col_width_; ++i) {
-        mat_[i] = new float[row_width_]();
-        for (int j = 0; j < row_width_; ++j)
-            this->mat_[i][j] = m.mat_[i][j];
+MyMatrix::MyMatrix(int col_wid, int row_wid, int ld, float *data) {
+    if (ld < row_wid) {
+        std::cerr << "matrix error: leading dimension too small!" << std::endl;
+        exit(0);
     }
+    row_width_ = row_wid;
+    col_width_ = col_wid;
+    ld_ = ld;
+    mat_ = data;
+    owns_ = false;
+}
+
+MyMatrix::MyMatrix(const MyMatrix& m) : MyMatrix(m.col_width_, m.row_width_, m.ld_ != m.row_width_) {
+    copy(m);
 }
 
 MyMatrix::~MyMatrix() {
-    for (int i = 0; i < col_width_; ++i)
-        delete [] mat_[i];
-    delete [] mat_;
+    if (owns_)
+        std::free(mat_);
+}
+
+inline float* MyMatrix::row_ptr(int i) {
+    return mat_ + size_t(i) * ld_;
+}
+
+inline const float* MyMatrix::row_ptr(int i) const {
+    return mat_ + size_t(i) * ld_;
 }
 
 inline void MyMatrix::set_value(float value, int i, int j) {
@@ -69,43 +118,55 @@ inline void MyMatrix::set_value(float value, int i, int j) {
         std::cerr << "set value error: out of matrix range!" << std::endl;
         exit(0);
     }
-    this->mat_[i][j] = value;
+    this->row_ptr(i)[j] = value;
 }
 
-inline float MyMatrix::get_value(int i, int j) {
+inline float MyMatrix::get_value(int i, int j) const {
     if (i >= this->col_width_ || j >= this->row_width_) {
         std::cerr << "get value error: out of matrix range!" << std::endl;
         exit(0);
     }
-    return this->mat_[i][j];
+    return this->row_ptr(i)[j];
 }
 
-inline int MyMatrix::get_row_width() {
+inline int MyMatrix::get_row_width() const {
     return this->row_width_;
 }
 
-inline int MyMatrix::get_col_width() {
+inline int MyMatrix::get_col_width() const {
     return this->col_width_;
 }
 
-float MyMatrix::get_min_val(int dim, int idx) {
+inline int MyMatrix::get_ld() const {
+    return this->ld_;
+}
+
+inline float* MyMatrix::get_data() {
+    return this->mat_;
+}
+
+inline const float* MyMatrix::get_data() const {
+    return this->mat_;
+}
+
+float MyMatrix::get_min_val(int dim, int idx) const {
     float re;
     if (dim == 0) {
         if (idx >= row_width_) {
             std::cerr << "get min error: wrong idx!" << std::endl;
             exit(0);
         }
-        re = mat_[0][idx];
+        re = row_ptr(0)[idx];
         for (int i = 1; i < col_width_; ++i)
-            re = std::min(re, mat_[i][idx]);
+            re = std::min(re, row_ptr(i)[idx]);
     } else if (dim == 1) {
         if (idx >= col_width_) {
             std::cerr << "get min error: wrong idx!" << std::endl;
             exit(0);
         }
-        re = mat_[idx][0];
+        re = row_ptr(idx)[0];
         for (int i = 1; i < row_width_; ++i)
-            re = std::min(re, mat_[idx][i]);
+            re = std::min(re, row_ptr(idx)[i]);
     } else {
         std::cerr << "get min error: dim error!" << std::endl;
         exit(0);
@@ -113,24 +174,24 @@ float MyMatrix::get_min_val(int dim, int idx) {
     return re;
 }
 
-float MyMatrix::get_max_val(int dim, int idx) {
+float MyMatrix::get_max_val(int dim, int idx) const {
     float re;
     if (dim == 0) {
         if (idx >= row_width_) {
             std::cerr << "get max error: wrong idx!" << std::endl;
             exit(0);
         }
-        re = mat_[0][idx];
+        re = row_ptr(0)[idx];
         for (int i = 1; i < col_width_; ++i)
-            re = std::max(re, mat_[i][idx]);
+            re = std::max(re, row_ptr(i)[idx]);
     } else if (dim == 1) {
         if (idx >= col_width_) {
             std::cerr << "get max error: wrong idx!" << std::endl;
             exit(0);
         }
-        re = mat_[idx][0];
+        re = row_ptr(idx)[0];
         for (int i = 1; i < row_width_; ++i)
-            re = std::max(re, mat_[idx][i]);
+            re = std::max(re, row_ptr(idx)[i]);
     } else {
         std::cerr << "get max error: dim error!" << std::endl;
         exit(0);
@@ -138,7 +199,7 @@ float MyMatrix::get_max_val(int dim, int idx) {
     return re;
 }
     
-int MyMatrix::get_min_idx(int dim, int idx) {
+int MyMatrix::get_min_idx(int dim, int idx) const {
     float min_val = 0;
     int re = 0;
     if (dim == 0) {
@@ -146,10 +207,10 @@ int MyMatrix::get_min_idx(int dim, int idx) {
             std::cerr << "get min error: wrong idx!" << std::endl;
             exit(0);
         }
-        min_val = mat_[0][idx];
+        min_val = row_ptr(0)[idx];
         for (int i = 1; i < col_width_; ++i)
-            if (mat_[i][idx] < min_val) {
-                min_val = mat_[i][idx];
+            if (row_ptr(i)[idx] < min_val) {
+                min_val = row_ptr(i)[idx];
                 re = i;
             }
     } else if (dim == 1) {
@@ -157,10 +218,10 @@ int MyMatrix::get_min_idx(int dim, int idx) {
             std::cerr << "get min error: wrong idx!" << std::endl;
             exit(0);
         }
-        min_val = mat_[idx][0];
+        min_val = row_ptr(idx)[0];
         for (int i = 1; i < row_width_; ++i)
-            if (mat_[idx][i] < min_val) {
-                min_val = mat_[idx][i];
+            if (row_ptr(idx)[i] < min_val) {
+                min_val = row_ptr(idx)[i];
                 re = i;
             }
     } else {
@@ -170,7 +231,7 @@ int MyMatrix::get_min_idx(int dim, int idx) {
     return re;
 }
 
-int MyMatrix::get_max_idx(int dim, int idx) {
+int MyMatrix::get_max_idx(int dim, int idx) const {
     float max_val = 0;
     int re = 0;
     if (dim == 0) {
@@ -178,10 +239,10 @@ int MyMatrix::get_max_idx(int dim, int idx) {
             std::cerr << "get max error: wrong idx!" << std::endl;
             exit(0);
         }
-        max_val = mat_[0][idx];
+        max_val = row_ptr(0)[idx];
         for (int i = 1; i < col_width_; ++i)
-            if (mat_[i][idx] > max_val) {
-                max_val = mat_[i][idx];
+            if (row_ptr(i)[idx] > max_val) {
+                max_val = row_ptr(i)[idx];
                 re = i;
             }
     } else if (dim == 1) {
@@ -189,10 +250,10 @@ int MyMatrix::get_max_idx(int dim, int idx) {
             std::cerr << "get max error: wrong idx!" << std::endl;
             exit(0);
         }
-        max_val = mat_[idx][0];
+        max_val = row_ptr(idx)[0];
         for (int i = 1; i < row_width_; ++i)
-            if (max_val < mat_[idx][i]) {
-                max_val = mat_[idx][i];
+            if (max_val < row_ptr(idx)[i]) {
+                max_val = row_ptr(idx)[i];
                 re = i;
             }
     } else {
@@ -202,13 +263,13 @@ int MyMatrix::get_max_idx(int dim, int idx) {
     return re;
 }
 
-void MyMatrix::get_row(int idx, std::vector<float> &row) {
+void MyMatrix::get_row(int idx, std::vector<float> &row) const {
     if (idx >= col_width_) {
         std::cerr << "get row error: wrong idx!" << std::endl;
         exit(0);
     }
     for (int i = 0; i < row_width_; ++i)
-        row.push_back(mat_[idx][i]);
+        row.push_back(row_ptr(idx)[i]);
 }
 
 void MyMatrix::copy(const MyMatrix& m) {
@@ -216,9 +277,8 @@ void MyMatrix::copy(const MyMatrix& m) {
         std::cerr << "copy error: copy wrong size!" << std::endl;
         exit(0);
     }
-    for (int i = 0; i < col_width_; ++i) 
-        for (int j = 0; j < row_width_; ++j)
-            this->mat_[i][j] = m.mat_[i][j];
+    for (int i = 0; i < col_width_; ++i)
+        std::memcpy(row_ptr(i), m.row_ptr(i), row_width_ * sizeof(float));
 }
 
 void MyMatrix::copy(const std::vector<float>& m) {
@@ -228,7 +288,7 @@ void MyMatrix::copy(const std::vector<float>& m) {
     }
     for (int i = 0; i < col_width_; ++i)
         for (int j = 0; j < row_width_; ++j)
-            this->mat_[i][j] = m[i*row_width_ + j];
+            this->row_ptr(i)[j] = m[i*row_width_ + j];
 }
 
 void MyMatrix::add(const MyMatrix& a, const MyMatrix &b) {
@@ -240,9 +300,12 @@ void MyMatrix::add(const MyMatrix& a, const MyMatrix &b) {
         std::cerr << "add error: illegal size of matrix!" << std::endl;
         exit(0);
     }
-    for (int i = 0; i < col_width_; ++i)
+    for (int i = 0; i < col_width_; ++i) {
+        float *re = row_ptr(i);
+        const float *ra = a.row_ptr(i), *rb = b.row_ptr(i);
         for (int j = 0; j < row_width_; ++j)
-            this->mat_[i][j] = a.mat_[i][j] + b.mat_[i][j];
+            re[j] = ra[j] + rb[j];
+    }
 }
 
 void MyMatrix::sub(const MyMatrix& a, const MyMatrix &b) {
@@ -254,9 +317,12 @@ void MyMatrix::sub(const MyMatrix& a, const MyMatrix &b) {
         std::cerr << "sub error: illegal size of matrix!" << std::endl;
         exit(0);
     }
-    for (int i = 0; i < col_width_; ++i)
+    for (int i = 0; i < col_width_; ++i) {
+        float *re = row_ptr(i);
+        const float *ra = a.row_ptr(i), *rb = b.row_ptr(i);
         for (int j = 0; j < row_width_; ++j)
-            this->mat_[i][j] = a.mat_[i][j] - b.mat_[i][j];
+            re[j] = ra[j] - rb[j];
+    }
 }
 
 void MyMatrix::mult(const MyMatrix& a, const MyMatrix &b) {
@@ -271,21 +337,24 @@ void MyMatrix::mult(const MyMatrix& a, const MyMatrix &b) {
         std::cout << this->col_width_ << ' ' << this->row_width_ << std::endl;
         exit(0);
     }
-    MyMatrix re(this->col_width_, this->row_width_);
-    for (int i = 0; i < this->col_width_; ++i) 
-        for (int j = 0; j < this->row_width_; ++j) {
-            float m = 0;
-            for (int k = 0; k < a.row_width_; ++k)
-                m += a.mat_[i][k] * b.mat_[k][j];
-            re.mat_[i][j] = m;
-        }
-    this->copy(re);
+    if (this == &a || this == &b) {
+        MyMatrix re(this->col_width_, this->row_width_);
+        re.mult(a, b);
+        this->copy(re);
+        return;
+    }
+    gemm(
+        col_width_, row_width_, a.row_width_,
+        a.mat_, a.ld_, b.mat_, b.ld_, mat_, ld_
+    );
 }
 
 void MyMatrix::mult(float k) {
-    for (int i = 0; i < col_width_; ++i)
+    for (int i = 0; i < col_width_; ++i) {
+        float *re = row_ptr(i);
         for (int j = 0; j < row_width_; ++j)
-            mat_[i][j] *= k;
+            re[j] *= k;
+    }
 }
 
 void MyMatrix::dotMult(const MyMatrix& a, const MyMatrix &b) {
@@ -297,9 +366,12 @@ void MyMatrix::dotMult(const MyMatrix& a, const MyMatrix &b) {
         std::cerr << "dot mult error: illegal size of matrix!" << std::endl;
         exit(0);
     }
-    for (int i = 0; i < col_width_; ++i)
+    for (int i = 0; i < col_width_; ++i) {
+        float *re = row_ptr(i);
+        const float *ra = a.row_ptr(i), *rb = b.row_ptr(i);
         for (int j = 0; j < row_width_; ++j)
-            this->mat_[i][j] = a.mat_[i][j] * b.mat_[i][j];
+            re[j] = ra[j] * rb[j];
+    }
 }
 
 void MyMatrix::transpose(const MyMatrix& a) {
@@ -307,9 +379,11 @@ void MyMatrix::transpose(const MyMatrix& a) {
         std::cerr << "transpose error: illegal size of matrix!" << std::endl;
         exit(0);
     }
-    for (int i = 0; i < this->col_width_; ++i)
+    for (int i = 0; i < this->col_width_; ++i) {
+        float *re = row_ptr(i);
         for (int j = 0; j < this->row_width_; ++j)
-            this->mat_[i][j] = a.mat_[j][i];
+            re[j] = a.row_ptr(j)[i];
+    }
 }
 
 void MyMatrix::activation(const MyMatrix& input, const std::string& type) {
@@ -317,30 +391,43 @@ void MyMatrix::activation(const MyMatrix& input, const std::string& type) {
         std::cerr << "activation error: wrong matrix size!" << std::endl;
         exit(0);
     }
-    for (int i = 0; i < col_width_; ++i) 
-        for (int j = 0; j < row_width_; ++j) {
-            float m = input.mat_[i][j];
-            if (type == "sigmoid") {
-                if (m > 10)
-                    m = 10;
-                float tmp = exp(m);
-                m = tmp / (1 + tmp);
-            }
-            else if (type == "tanh") {
-                if (m > 10)
-                    m = 10;
-                m = (exp(m) - 1/exp(m)) / (exp(m) + 1/exp(m));
+    enum { NONE, SIGMOID, TANH, RELU } act = NONE;
+    if (type == "sigmoid")
+        act = SIGMOID;
+    else if (type == "tanh")
+        act = TANH;
+    else if (type == "ReLU")
+        act = RELU;
+    int grain = std::max(1, PARALLEL_MIN_WORK / std::max(1, row_width_));
+    parallel_for(0, col_width_, grain, [&](int row_begin, int row_end) {
+        for (int i = row_begin; i < row_end; ++i) {
+            const float *in = input.row_ptr(i);
+            float *re = row_ptr(i);
+            for (int j = 0; j < row_width_; ++j) {
+                float m = in[j];
+                if (act == SIGMOID) {
+                    if (m > 10)
+                        m = 10;
+                    float tmp = exp(m);
+                    m = tmp / (1 + tmp);
+                }
+                else if (act == TANH) {
+                    if (m > 10)
+                        m = 10;
+                    m = (exp(m) - 1/exp(m)) / (exp(m) + 1/exp(m));
+                }
+                else if (act == RELU)
+                    m = m < 0 ? 0 : m;
+                re[j] = m;
             }
-            else if (type == "ReLU")
-                m = m < 0 ? 0 : m;
-            this->mat_[i][j] = m;
         }
+    });
 }
 
-void MyMatrix::check() {
+void MyMatrix::check() const {
     for (int i = 0; i < row_width_; ++i) {
         for (int j = 0; j < col_width_; ++j)
-            std::cout << mat_[j][i] << ' ';
+            std::cout << row_ptr(j)[i] << ' ';
         std::cout << std::endl;
     }
 }
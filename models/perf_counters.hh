@@ -0,0 +1,146 @@
+#ifndef PERF_COUNTERS_HH
+#define PERF_COUNTERS_HH
+
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// hardware counters of the calling thread (user space only) through
+// perf_event_open: cycles, instructions, last level cache misses and branch
+// misses, opened as one group so that they count over the same interval and
+// one read() takes them all. a counter the machine (or a VM, or
+// perf_event_paranoid) does not give is left out, and when none opens
+// available() is false and read() gives zeros, so callers report them as
+// missing instead of failing. the work that other threads do for the caller
+// (the shared pool of parallel_for) is not counted
+enum PerfCounter {
+    PERF_CYCLES, PERF_INSTRUCTIONS, PERF_LLC_MISSES, PERF_BRANCH_MISSES, PERF_COUNTER_SUM
+};
+
+struct PerfSample {
+    uint64_t value[PERF_COUNTER_SUM];
+};
+
+
+class PerfCounters {
+private:
+    int fds_[PERF_COUNTER_SUM];
+    // position of each counter in the group read, -1 when it did not open
+    int slot_[PERF_COUNTER_SUM];
+    int leader_, open_sum_;
+    std::string error_;
+
+public:
+    PerfCounters();
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+    ~PerfCounters();
+
+    // the counters of the calling thread, opened on first use
+    static PerfCounters& thread();
+    static const char* get_name(int counter);
+
+    bool available() const;
+    bool has(int counter) const;
+    // why some or all counters are missing, empty when all opened
+    const std::string& get_error() const;
+    // running totals, scaled up if the kernel multiplexed the group
+    void read(PerfSample &sample) const;
+};
+
+
+PerfCounters::PerfCounters() {
+    static const uint64_t configs[PERF_COUNTER_SUM] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+    };
+    leader_ = -1;
+    open_sum_ = 0;
+    for (int c = 0; c < PERF_COUNTER_SUM; ++c) {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[c];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP |
+            PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.disabled = leader_ < 0;
+        fds_[c] = syscall(SYS_perf_event_open, &attr, 0, -1, leader_, 0);
+        slot_[c] = -1;
+        if (fds_[c] < 0) {
+            if (error_.empty())
+                error_ = std::string(get_name(c)) + ": " + std::strerror(errno);
+            continue;
+        }
+        if (leader_ < 0)
+            leader_ = fds_[c];
+        slot_[c] = open_sum_++;
+    }
+    if (leader_ >= 0) {
+        ioctl(leader_, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(leader_, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+}
+
+
+PerfCounters::~PerfCounters() {
+    for (int c = 0; c < PERF_COUNTER_SUM; ++c)
+        if (fds_[c] >= 0)
+            close(fds_[c]);
+}
+
+
+PerfCounters& PerfCounters::thread() {
+    thread_local PerfCounters counters;
+    return counters;
+}
+
+
+const char* PerfCounters::get_name(int counter) {
+    static const char *names[PERF_COUNTER_SUM] = {
+        "cycles", "instructions", "llc_misses", "branch_misses"
+    };
+    return names[counter];
+}
+
+
+inline bool PerfCounters::available() const {
+    return open_sum_ > 0;
+}
+
+
+inline bool PerfCounters::has(int counter) const {
+    return slot_[counter] >= 0;
+}
+
+
+inline const std::string& PerfCounters::get_error() const {
+    return error_;
+}
+
+
+void PerfCounters::read(PerfSample &sample) const {
+    for (int c = 0; c < PERF_COUNTER_SUM; ++c)
+        sample.value[c] = 0;
+    if (leader_ < 0)
+        return;
+    // nr, time enabled, time running, one value per counter
+    uint64_t data[3 + PERF_COUNTER_SUM];
+    if (::read(leader_, data, sizeof(data)) < ssize_t(3 * sizeof(uint64_t)))
+        return;
+    double scale = data[2] > 0 ? double(data[1]) / data[2] : 1;
+    for (int c = 0; c < PERF_COUNTER_SUM; ++c)
+        if (slot_[c] >= 0 && slot_[c] < data[0])
+            sample.value[c] = data[3 + slot_[c]] * scale;
+}
+
+#endif
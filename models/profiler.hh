@@ -0,0 +1,336 @@
+#ifndef PROFILER_HH
+#define PROFILER_HH
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <map>
+#include <mutex>
+#include <memory>
+#include <chrono>
+#include <algorithm>
+#include <iomanip>
+#include <cstdint>
+
+#include "workspace.hh"
+#include "perf_counters.hh"
+
+// per stage instrumentation of the forward pass. a build with
+// -DPGNN_PROFILE times every PGNN_PROFILE_SCOPE, in any other build the
+// macro is empty and nothing of this runs. an event is the wall time of
+// one stage of one layer (layer -1 for whole-pass stages), its flops, the
+// peak workspace bytes taken inside it and the size of the matrix it
+// writes. every thread appends to its own buffer, so recording takes no
+// lock after the first event of a thread. with set_counters(true) an event
+// also holds the hardware counters of its thread over the stage
+struct ProfileEvent {
+    const char *name;
+    int layer, thread;
+    int64_t begin_ns, end_ns;
+    double flops;
+    size_t scratch_bytes, output_bytes;
+    PerfSample counters;
+};
+
+
+class Profiler {
+private:
+    struct Buffer {
+        int thread;
+        std::vector<ProfileEvent> events;
+    };
+
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<Buffer>> buffers_;
+    std::chrono::steady_clock::time_point origin_;
+    bool counters_;
+
+    Profiler();
+    Buffer& thread_buffer();
+    void collect(std::vector<ProfileEvent> &events);
+
+public:
+    static Profiler& get();
+    int64_t now_ns() const;
+    // read the counters of perf_counters.hh around every stage (two reads
+    // per scope), set before the forward passes start
+    void set_counters(bool enable);
+    bool get_counters() const;
+    void record(const ProfileEvent &event);
+    // drop the recorded events, the buffers of the threads are kept
+    void clear();
+    // chrome://tracing or ui.perfetto.dev, one complete event per stage
+    void save_trace(const std::string &path);
+    // per stage and layer: calls, time, share of the forward passes,
+    // GFLOP/s, peak scratch and output sizes, then IPC and the LLC and
+    // branch misses per thousand instructions when counted
+    void print_summary(std::ostream &out);
+};
+
+
+// times its own lifetime as one event. ws, when given, also measures the
+// scratch bytes taken inside the scope (nested scopes included)
+class ProfileScope {
+private:
+    const char *name_;
+    int layer_;
+    double flops_;
+    size_t output_bytes_;
+    Workspace *ws_;
+    size_t mark_, saved_peak_;
+    int64_t begin_ns_;
+    PerfSample counters_;
+
+public:
+    ProfileScope(
+        const char *name, int layer, double flops = 0, size_t output_bytes = 0,
+        Workspace *ws = nullptr
+    );
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+    ~ProfileScope();
+};
+
+
+#define PGNN_PROFILE_CAT2(a, b) a##b
+#define PGNN_PROFILE_CAT(a, b) PGNN_PROFILE_CAT2(a, b)
+#ifdef PGNN_PROFILE
+#define PGNN_PROFILE_SCOPE(...) \
+    ProfileScope PGNN_PROFILE_CAT(profile_scope_, __LINE__)(__VA_ARGS__)
+#else
+#define PGNN_PROFILE_SCOPE(...) do {} while (0)
+#endif
+
+
+Profiler::Profiler() {
+    origin_ = std::chrono::steady_clock::now();
+    counters_ = false;
+}
+
+
+Profiler& Profiler::get() {
+    static Profiler profiler;
+    return profiler;
+}
+
+
+inline int64_t Profiler::now_ns() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - origin_
+    ).count();
+}
+
+
+void Profiler::set_counters(bool enable) {
+    counters_ = enable;
+}
+
+
+inline bool Profiler::get_counters() const {
+    return counters_;
+}
+
+
+// the buffers live as long as the profiler, a thread that ends leaves its
+// events behind
+Profiler::Buffer& Profiler::thread_buffer() {
+    thread_local Buffer *buffer = nullptr;
+    if (buffer == nullptr) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        buffers_.emplace_back(new Buffer);
+        buffer = buffers_.back().get();
+        buffer->thread = buffers_.size() - 1;
+        buffer->events.reserve(4096);
+    }
+    return *buffer;
+}
+
+
+inline void Profiler::record(const ProfileEvent &event) {
+    Buffer &buffer = thread_buffer();
+    buffer.events.push_back(event);
+    buffer.events.back().thread = buffer.thread;
+}
+
+
+// only while no thread records
+void Profiler::clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto &b : buffers_)
+        b->events.clear();
+}
+
+
+void Profiler::collect(std::vector<ProfileEvent> &events) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    events.clear();
+    for (auto &b : buffers_)
+        events.insert(events.end(), b->events.begin(), b->events.end());
+    std::sort(events.begin(), events.end(), [](const ProfileEvent &a, const ProfileEvent &b) {
+        return a.begin_ns < b.begin_ns;
+    });
+}
+
+
+void Profiler::save_trace(const std::string &path) {
+    std::vector<ProfileEvent> events;
+    collect(events);
+    std::ofstream out(path);
+    if (!out) {
+        std::cerr << "profile error: can not write " << path << "!" << std::endl;
+        exit(0);
+    }
+    out << "{\"traceEvents\": [\n";
+    out << std::fixed << std::setprecision(3);
+    for (size_t i = 0; i < events.size(); ++i) {
+        const ProfileEvent &e = events[i];
+        out << "{\"name\": \"" << e.name;
+        if (e.layer >= 0)
+            out << " " << e.layer;
+        out << "\", \"cat\": \"forward\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << e.thread
+            << ", \"ts\": " << e.begin_ns / 1000.0 << ", \"dur\": "
+            << (e.end_ns - e.begin_ns) / 1000.0 << ", \"args\": {\"layer\": " << e.layer
+            << ", \"flops\": " << e.flops << ", \"scratch_bytes\": " << e.scratch_bytes
+            << ", \"output_bytes\": " << e.output_bytes;
+        for (int c = 0; c < PERF_COUNTER_SUM; ++c)
+            if (counters_ && PerfCounters::thread().has(c))
+                out << ", \"" << PerfCounters::get_name(c) << "\": " << e.counters.value[c];
+        out << "}}"
+            << (i + 1 < events.size() ? ",\n" : "\n");
+    }
+    out << "], \"displayTimeUnit\": \"ms\"}\n";
+}
+
+
+void Profiler::print_summary(std::ostream &out) {
+    struct Row {
+        int first, calls = 0;
+        double ns = 0, flops = 0;
+        size_t scratch_bytes = 0, output_bytes = 0;
+        double counters[PERF_COUNTER_SUM] = {};
+    };
+    std::vector<ProfileEvent> events;
+    collect(events);
+    std::map<std::pair<std::string, int>, Row> rows;
+    double forward_ns = 0;
+    for (size_t i = 0; i < events.size(); ++i) {
+        const ProfileEvent &e = events[i];
+        auto it = rows.emplace(std::make_pair(std::string(e.name), e.layer), Row()).first;
+        Row &row = it->second;
+        if (row.calls++ == 0)
+            row.first = i;
+        row.ns += e.end_ns - e.begin_ns;
+        row.flops += e.flops;
+        row.scratch_bytes = std::max(row.scratch_bytes, e.scratch_bytes);
+        row.output_bytes = std::max(row.output_bytes, e.output_bytes);
+        for (int c = 0; c < PERF_COUNTER_SUM; ++c)
+            row.counters[c] += e.counters.value[c];
+        if (std::string(e.name) == "forward")
+            forward_ns += e.end_ns - e.begin_ns;
+    }
+    // in the order the stages first ran
+    std::vector<std::pair<const std::pair<std::string, int>, Row>*> order;
+    for (auto &p : rows)
+        order.push_back(&p);
+    std::sort(order.begin(), order.end(), [](const auto *a, const auto *b) {
+        return a->second.first < b->second.first;
+    });
+    // the counters of the thread that reads them, which is the one that
+    // recorded unless a pool ran the stage
+    const PerfCounters &perf = PerfCounters::thread();
+    bool counters = counters_ && perf.available();
+    if (counters_ && !perf.get_error().empty())
+        out << "hardware counters: " << (perf.available() ? "some missing" : "unavailable")
+            << " (" << perf.get_error() << ")" << std::endl;
+    std::ios::fmtflags flags = out.flags();
+    out << std::left << std::setw(12) << "stage" << std::right << std::setw(6) << "layer"
+        << std::setw(8) << "calls" << std::setw(12) << "total ms" << std::setw(10) << "avg us"
+        << std::setw(8) << "%" << std::setw(10) << "GFLOP/s" << std::setw(14) << "scratch KB"
+        << std::setw(12) << "output KB";
+    if (counters)
+        out << std::setw(8) << "IPC" << std::setw(14) << "LLC miss/ki" << std::setw(14)
+            << "br miss/ki";
+    out << std::endl;
+    for (auto *p : order) {
+        const Row &row = p->second;
+        out << std::left << std::setw(12) << p->first.first << std::right << std::setw(6);
+        if (p->first.second >= 0)
+            out << p->first.second;
+        else
+            out << "-";
+        out << std::setw(8) << row.calls << std::fixed << std::setprecision(3)
+            << std::setw(12) << row.ns / 1e6 << std::setprecision(1)
+            << std::setw(10) << row.ns / 1e3 / row.calls << std::setw(8)
+            << (forward_ns > 0 ? 100 * row.ns / forward_ns : 0.0) << std::setprecision(2)
+            << std::setw(10);
+        if (row.flops > 0 && row.ns > 0)
+            out << row.flops / row.ns;
+        else
+            out << "-";
+        out << std::setprecision(1) << std::setw(14) << row.scratch_bytes / 1024.0
+            << std::setw(12) << row.output_bytes / 1024.0;
+        if (counters) {
+            const double *c = row.counters;
+            double ki = c[PERF_INSTRUCTIONS] / 1000;
+            out << std::setprecision(2) << std::setw(8);
+            if (perf.has(PERF_CYCLES) && perf.has(PERF_INSTRUCTIONS) && c[PERF_CYCLES] > 0)
+                out << c[PERF_INSTRUCTIONS] / c[PERF_CYCLES];
+            else
+                out << "-";
+            for (int k : {PERF_LLC_MISSES, PERF_BRANCH_MISSES}) {
+                out << std::setw(14);
+                if (perf.has(k) && ki > 0)
+                    out << c[k] / ki;
+                else
+                    out << "-";
+            }
+        }
+        out << std::endl;
+    }
+    out.flags(flags);
+}
+
+
+inline ProfileScope::ProfileScope(
+    const char *name, int layer, double flops, size_t output_bytes, Workspace *ws
+) {
+    name_ = name;
+    layer_ = layer;
+    flops_ = flops;
+    output_bytes_ = output_bytes;
+    ws_ = ws;
+    if (ws_ != nullptr) {
+        mark_ = ws_->get_mark();
+        saved_peak_ = ws_->restart_peak();
+    }
+    if (Profiler::get().get_counters())
+        PerfCounters::thread().read(counters_);
+    begin_ns_ = Profiler::get().now_ns();
+}
+
+
+inline ProfileScope::~ProfileScope() {
+    ProfileEvent event;
+    event.end_ns = Profiler::get().now_ns();
+    if (Profiler::get().get_counters()) {
+        PerfCounters::thread().read(event.counters);
+        for (int c = 0; c < PERF_COUNTER_SUM; ++c)
+            event.counters.value[c] -= counters_.value[c];
+    } else {
+        event.counters = PerfSample();
+    }
+    event.begin_ns = begin_ns_;
+    event.name = name_;
+    event.layer = layer_;
+    event.flops = flops_;
+    event.output_bytes = output_bytes_;
+    event.scratch_bytes = 0;
+    if (ws_ != nullptr) {
+        event.scratch_bytes = ws_->get_peak() - mark_;
+        ws_->merge_peak(saved_peak_);
+    }
+    Profiler::get().record(event);
+}
+
+#endif
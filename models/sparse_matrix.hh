@@ -0,0 +1,177 @@
+#ifndef SPARSE_MATRIX_HH
+#define SPARSE_MATRIX_HH
+
+#include <iostream>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+#include "my_matrix.hh"
+
+// CSR matrix, only used as the left operand of a sparse x dense product
+// (or of its max-plus counterpart gather_max). rows are appended in order
+// with push() and closed with end_row()
+class SparseMatrix {
+private:
+    int row_width_, col_width_;
+    std::vector<int> row_ptr_;
+    std::vector<int> col_idx_;
+    std::vector<float> val_;
+
+public:
+    SparseMatrix(int col_wid = 0, int row_wid = 0);
+    ~SparseMatrix() {};
+    void reset(int col_wid, int row_wid);
+    int get_row_width() const;
+    int get_col_width() const;
+    int get_nnz() const;
+    int get_row_nnz(int i) const;
+
+    void push(int j, float value);
+    void end_row();
+    void mult(const MyMatrix& b, MyMatrix& re) const;
+    void gather_max(const MyMatrix& b, MyMatrix& re) const;
+};
+
+
+SparseMatrix::SparseMatrix(int col_wid, int row_wid) {
+    reset(col_wid, row_wid);
+}
+
+
+// start over as an empty col_wid x row_wid matrix, the arrays keep their
+// capacity so a reused matrix stops allocating once it has grown
+void SparseMatrix::reset(int col_wid, int row_wid) {
+    row_width_ = row_wid;
+    col_width_ = col_wid;
+    row_ptr_.clear();
+    col_idx_.clear();
+    val_.clear();
+    row_ptr_.reserve(col_wid + 1);
+    row_ptr_.push_back(0);
+}
+
+
+inline int SparseMatrix::get_row_width() const {
+    return row_width_;
+}
+
+
+inline int SparseMatrix::get_col_width() const {
+    return col_width_;
+}
+
+
+inline int SparseMatrix::get_nnz() const {
+    return col_idx_.size();
+}
+
+
+inline int SparseMatrix::get_row_nnz(int i) const {
+    return row_ptr_[i+1] - row_ptr_[i];
+}
+
+
+inline void SparseMatrix::push(int j, float value) {
+    if (j >= row_width_ || row_ptr_.size() > col_width_) {
+        std::cerr << "sparse push error: out of matrix range!" << std::endl;
+        exit(0);
+    }
+    col_idx_.push_back(j);
+    val_.push_back(value);
+}
+
+
+inline void SparseMatrix::end_row() {
+    row_ptr_.push_back(col_idx_.size());
+}
+
+
+// re = this * b, the cost is O(nnz * b.row_width_), rows are split over
+// the shared thread pool
+void SparseMatrix::mult(const MyMatrix& b, MyMatrix& re) const {
+    if (row_ptr_.size() != col_width_ + 1) {
+        std::cerr << "sparse mult error: matrix is not complete!" << std::endl;
+        exit(0);
+    }
+    if (row_width_ != b.col_width_) {
+        std::cerr << "sparse mult error: illegal size of matrix!" << std::endl;
+        exit(0);
+    }
+    if (col_width_ != re.col_width_ || b.row_width_ != re.row_width_ || &b == &re) {
+        std::cerr << "sparse mult error: illegal size of matrix!" << std::endl;
+        exit(0);
+    }
+    int n = b.row_width_;
+    int row_cost = (get_nnz() / std::max(1, col_width_) + 1) * n;
+    int grain = std::max(1, PARALLEL_MIN_WORK / std::max(1, row_cost));
+    parallel_for(0, col_width_, grain, [&](int row_begin, int row_end) {
+        for (int i = row_begin; i < row_end; ++i) {
+            float *out = re.row_ptr(i);
+            for (int k = 0; k < n; ++k)
+                out[k] = 0;
+            for (int p = row_ptr_[i]; p < row_ptr_[i+1]; ++p) {
+                const float *in = b.row_ptr(col_idx_[p]);
+                float v = val_[p];
+                for (int k = 0; k < n; ++k)
+                    out[k] += v * in[k];
+            }
+        }
+    });
+}
+
+
+// re[i] = the element-wise max of the rows b[j] over the entries j of row
+// i (the values are ignored), read in place. an empty row gets the column
+// minimum of b, like a row padded only with the "dummy" minimum node
+void SparseMatrix::gather_max(const MyMatrix& b, MyMatrix& re) const {
+    if (row_ptr_.size() != col_width_ + 1) {
+        std::cerr << "sparse max error: matrix is not complete!" << std::endl;
+        exit(0);
+    }
+    if (
+        row_width_ != b.col_width_ || col_width_ != re.col_width_ ||
+        b.row_width_ != re.row_width_ || &b == &re
+    ) {
+        std::cerr << "sparse max error: illegal size of matrix!" << std::endl;
+        exit(0);
+    }
+    int n = b.row_width_;
+    int row_cost = (get_nnz() / std::max(1, col_width_) + 1) * n;
+    int grain = std::max(1, PARALLEL_MIN_WORK / std::max(1, row_cost));
+    bool has_empty_row = false;
+    for (int i = 0; i < col_width_ && !has_empty_row; ++i)
+        has_empty_row = row_ptr_[i] == row_ptr_[i+1];
+    parallel_for(0, col_width_, grain, [&](int row_begin, int row_end) {
+        for (int i = row_begin; i < row_end; ++i) {
+            int p = row_ptr_[i], p_end = row_ptr_[i+1];
+            if (p == p_end)
+                continue;
+            float *out = re.row_ptr(i);
+            std::memcpy(out, b.row_ptr(col_idx_[p]), n * sizeof(float));
+            for (++p; p < p_end; ++p) {
+                const float *in = b.row_ptr(col_idx_[p]);
+                for (int k = 0; k < n; ++k)
+                    out[k] = std::max(out[k], in[k]);
+            }
+        }
+    });
+    if (!has_empty_row || b.col_width_ == 0)
+        return;
+    // the column minimum is built in the first empty row, then copied
+    int first_empty = 0;
+    while (row_ptr_[first_empty] != row_ptr_[first_empty+1])
+        ++first_empty;
+    float *col_min = re.row_ptr(first_empty);
+    std::memcpy(col_min, b.row_ptr(0), n * sizeof(float));
+    for (int j = 1; j < b.col_width_; ++j) {
+        const float *in = b.row_ptr(j);
+        for (int k = 0; k < n; ++k)
+            col_min[k] = std::min(col_min[k], in[k]);
+    }
+    for (int i = first_empty + 1; i < col_width_; ++i)
+        if (row_ptr_[i] == row_ptr_[i+1])
+            std::memcpy(re.row_ptr(i), col_min, n * sizeof(float));
+}
+
+#endif
@@ -0,0 +1,237 @@
+#ifndef THREAD_POOL_HH
+#define THREAD_POOL_HH
+
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+
+// below this many element operations a kernel is not worth splitting
+const int PARALLEL_MIN_WORK = 1 << 15;
+
+// fixed-size pool of worker threads with one task deque per worker.
+// a worker pops its own deque from the back and, once it runs dry, steals
+// from the front of the others, so a few expensive tasks never leave the
+// rest of the pool idle. tasks submitted from outside the pool are dealt
+// round-robin, tasks submitted by a worker go to its own deque
+class ThreadPool {
+private:
+    typedef std::function<void()> Task;
+    struct TaskQueue {
+        std::mutex mtx;
+        std::deque<Task> tasks;
+    };
+
+    int num_threads_;
+    std::vector<std::unique_ptr<TaskQueue>> queues_;
+    std::vector<std::thread> threads_;
+    std::mutex mtx_;
+    std::condition_variable work_cv_, done_cv_;
+    std::atomic<int> queued_, unfinished_;
+    std::atomic<unsigned> next_queue_;
+    bool stop_;
+
+    static int& worker_id();
+    static ThreadPool*& shared_pool();
+    bool pop(int id, Task &task);
+    void run_worker(int id);
+
+public:
+    ThreadPool(int num_threads);
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    ~ThreadPool();
+    int get_thread_num() const;
+    static int current_worker();
+    static ThreadPool* get_shared();
+    static void set_shared(ThreadPool *pool);
+
+    void submit(Task task);
+    void wait();
+};
+
+
+// run fn(b, e) on sub-ranges of [begin, end) of at least grain items,
+// spread over the shared pool with the calling thread taking one part.
+// it stays serial when no shared pool is set, when the range is too
+// small, or when it is called from a pool worker (the work is already
+// parallel at a coarser level then)
+template <typename F>
+void parallel_for(int begin, int end, int grain, const F &fn);
+
+
+ThreadPool::ThreadPool(int num_threads) {
+    if (num_threads < 1) {
+        std::cerr << "thread pool error: need at least one thread!" << std::endl;
+        exit(0);
+    }
+    num_threads_ = num_threads;
+    queued_ = 0;
+    unfinished_ = 0;
+    next_queue_ = 0;
+    stop_ = false;
+    for (int i = 0; i < num_threads; ++i)
+        queues_.emplace_back(new TaskQueue());
+    for (int i = 0; i < num_threads; ++i)
+        threads_.emplace_back(&ThreadPool::run_worker, this, i);
+}
+
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        stop_ = true;
+    }
+    work_cv_.notify_all();
+    for (auto &t : threads_)
+        t.join();
+}
+
+
+inline int ThreadPool::get_thread_num() const {
+    return num_threads_;
+}
+
+
+// -1 outside of any pool
+inline int& ThreadPool::worker_id() {
+    thread_local int id = -1;
+    return id;
+}
+
+
+inline int ThreadPool::current_worker() {
+    return worker_id();
+}
+
+
+inline ThreadPool*& ThreadPool::shared_pool() {
+    static ThreadPool *pool = nullptr;
+    return pool;
+}
+
+
+// the pool used by parallel_for inside the kernels
+inline ThreadPool* ThreadPool::get_shared() {
+    return shared_pool();
+}
+
+
+inline void ThreadPool::set_shared(ThreadPool *pool) {
+    shared_pool() = pool;
+}
+
+
+void ThreadPool::submit(Task task) {
+    int id = worker_id();
+    int q = id >= 0 && id < num_threads_ ? id : next_queue_++ % num_threads_;
+    unfinished_++;
+    {
+        std::lock_guard<std::mutex> lock(queues_[q]->mtx);
+        queues_[q]->tasks.push_back(std::move(task));
+    }
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        queued_++;
+    }
+    work_cv_.notify_one();
+}
+
+
+// own deque first (newest task), then steal the oldest task of a victim
+bool ThreadPool::pop(int id, Task &task) {
+    {
+        TaskQueue &own = *queues_[id];
+        std::lock_guard<std::mutex> lock(own.mtx);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+    for (int i = 1; i < num_threads_; ++i) {
+        TaskQueue &victim = *queues_[(id + i) % num_threads_];
+        std::lock_guard<std::mutex> lock(victim.mtx);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+
+void ThreadPool::run_worker(int id) {
+    worker_id() = id;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+            work_cv_.wait(lock, [this]() { return stop_ || queued_ > 0; });
+            if (stop_ && queued_ == 0)
+                return;
+            queued_--;
+        }
+        // a task is reserved for us, it may only sit in another deque
+        Task task;
+        while (!pop(id, task))
+            std::this_thread::yield();
+        task();
+        if (--unfinished_ == 0) {
+            std::lock_guard<std::mutex> lock(mtx_);
+            done_cv_.notify_all();
+        }
+    }
+}
+
+
+// block until every submitted task has finished
+void ThreadPool::wait() {
+    std::unique_lock<std::mutex> lock(mtx_);
+    done_cv_.wait(lock, [this]() { return unfinished_ == 0; });
+}
+
+
+template <typename F>
+void parallel_for(int begin, int end, int grain, const F &fn) {
+    int n = end - begin;
+    if (n <= 0)
+        return;
+    grain = std::max(grain, 1);
+    ThreadPool *pool = ThreadPool::get_shared();
+    int chunks = 1;
+    if (pool != nullptr && ThreadPool::current_worker() < 0)
+        chunks = std::min(n / grain, pool->get_thread_num() + 1);
+    if (chunks <= 1) {
+        fn(begin, end);
+        return;
+    }
+    // left, mtx and cv live on this stack: a chunk counts itself done and
+    // notifies under mtx, so the wait below can not return (and free them)
+    // before the last chunk has let go of the lock
+    int left = chunks - 1;
+    std::mutex mtx;
+    std::condition_variable cv;
+    int b = begin;
+    for (int c = 0; c < chunks - 1; ++c) {
+        int e = b + n / chunks + (c < n % chunks);
+        pool->submit([&, b, e]() {
+            fn(b, e);
+            std::lock_guard<std::mutex> lock(mtx);
+            if (--left == 0)
+                cv.notify_all();
+        });
+        b = e;
+    }
+    fn(b, end);
+    std::unique_lock<std::mutex> lock(mtx);
+    cv.wait(lock, [&]() { return left == 0; });
+}
+
+#endif
@@ -0,0 +1,143 @@
+#ifndef WORKSPACE_HH
+#define WORKSPACE_HH
+
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+
+#include "my_matrix.hh"
+#include "batched_graph.hh"
+
+// scratch memory of a forward pass: one aligned block handed out as
+// matrix views by a stack (bump) allocator. get_mark/release give the
+// memory of a finished step back, so the per-layer buffers of one layer
+// are reused by the next. the block only grows in reserve(), which is
+// only allowed while nothing is handed out; once it is big enough for the
+// largest batch a forward pass does no heap allocation at all (counted at
+// malloc and aligned_alloc). with a shared pool (--intra-op) the tasks that
+// parallel_for submits still allocate in the pool.
+// a workspace belongs to one thread at a time
+class Workspace {
+private:
+    char *buffer_;
+    size_t capacity_, used_, peak_;
+    BatchedGraph graph_;
+
+public:
+    Workspace(size_t bytes = 0);
+    Workspace(const Workspace&) = delete;
+    Workspace& operator=(const Workspace&) = delete;
+    ~Workspace();
+
+    static size_t matrix_bytes(int col_wid, int row_wid);
+    void reserve(size_t bytes);
+    void reset();
+    size_t get_mark() const;
+    void release(size_t mark);
+    MyMatrix matrix(int col_wid, int row_wid, bool zero = false);
+    BatchedGraph& get_graph();
+
+    size_t get_capacity() const;
+    size_t get_peak() const;
+    // the peak of a part of the pass: restart_peak starts it from the
+    // current use and returns the old peak, merge_peak folds that back in
+    size_t restart_peak();
+    void merge_peak(size_t peak);
+};
+
+
+Workspace::Workspace(size_t bytes) {
+    buffer_ = nullptr;
+    capacity_ = used_ = peak_ = 0;
+    reserve(bytes);
+}
+
+
+Workspace::~Workspace() {
+    std::free(buffer_);
+}
+
+
+// bytes taken by a padded col_wid x row_wid matrix
+inline size_t Workspace::matrix_bytes(int col_wid, int row_wid) {
+    size_t bytes = size_t(col_wid) * MyMatrix::padded_width(row_wid) * sizeof(float);
+    return (bytes + 63) / 64 * 64;
+}
+
+
+void Workspace::reserve(size_t bytes) {
+    if (bytes <= capacity_)
+        return;
+    if (used_ != 0) {
+        std::cerr << "workspace error: can not grow while in use!" << std::endl;
+        exit(0);
+    }
+    std::free(buffer_);
+    capacity_ = (bytes + 63) / 64 * 64;
+    buffer_ = static_cast<char*>(std::aligned_alloc(64, capacity_));
+    if (buffer_ == nullptr) {
+        std::cerr << "workspace error: out of memory!" << std::endl;
+        exit(0);
+    }
+}
+
+
+inline void Workspace::reset() {
+    used_ = 0;
+}
+
+
+inline size_t Workspace::get_mark() const {
+    return used_;
+}
+
+
+// give back everything handed out after mark
+inline void Workspace::release(size_t mark) {
+    used_ = mark;
+}
+
+
+MyMatrix Workspace::matrix(int col_wid, int row_wid, bool zero) {
+    size_t bytes = matrix_bytes(col_wid, row_wid);
+    if (used_ + bytes > capacity_) {
+        std::cerr << "workspace error: out of space, reserve more!" << std::endl;
+        exit(0);
+    }
+    float *data = reinterpret_cast<float*>(buffer_ + used_);
+    used_ += bytes;
+    peak_ = std::max(peak_, used_);
+    if (zero)
+        std::memset(data, 0, bytes);
+    return MyMatrix(col_wid, row_wid, MyMatrix::padded_width(row_wid), data);
+}
+
+
+// the batch structure of a forward pass that was not given one
+inline BatchedGraph& Workspace::get_graph() {
+    return graph_;
+}
+
+
+inline size_t Workspace::get_capacity() const {
+    return capacity_;
+}
+
+
+inline size_t Workspace::get_peak() const {
+    return peak_;
+}
+
+
+inline size_t Workspace::restart_peak() {
+    size_t peak = peak_;
+    peak_ = used_;
+    return peak;
+}
+
+
+inline void Workspace::merge_peak(size_t peak) {
+    peak_ = std::max(peak_, peak);
+}
+
+#endif
@@ -0,0 +1,323 @@
+#ifndef PIPELINE_HH
+#define PIPELINE_HH
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <atomic>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "models/graphcnn.hh"
+#include "models/workspace.hh"
+#include "models/bounded_queue.hh"
+#include "graph_arena.hh"
+#include "batch_plan.hh"
+#include "util.hh"
+
+// the graphs of a text dataset one at a time, in file order. labels and
+// tags are numbered by first appearance like loadGraphArena (the numbering
+// never changes once given, so it does not need the whole file), the
+// edges are made symmetric and deduplicated the same way. next() parses a
+// graph into reused buffers, append() copies it into an arena
+class GraphStream {
+private:
+    char *image_;
+    size_t size_;
+    const char *p_, *end_;
+    int graph_sum_, next_graph_;
+    std::unordered_map<int, int> label_dict_, tag_dict_;
+    int label_, node_sum_;
+    std::vector<int> tags_, adj_offsets_, neighbors_;
+    std::vector<int> src_, dst_;
+
+public:
+    GraphStream();
+    GraphStream(const GraphStream&) = delete;
+    GraphStream& operator=(const GraphStream&) = delete;
+    ~GraphStream();
+    void open(const std::string &dataset);
+    bool next();
+    void append(GraphArena &arena) const;
+
+    int get_graph_sum() const;
+    int get_label() const;
+    int get_node_sum() const;
+    int get_edge_sum() const;
+};
+
+
+GraphStream::GraphStream() {
+    image_ = nullptr;
+    size_ = 0;
+    p_ = end_ = nullptr;
+    graph_sum_ = next_graph_ = 0;
+}
+
+
+GraphStream::~GraphStream() {
+    if (image_ != nullptr)
+        munmap(image_, size_);
+}
+
+
+// the file is mapped, its pages are read as the parser reaches them
+void GraphStream::open(const std::string &dataset) {
+    std::string path = "dataset/" + dataset + "/" + dataset + ".txt";
+    int fd = ::open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        std::cerr << "data error: can not read " << path << "!" << std::endl;
+        exit(0);
+    }
+    void *image = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        std::cerr << "data error: can not map " << path << "!" << std::endl;
+        exit(0);
+    }
+    madvise(image, st.st_size, MADV_SEQUENTIAL);
+    image_ = static_cast<char*>(image);
+    size_ = st.st_size;
+    p_ = image_;
+    end_ = image_ + size_;
+    if (!scan_int(p_, end_, graph_sum_) || graph_sum_ < 0) {
+        std::cerr << "data error: broken header in " << path << "!" << std::endl;
+        exit(0);
+    }
+    skip_line(p_, end_);
+    next_graph_ = 0;
+}
+
+
+// false after the last graph
+bool GraphStream::next() {
+    if (next_graph_ == graph_sum_)
+        return false;
+    int n, raw_label;
+    if (!scan_int(p_, end_, n) || !scan_int(p_, end_, raw_label) || n < 0) {
+        std::cerr << "data error: broken graph " << next_graph_ << "!" << std::endl;
+        exit(0);
+    }
+    skip_line(p_, end_);
+    label_ = label_dict_.emplace(raw_label, label_dict_.size()).first->second;
+    node_sum_ = n;
+    tags_.resize(n);
+    src_.clear();
+    dst_.clear();
+    for (int j = 0; j < n; ++j) {
+        int raw_tag, degree, k;
+        if (!scan_int(p_, end_, raw_tag) || !scan_int(p_, end_, degree)) {
+            std::cerr << "data error: broken node in graph " << next_graph_ << "!" << std::endl;
+            exit(0);
+        }
+        tags_[j] = tag_dict_.emplace(raw_tag, tag_dict_.size()).first->second;
+        for (int e = 0; e < degree; ++e) {
+            if (!scan_int(p_, end_, k) || k < 0 || k >= n) {
+                std::cerr << "data error: broken edge in graph " << next_graph_ << "!" << std::endl;
+                exit(0);
+            }
+            src_.push_back(j);
+            dst_.push_back(k);
+            src_.push_back(k);
+            dst_.push_back(j);
+        }
+        skip_line(p_, end_);
+    }
+    // bucket the edges by their first node, then sort and deduplicate
+    adj_offsets_.assign(n + 1, 0);
+    for (auto j : src_)
+        adj_offsets_[j+1]++;
+    for (int j = 0; j < n; ++j)
+        adj_offsets_[j+1] += adj_offsets_[j];
+    neighbors_.resize(dst_.size());
+    for (size_t e = 0; e < src_.size(); ++e)
+        neighbors_[adj_offsets_[src_[e]]++] = dst_[e];
+    int out = 0;
+    for (int j = 0, b = 0; j < n; ++j) {
+        int e = adj_offsets_[j];
+        std::sort(neighbors_.begin() + b, neighbors_.begin() + e);
+        int degree = std::unique(neighbors_.begin() + b, neighbors_.begin() + e) - neighbors_.begin() - b;
+        std::copy(neighbors_.begin() + b, neighbors_.begin() + b + degree, neighbors_.begin() + out);
+        adj_offsets_[j] = out;
+        out += degree;
+        b = e;
+    }
+    adj_offsets_[n] = out;
+    ++next_graph_;
+    return true;
+}
+
+
+inline void GraphStream::append(GraphArena &arena) const {
+    arena.append(label_, node_sum_, tags_.data(), adj_offsets_.data(), neighbors_.data());
+}
+
+
+inline int GraphStream::get_graph_sum() const {
+    return graph_sum_;
+}
+
+
+inline int GraphStream::get_label() const {
+    return label_;
+}
+
+
+inline int GraphStream::get_node_sum() const {
+    return node_sum_;
+}
+
+
+inline int GraphStream::get_edge_sum() const {
+    return adj_offsets_[node_sum_];
+}
+
+
+struct PipelineStats {
+    int batch_sum;
+    double first_seconds, seconds;
+};
+
+// one batch on its way through the pipeline, the slots are recycled so
+// their buffers stop growing after the largest batch
+struct PipelineBatch {
+    int first_graph;
+    GraphArena arena;
+    std::vector<int> graphs;
+    BatchedGraph graph;
+};
+
+// the whole dataset through three stages that overlap:
+//   parser     streams the graphs of the file and packs them into batches
+//              (the budget of BatchPlan in file order, sort_by_size has no
+//              meaning here)
+//   builder    prepares the BatchedGraph of each batch
+//   compute    workers threads run forward on the prepared batches
+// the stages hand the batches over through bounded lock-free queues, at
+// most queue_depth batches wait between two stages, and a slot goes back
+// to the parser once its batch is predicted. pred and labels are indexed
+// by graph; first_seconds is the time to the first finished batch
+void run_pipeline(
+    const GraphCNN &model, const std::string &dataset, const BatchBudget &budget,
+    int workers, int queue_depth, std::vector<int> &pred, std::vector<int> &labels,
+    PipelineStats &stats
+) {
+    auto begin = std::chrono::steady_clock::now();
+    GraphStream stream;
+    stream.open(dataset);
+    int graph_sum = stream.get_graph_sum(), slot_sum = 2 * queue_depth + workers;
+    pred.assign(graph_sum, 0);
+    labels.assign(graph_sum, 0);
+    size_t capacity = 2;
+    while (capacity < slot_sum)
+        capacity *= 2;
+    BoundedQueue<PipelineBatch*> free_slots(capacity), parsed(capacity), ready(capacity);
+    std::vector<std::unique_ptr<PipelineBatch>> slots(slot_sum);
+    for (auto &slot : slots) {
+        slot.reset(new PipelineBatch);
+        free_slots.push(slot.get());
+    }
+    // the queues hold at most queue_depth batches: a stage takes a slot
+    // only when the next stage is behind by less than that
+    std::atomic<int> in_parsed(0), in_ready(0), batch_sum(0);
+    std::atomic<bool> first_done(false);
+    double first_seconds = 0;
+    auto elapsed = [&]() {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    };
+    auto wait_below = [&](std::atomic<int> &count) {
+        while (count.load(std::memory_order_acquire) >= queue_depth)
+            std::this_thread::yield();
+    };
+
+    std::thread parser([&]() {
+        bool has_graph = stream.next();
+        int g = 0;
+        while (has_graph) {
+            PipelineBatch *batch;
+            free_slots.pop(batch);
+            batch->first_graph = g;
+            batch->arena.clear();
+            batch->arena.set_tag_sum(model.get_input_dim());
+            batch->graphs.clear();
+            int nodes = 0, edges = 0;
+            while (has_graph) {
+                int size = batch->graphs.size();
+                bool full = size > 0 && (
+                    (budget.max_graphs > 0 && size + 1 > budget.max_graphs) ||
+                    (budget.max_nodes > 0 && nodes + stream.get_node_sum() > budget.max_nodes) ||
+                    (budget.max_edges > 0 && edges + stream.get_edge_sum() > budget.max_edges)
+                );
+                if (full)
+                    break;
+                nodes += stream.get_node_sum();
+                edges += stream.get_edge_sum();
+                labels[g++] = stream.get_label();
+                stream.append(batch->arena);
+                batch->graphs.push_back(size);
+                has_graph = stream.next();
+            }
+            wait_below(in_parsed);
+            in_parsed++;
+            parsed.push(batch);
+        }
+        parsed.close();
+    });
+
+    std::thread builder([&]() {
+        PipelineBatch *batch;
+        while (parsed.pop(batch)) {
+            in_parsed--;
+            model.prepare(batch->arena, batch->graphs, batch->graph);
+            wait_below(in_ready);
+            in_ready++;
+            ready.push(batch);
+        }
+        ready.close();
+    });
+
+    std::vector<std::thread> computes;
+    for (int w = 0; w < workers; ++w) {
+        computes.emplace_back([&]() {
+            Workspace ws;
+            PipelineBatch *batch;
+            int dim = model.get_output_dim();
+            while (ready.pop(batch)) {
+                in_ready--;
+                const BatchedGraph &graph = batch->graph;
+                int size = graph.get_graph_sum();
+                ws.reserve(
+                    Workspace::matrix_bytes(size, dim) +
+                    model.get_workspace_size(graph.get_node_sum(), graph.get_tag_sum())
+                );
+                MyMatrix output = ws.matrix(size, dim, true);
+                model.forward(graph, output, ws);
+                for (int j = 0; j < size; ++j)
+                    pred[batch->first_graph + j] = output.get_max_idx(1, j);
+                ws.reset();
+                batch_sum++;
+                if (!first_done.exchange(true))
+                    first_seconds = elapsed();
+                free_slots.push(batch);
+            }
+        });
+    }
+    parser.join();
+    builder.join();
+    for (auto &t : computes)
+        t.join();
+    stats.batch_sum = batch_sum;
+    stats.first_seconds = first_seconds;
+    stats.seconds = elapsed();
+}
+
+#endif
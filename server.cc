@@ -0,0 +1,334 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
+#include <limits>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "models/graphcnn.hh"
+#include "models/thread_pool.hh"
+#include "models/workspace.hh"
+#include "graph_arena.hh"
+#include "util.hh"
+
+// resident inference server on stdin/stdout. the model is loaded once and
+// every request is one graph in the per-graph format of dataset/*.txt:
+//     n label                    (the label is read and ignored)
+//     tag degree neighbor...     (n node lines)
+// the raw tags are numbered like the training dataset given on the command
+// line. a reader thread parses the requests as they come, the main thread
+// takes every request waiting, up to --batch-graphs graphs and
+// --batch-nodes nodes, and runs them as one forward batch. while the batch
+// is not full it waits for more, but never longer than --max-delay-ms after
+// the oldest request arrived. one line per request, in request order:
+//     seq class logit...         (class is the raw label of the dataset)
+//     seq error message
+// at the end of the input the latency percentiles and the throughput are
+// printed on stderr
+// usage: ./server <model> <dataset> [--max-delay-ms D] [--batch-graphs N]
+//        [--batch-nodes N] [--threads N]
+
+typedef std::chrono::steady_clock Clock;
+
+struct Request {
+    int seq;
+    Clock::time_point arrival;
+    std::string error;
+    // the graph, neighbors in CSR like a GraphArena
+    int node_sum;
+    std::vector<int> tags, adj_offsets, neighbors;
+};
+
+
+class RequestQueue {
+private:
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<std::unique_ptr<Request>> requests_;
+    bool closed_;
+
+public:
+    RequestQueue();
+    void push(std::unique_ptr<Request> request);
+    void close();
+    // wait for a first request, then keep taking requests until the budget
+    // is full or deadline (max_delay after the first arrival) has passed.
+    // false once the queue is closed and empty
+    bool pop_batch(
+        int max_graphs, int max_nodes, Clock::duration max_delay,
+        std::vector<std::unique_ptr<Request>> &batch
+    );
+};
+
+
+RequestQueue::RequestQueue() {
+    closed_ = false;
+}
+
+
+void RequestQueue::push(std::unique_ptr<Request> request) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        requests_.push_back(std::move(request));
+    }
+    ready_.notify_one();
+}
+
+
+void RequestQueue::close() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+    }
+    ready_.notify_one();
+}
+
+
+bool RequestQueue::pop_batch(
+    int max_graphs, int max_nodes, Clock::duration max_delay,
+    std::vector<std::unique_ptr<Request>> &batch
+) {
+    batch.clear();
+    std::unique_lock<std::mutex> lock(mutex_);
+    ready_.wait(lock, [&]() { return !requests_.empty() || closed_; });
+    if (requests_.empty())
+        return false;
+    Clock::time_point deadline = requests_.front()->arrival + max_delay;
+    int node_sum = 0;
+    while (true) {
+        // a graph alone over the node budget still runs, as its own batch
+        while (
+            !requests_.empty() && int(batch.size()) < max_graphs && (
+                batch.empty() || max_nodes <= 0 ||
+                node_sum + requests_.front()->node_sum <= max_nodes
+            )
+        ) {
+            node_sum += requests_.front()->node_sum;
+            batch.push_back(std::move(requests_.front()));
+            requests_.pop_front();
+        }
+        bool full = int(batch.size()) == max_graphs || !requests_.empty();
+        if (full || closed_)
+            break;
+        if (!ready_.wait_until(lock, deadline, [&]() { return !requests_.empty() || closed_; }))
+            break;
+    }
+    return true;
+}
+
+
+// a graph larger than this is refused
+const int MAX_REQUEST_NODES = 1 << 20;
+
+// read one request, false at the end of the input. the edges are made
+// symmetric and deduplicated like in loadGraphArena. a graph of more than
+// MAX_REQUEST_NODES nodes is refused from its header, its node lines are
+// skipped without being stored so that the next request starts at a header
+bool read_request(
+    std::istream &in, const std::unordered_map<int, int> &tag_dict, Request &request
+) {
+    std::string line;
+    do {
+        if (!std::getline(in, line))
+            return false;
+    } while (line.find_first_not_of(" \t\r") == std::string::npos);
+    request.arrival = Clock::now();
+    const char *p = line.data(), *end = p + line.size();
+    int n, label;
+    if (!scan_int(p, end, n) || !scan_int(p, end, label) || n <= 0) {
+        request.error = "broken graph header";
+        request.node_sum = 0;
+        return true;
+    }
+    if (n > MAX_REQUEST_NODES) {
+        request.error = "graph of " + std::to_string(n) + " nodes over the limit of "
+            + std::to_string(MAX_REQUEST_NODES);
+        request.node_sum = 0;
+        for (int v = 0; v < n && in; ++v)
+            in.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        return true;
+    }
+    request.node_sum = n;
+    request.tags.assign(n, 0);
+    std::vector<std::vector<int>> adjacency(n);
+    for (int v = 0; v < n; ++v) {
+        if (!std::getline(in, line)) {
+            request.error = "missing node lines";
+            return true;
+        }
+        p = line.data();
+        end = p + line.size();
+        int tag, degree, u;
+        if (!scan_int(p, end, tag) || !scan_int(p, end, degree)) {
+            request.error = "broken node line";
+            continue;
+        }
+        auto it = tag_dict.find(tag);
+        if (it == tag_dict.end())
+            request.error = "unknown node tag " + std::to_string(tag);
+        else
+            request.tags[v] = it->second;
+        for (int e = 0; e < degree; ++e) {
+            if (!scan_int(p, end, u) || u < 0 || u >= n) {
+                request.error = "broken edge";
+                break;
+            }
+            adjacency[v].push_back(u);
+            adjacency[u].push_back(v);
+        }
+    }
+    request.adj_offsets.assign(1, 0);
+    request.neighbors.clear();
+    for (auto &neighbors : adjacency) {
+        std::sort(neighbors.begin(), neighbors.end());
+        neighbors.erase(std::unique(neighbors.begin(), neighbors.end()), neighbors.end());
+        request.neighbors.insert(request.neighbors.end(), neighbors.begin(), neighbors.end());
+        request.adj_offsets.push_back(request.neighbors.size());
+    }
+    return true;
+}
+
+
+void usage(const char *name) {
+    std::cerr << "usage: " << name << " <model> <dataset> [--max-delay-ms D]"
+              << " [--batch-graphs N] [--batch-nodes N] [--threads N]" << std::endl;
+    exit(0);
+}
+
+
+int main(int argc, char** argv) {
+    if (argc < 3)
+        usage(argv[0]);
+    double max_delay_ms = 2;
+    int max_graphs = 64, max_nodes = 4096, num_threads = 1;
+    for (int i = 3; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (arg == "--max-delay-ms" && i+1 < argc)
+            max_delay_ms = std::max(0.0, std::stod(argv[++i]));
+        else if (arg == "--batch-graphs" && i+1 < argc)
+            max_graphs = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--batch-nodes" && i+1 < argc)
+            max_nodes = std::max(0, std::stoi(argv[++i]));
+        else if (arg == "--threads" && i+1 < argc)
+            num_threads = std::max(1, std::stoi(argv[++i]));
+        else
+            usage(argv[0]);
+    }
+
+    // stdout only carries the responses
+    std::string model_path(argv[1]), dataset(argv[2]);
+    std::unique_ptr<GraphCNN> model;
+    if (ModelFile::is_binary(model_path)) {
+        model.reset(new GraphCNN(model_path, false, "sum", "sum"));
+    } else {
+        std::map<std::string, std::vector<std::vector<float>> > model_data;
+        load_model_data(model_path, model_data);
+        model.reset(new GraphCNN(model_data, false, "sum", "sum"));
+    }
+    std::unordered_map<int, int> label_dict, tag_dict;
+    load_dataset_dicts(dataset, label_dict, tag_dict);
+    if (tag_dict.size() != model->get_input_dim()) {
+        std::cerr << "error: " << dataset << " has " << tag_dict.size()
+                  << " node tags, the model takes " << model->get_input_dim() << "!" << std::endl;
+        exit(0);
+    }
+    std::vector<int> raw_labels(std::max(label_dict.size(), size_t(model->get_output_dim())), -1);
+    for (const auto &p : label_dict)
+        if (p.second < raw_labels.size())
+            raw_labels[p.second] = p.first;
+    std::unique_ptr<ThreadPool> pool;
+    if (num_threads > 1) {
+        pool.reset(new ThreadPool(num_threads - 1));
+        ThreadPool::set_shared(pool.get());
+    }
+    std::cerr << "server ready: " << model_path << ", tags of " << dataset << std::endl;
+
+    RequestQueue queue;
+    std::thread reader([&]() {
+        for (int seq = 0; ; ++seq) {
+            std::unique_ptr<Request> request(new Request);
+            request->seq = seq;
+            if (!read_request(std::cin, tag_dict, *request))
+                break;
+            queue.push(std::move(request));
+        }
+        queue.close();
+    });
+
+    Clock::duration max_delay = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double, std::milli>(max_delay_ms)
+    );
+    std::vector<std::unique_ptr<Request>> batch;
+    std::vector<int> graphs;
+    std::vector<double> latencies;
+    GraphArena arena;
+    Workspace ws;
+    int batch_sum = 0, dim = model->get_output_dim();
+    Clock::time_point first_arrival, last_reply;
+    std::ostringstream out;
+    while (queue.pop_batch(max_graphs, max_nodes, max_delay, batch)) {
+        if (batch_sum++ == 0)
+            first_arrival = batch.front()->arrival;
+        arena.clear();
+        arena.set_tag_sum(tag_dict.size());
+        graphs.clear();
+        int node_sum = 0;
+        for (auto &r : batch) {
+            if (!r->error.empty())
+                continue;
+            graphs.push_back(arena.get_graph_sum());
+            arena.append(0, r->node_sum, r->tags.data(), r->adj_offsets.data(), r->neighbors.data());
+            node_sum += r->node_sum;
+        }
+        ws.reserve(
+            Workspace::matrix_bytes(graphs.size(), dim) +
+            model->get_workspace_size(node_sum, arena.get_tag_sum())
+        );
+        MyMatrix output = ws.matrix(graphs.size(), dim, true);
+        if (!graphs.empty())
+            model->forward(arena, graphs, output, ws);
+        out.str("");
+        for (int i = 0, g = 0; i < batch.size(); ++i) {
+            out << batch[i]->seq;
+            if (!batch[i]->error.empty()) {
+                out << " error " << batch[i]->error << "\n";
+                continue;
+            }
+            out << " " << raw_labels[output.get_max_idx(1, g)];
+            for (int k = 0; k < dim; ++k)
+                out << " " << output.get_value(g, k);
+            out << "\n";
+            ++g;
+        }
+        ws.reset();
+        std::cout << out.str() << std::flush;
+        last_reply = Clock::now();
+        for (auto &r : batch)
+            latencies.push_back(std::chrono::duration<double, std::milli>(last_reply - r->arrival).count());
+    }
+    reader.join();
+    ThreadPool::set_shared(nullptr);
+
+    if (latencies.empty())
+        return 0;
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double q) {
+        return latencies[std::min(latencies.size() - 1, size_t(q * latencies.size()))];
+    };
+    double seconds = std::chrono::duration<double>(last_reply - first_arrival).count();
+    std::cerr << "requests: " << latencies.size() << " in " << batch_sum << " batches ("
+              << double(latencies.size()) / batch_sum << " graphs per batch)" << std::endl;
+    std::cerr << "latency: p50 " << percentile(0.5) << " ms, p99 " << percentile(0.99)
+              << " ms, max " << latencies.back() << " ms" << std::endl;
+    std::cerr << "throughput: " << latencies.size() / std::max(seconds, 1e-9)
+              << " graphs/s" << std::endl;
+    return 0;
+}
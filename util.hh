@@ -6,9 +6,55 @@
 #include <sstream>
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <random>
+#include <memory>
+#include <cstring>
+#include <algorithm>
+#include <iterator>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "s2vgraph.hh"
+#include "graph_arena.hh"
+#include "models/thread_pool.hh"
+#include "models/gemm_int8.hh"
+
+
+// read a text model: for every tensor a line with its name, a line with
+// the dimension and the size, then one line per row
+void load_model_data(const std::string &path, std::map<std::string, std::vector<std::vector<float>> > &data) {
+    std::ifstream get_data(path);
+    std::string str;
+    int dim, row, col;
+    while (std::getline(get_data, str)) {
+        std::string name(str);
+        data[name] = std::vector<std::vector<float>>();
+        std::getline(get_data, str);
+        std::stringstream data_size(str);
+        data_size >> dim;
+        if (dim == 1) {
+            data_size >> col;
+            row = 1;
+        } else {
+            data_size >> row >> col;
+        }
+        for (int i = 0; i < row; ++i) {
+            std::getline(get_data, str);
+            data[name].push_back(std::vector<float>());
+            std::stringstream data_val(str);
+            float val;
+            for (int j = 0; j < col; ++j) {
+                data_val >> val;
+                data[name][i].push_back(val);
+            }
+        }
+    }
+    get_data.close();
+}
 
 
 void loadData(
@@ -97,6 +143,355 @@ void loadData(
 }
 
 
+// read the next integer at or after p, p is left behind it. only spaces
+// and tabs are skipped, so a number is never taken from the next line
+inline bool scan_int(const char *&p, const char *end, int &value) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+        ++p;
+    bool negative = p < end && *p == '-';
+    if (negative)
+        ++p;
+    if (p == end || *p < '0' || *p > '9')
+        return false;
+    int v = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+        v = v * 10 + (*p++ - '0');
+    value = negative ? -v : v;
+    return true;
+}
+
+
+inline void skip_line(const char *&p, const char *end) {
+    const char *eol = static_cast<const char*>(std::memchr(p, '\n', end - p));
+    p = eol == nullptr ? end : eol + 1;
+}
+
+
+// 64 bit FNV-1a
+inline uint64_t hash_bytes(const char *data, size_t size) {
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < size; ++i)
+        h = (h ^ uint8_t(data[i])) * 1099511628211ull;
+    return h;
+}
+
+
+void print_arena_info(const GraphArena &arena) {
+    std::cout << "# classes: " << arena.get_label_sum() << std::endl;
+    std::cout << "# maximum node tag: " << arena.get_tag_sum() << std::endl;
+    std::cout << "# graphs number: " << arena.get_graph_sum() << std::endl;
+}
+
+
+// map cache_path into arena if it was built from the text file data of
+// stat st as it is now: same size and mtime, or same content when only the
+// mtime changed (the cache then takes the new mtime). source is set to the
+// key of the text file either way
+bool open_dataset_cache(
+    const std::string &cache_path, const char *data, const struct stat &st,
+    bool degree_as_tag, GraphArena &arena, DatasetSource &source
+) {
+    std::memset(&source, 0, sizeof(source));
+    source.size = st.st_size;
+    source.mtime = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    source.degree_as_tag = degree_as_tag;
+    DatasetSource cached;
+    if (
+        arena.open_cache(cache_path, cached) &&
+        cached.size == source.size && cached.degree_as_tag == source.degree_as_tag && (
+            cached.mtime == source.mtime || cached.hash == hash_bytes(data, st.st_size)
+        )
+    ) {
+        source.hash = cached.hash;
+        // same content under a new mtime, remember the new one
+        if (cached.mtime != source.mtime)
+            arena.save_cache(cache_path, source);
+        return true;
+    }
+    source.hash = hash_bytes(data, st.st_size);
+    return false;
+}
+
+
+// same dataset, labels and tags as loadData, but into a GraphArena and
+// much faster: the file is mapped and scanned without streams, one
+// sequential pass finds where every graph starts, then the graphs are
+// parsed on num_threads threads straight into the flat arrays.
+// with use_cache the result is kept in dataset/X/X.cache (X.degree.cache
+// with degree_as_tag) and later runs map that file instead, as long as the
+// text file keeps its size and its mtime (or its content, when only the
+// mtime changed)
+void loadGraphArena(
+    const std::string& dataset, bool degree_as_tag, GraphArena &arena,
+    int num_threads, bool use_cache
+) {
+    std::cout << "Loading data..." << std::endl;
+
+    std::string path = "dataset/" + dataset + "/" + dataset + ".txt";
+    std::string cache_path = "dataset/" + dataset + "/" + dataset + (degree_as_tag ? ".degree.cache" : ".cache");
+    int fd = ::open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        std::cerr << "data error: can not read " << path << "!" << std::endl;
+        exit(0);
+    }
+    void *image = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        std::cerr << "data error: can not map " << path << "!" << std::endl;
+        exit(0);
+    }
+    const char *data = static_cast<const char*>(image), *end = data + st.st_size;
+
+    DatasetSource source;
+    if (use_cache && open_dataset_cache(cache_path, data, st, degree_as_tag, arena, source)) {
+        munmap(image, st.st_size);
+        std::cout << "# cached in " << cache_path << std::endl;
+        print_arena_info(arena);
+        return;
+    }
+
+    // find the graphs: a line "n label" followed by n node lines
+    const char *p = data;
+    int graphs_num;
+    if (!scan_int(p, end, graphs_num) || graphs_num < 0) {
+        std::cerr << "data error: broken header in " << path << "!" << std::endl;
+        exit(0);
+    }
+    skip_line(p, end);
+    arena.clear();
+    std::vector<const char*> starts(graphs_num);
+    std::vector<int> raw_labels(graphs_num);
+    for (int i = 0; i < graphs_num; ++i) {
+        int n;
+        starts[i] = p;
+        if (!scan_int(p, end, n) || !scan_int(p, end, raw_labels[i]) || n < 0) {
+            std::cerr << "data error: broken graph " << i << " in " << path << "!" << std::endl;
+            exit(0);
+        }
+        skip_line(p, end);
+        for (int j = 0; j < n; ++j)
+            skip_line(p, end);
+        arena.node_offsets_data_.push_back(arena.node_offsets_data_.back() + n);
+    }
+    int node_sum = arena.node_offsets_data_.back();
+    arena.tags_data_.resize(node_sum);
+    arena.adj_offsets_data_.assign(node_sum + 1, 0);
+    arena.max_degrees_data_.resize(graphs_num);
+
+    // parse the node lines, a chunk of graphs per task. the edges are
+    // made symmetric and deduplicated like the neighbor sets of loadData
+    int chunk_num = std::max(1, std::min(graphs_num, num_threads * 4));
+    std::vector<std::vector<int>> chunk_neighbors(chunk_num);
+    auto parse_chunk = [&](int c) {
+        // every edge in both directions, bucketed by its first node
+        std::vector<int> src, dst, count, bucket;
+        std::vector<int> &neighbors = chunk_neighbors[c];
+        for (int g = c * graphs_num / chunk_num; g < (c+1) * graphs_num / chunk_num; ++g) {
+            const char *q = starts[g];
+            skip_line(q, end);
+            int begin = arena.node_offsets_data_[g], n = arena.node_offsets_data_[g+1] - begin;
+            src.clear();
+            dst.clear();
+            for (int j = 0; j < n; ++j) {
+                int degree, k;
+                if (!scan_int(q, end, arena.tags_data_[begin+j]) || !scan_int(q, end, degree)) {
+                    std::cerr << "data error: broken node in graph " << g << "!" << std::endl;
+                    exit(0);
+                }
+                for (int e = 0; e < degree; ++e) {
+                    if (!scan_int(q, end, k) || k < 0 || k >= n) {
+                        std::cerr << "data error: broken edge in graph " << g << "!" << std::endl;
+                        exit(0);
+                    }
+                    src.push_back(j);
+                    dst.push_back(k);
+                    src.push_back(k);
+                    dst.push_back(j);
+                }
+                skip_line(q, end);
+            }
+            count.assign(n + 1, 0);
+            for (auto j : src)
+                count[j+1]++;
+            for (int j = 0; j < n; ++j)
+                count[j+1] += count[j];
+            bucket.resize(dst.size());
+            for (int e = 0; e < src.size(); ++e)
+                bucket[count[src[e]]++] = dst[e];
+            // count[j] is now the end of bucket j, sort and deduplicate it
+            int max_degree = 0;
+            for (int j = 0, b = 0; j < n; b = count[j++]) {
+                std::sort(bucket.begin() + b, bucket.begin() + count[j]);
+                int degree = std::unique(bucket.begin() + b, bucket.begin() + count[j]) - bucket.begin() - b;
+                neighbors.insert(neighbors.end(), bucket.begin() + b, bucket.begin() + b + degree);
+                arena.adj_offsets_data_[begin + j + 1] = degree;
+                max_degree = std::max(max_degree, degree);
+            }
+            arena.max_degrees_data_[g] = max_degree;
+        }
+    };
+    if (num_threads > 1) {
+        ThreadPool pool(num_threads);
+        for (int c = 0; c < chunk_num; ++c)
+            pool.submit([&, c]() { parse_chunk(c); });
+        pool.wait();
+    } else {
+        for (int c = 0; c < chunk_num; ++c)
+            parse_chunk(c);
+    }
+
+    // the chunks are in graph order, so are their neighbors
+    for (int v = 0; v < node_sum; ++v)
+        arena.adj_offsets_data_[v+1] += arena.adj_offsets_data_[v];
+    arena.neighbors_data_.reserve(arena.adj_offsets_data_[node_sum]);
+    for (const auto &neighbors : chunk_neighbors)
+        arena.neighbors_data_.insert(arena.neighbors_data_.end(), neighbors.begin(), neighbors.end());
+
+    // labels and tags are numbered in order of first appearance, then the
+    // tags that occur are renumbered in increasing order. the first
+    // appearance numbers are already 0..k-1, only degrees need renumbering
+    std::unordered_map<int, int> label_dict, feat_dict;
+    for (int i = 0; i < graphs_num; ++i) {
+        auto it = label_dict.emplace(raw_labels[i], label_dict.size());
+        if (it.second)
+            arena.raw_labels_data_.push_back(raw_labels[i]);
+        arena.labels_data_.push_back(it.first->second);
+    }
+    if (degree_as_tag) {
+        int max_degree = 0;
+        for (auto d : arena.max_degrees_data_)
+            max_degree = std::max(max_degree, d);
+        std::vector<int> tag2idx(max_degree + 1, 0);
+        for (int v = 0; v < node_sum; ++v) {
+            arena.tags_data_[v] = arena.adj_offsets_data_[v+1] - arena.adj_offsets_data_[v];
+            tag2idx[arena.tags_data_[v]] = 1;
+        }
+        int cnt = 0;
+        for (int d = 0; d <= max_degree; ++d) {
+            if (tag2idx[d])
+                arena.raw_tags_data_.push_back(d);
+            tag2idx[d] = tag2idx[d] ? cnt++ : -1;
+        }
+        for (auto &t : arena.tags_data_)
+            t = tag2idx[t];
+        arena.tag_sum_ = cnt;
+    } else {
+        int last_raw = 0, last_tag = -1;
+        for (auto &t : arena.tags_data_) {
+            if (last_tag < 0 || t != last_raw) {
+                last_raw = t;
+                auto it = feat_dict.emplace(t, feat_dict.size());
+                if (it.second)
+                    arena.raw_tags_data_.push_back(t);
+                last_tag = it.first->second;
+            }
+            t = last_tag;
+        }
+        arena.tag_sum_ = feat_dict.size();
+    }
+    arena.label_sum_ = label_dict.size();
+    arena.use_data();
+
+    if (use_cache && !arena.save_cache(cache_path, source))
+        std::cerr << "data warning: can not write " << cache_path << "!" << std::endl;
+    munmap(image, st.st_size);
+    print_arena_info(arena);
+}
+
+
+// the numbering loadGraphArena gives to the raw labels and node tags of a
+// text dataset (in order of first appearance), to number new graphs the
+// same way. they are read from dataset/X/X.cache when it matches the text
+// file, else the text file is scanned for them
+void load_dataset_dicts(
+    const std::string& dataset,
+    std::unordered_map<int, int> &label_dict, std::unordered_map<int, int> &tag_dict
+) {
+    std::string path = "dataset/" + dataset + "/" + dataset + ".txt";
+    std::string cache_path = "dataset/" + dataset + "/" + dataset + ".cache";
+    int fd = ::open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        std::cerr << "data error: can not read " << path << "!" << std::endl;
+        exit(0);
+    }
+    void *image = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        std::cerr << "data error: can not map " << path << "!" << std::endl;
+        exit(0);
+    }
+    const char *p = static_cast<const char*>(image), *end = p + st.st_size;
+    label_dict.clear();
+    tag_dict.clear();
+
+    GraphArena arena;
+    DatasetSource source;
+    if (
+        open_dataset_cache(cache_path, p, st, false, arena, source) &&
+        arena.get_raw_label_sum() == arena.get_label_sum() &&
+        arena.get_raw_tag_sum() == arena.get_tag_sum()
+    ) {
+        for (int l = 0; l < arena.get_raw_label_sum(); ++l)
+            label_dict.emplace(arena.get_raw_label(l), l);
+        for (int t = 0; t < arena.get_raw_tag_sum(); ++t)
+            tag_dict.emplace(arena.get_raw_tag(t), t);
+        munmap(image, st.st_size);
+        return;
+    }
+
+    int graphs_num;
+    if (!scan_int(p, end, graphs_num)) {
+        std::cerr << "data error: can not read " << path << "!" << std::endl;
+        exit(0);
+    }
+    skip_line(p, end);
+    for (int i = 0; i < graphs_num; ++i) {
+        int n, label, tag;
+        if (!scan_int(p, end, n) || !scan_int(p, end, label)) {
+            std::cerr << "data error: broken graph " << i << " in " << path << "!" << std::endl;
+            exit(0);
+        }
+        label_dict.emplace(label, label_dict.size());
+        skip_line(p, end);
+        for (int j = 0; j < n; ++j) {
+            if (scan_int(p, end, tag))
+                tag_dict.emplace(tag, tag_dict.size());
+            skip_line(p, end);
+        }
+    }
+    munmap(image, st.st_size);
+}
+
+
+// int8 calibration ranges, one line per linear: name min max
+void save_quant_ranges(const std::string &path, const std::map<std::string, QuantRange> &ranges) {
+    std::ofstream out(path);
+    out.precision(9);
+    for (const auto &p : ranges)
+        out << p.first << " " << p.second.min << " " << p.second.max << "\n";
+    if (!out) {
+        std::cerr << "error: can not write " << path << "!" << std::endl;
+        exit(0);
+    }
+}
+
+
+void load_quant_ranges(const std::string &path, std::map<std::string, QuantRange> &ranges) {
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "error: can not open " << path << "!" << std::endl;
+        exit(0);
+    }
+    ranges.clear();
+    std::string name;
+    QuantRange range;
+    while (in >> name >> range.min >> range.max)
+        ranges[name] = range;
+}
+
+
 // according to k-fold cross validation
 // choose random data for test_graph_list
 void separateData(